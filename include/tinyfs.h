@@ -3,19 +3,57 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /* Constants */
-#define BLOCK_SIZE 256
-#define MAX_BLOCKS 1024
+#define DEFAULT_BLOCK_SIZE 256
+#define MIN_BLOCK_SIZE 256          /* Block sizes are powers of two in this range */
+#define MAX_BLOCK_SIZE 65536
+#define DISK_CHUNK_SIZE (2u * 1024 * 1024) /* RAM disk memory is mapped in chunks of this size */
+#define HUGE_PAGE_SIZE (2u * 1024 * 1024)
 #define MAX_FILENAME_LEN 32
 #define MAX_PATH_LEN 256
-#define MAX_OPEN_FILES 64
+#define MAX_OPEN_FILES 64           /* Initial open file table size; grows on demand */
 #define MAX_INODES 128
 #define MAGIC_NUMBER 0x54494E59  /* "TINY" */
 #define ROOT_INODE 0
+#define TFS_ROOT_FD -100  /* dirfd meaning "resolve from the root directory" */
+#define MAX_SNAPSHOTS 8
+#define SNAPSHOT_RECLAIM_BATCH 16   /* Block references a reclamation step releases */
 
-/* File System Version */
-#define FS_VERSION 1
+/* Huge Page Policies For Disk Memory */
+#define HUGE_PAGES_OFF 0      /* Small pages only */
+#define HUGE_PAGES_THP 1      /* 2 MB aligned regions advised for transparent huge pages */
+#define HUGE_PAGES_HUGETLB 2  /* Reserved huge pages (MAP_HUGETLB), falling back to THP */
+
+/* Block Device Backends */
+#define BACKEND_RAM 0         /* Anonymous memory, mapped in chunks on first write */
+#define BACKEND_MMAP 1        /* Host file mapped shared */
+#define BACKEND_PREAD 2       /* Host file through pread/pwrite and the page cache */
+#define BACKEND_DIRECT 3      /* Host file opened O_DIRECT, bypassing the page cache */
+#define BACKEND_COUNT 4
+
+/* Backend Capabilities */
+#define BACKEND_CAP_ZERO_COPY 1   /* Blocks are addressable memory (get_block_pointer) */
+#define BACKEND_CAP_PERSISTENT 2  /* Blocks live in a host file and outlast the process */
+#define BACKEND_CAP_ASYNC 4       /* Blocks sit behind a file descriptor I/O can be queued to */
+#define BACKEND_CAP_UNCACHED 8    /* Transfers bypass the host page cache */
+#define DIRECT_IO_ALIGN 4096      /* Buffer, offset and length alignment for O_DIRECT */
+
+/* Asynchronous Block I/O Engines */
+#define IO_ENGINE_AUTO 0      /* io_uring where the kernel allows it, else worker threads */
+#define IO_ENGINE_URING 1     /* io_uring submission and completion rings */
+#define IO_ENGINE_THREADS 2   /* Pool of threads doing pread/pwrite */
+#define IO_ENGINE_SYNC 3      /* Each request runs inside submit (RAM and mmap backends) */
+#define IO_QUEUE_DEPTH 64     /* Default limit on requests in flight */
+
+/* Write-back defaults; thresholds are percent of the scheduler queue's capacity */
+#define WRITEBACK_EXPIRE_MS 1000        /* Oldest unwritten change the flusher tolerates */
+#define WRITEBACK_BACKGROUND_PERCENT 25 /* Dirty share that wakes the flusher early */
+#define WRITEBACK_LIMIT_PERCENT 75      /* Dirty share at which writers flush themselves */
+
+/* File System Version (2: 64-bit block numbers and file sizes) */
+#define FS_VERSION 2
 
 /* Inode Types */
 #define TYPE_FILE 1
@@ -26,17 +64,22 @@
 #define MODE_WRITE 2
 #define MODE_APPEND 4
 
+/* writeWholeFile Flags */
+#define WRITE_CREATE 1    /* Create the file if it does not exist */
+#define WRITE_TRUNCATE 2  /* Discard old contents beyond the new data */
+
 /* Superblock Structure */
 typedef struct {
     uint32_t magic;              /* Magic number to identify file system */
     uint32_t version;            /* File system version */
-    uint32_t total_blocks;       /* Total number of blocks in the file system */
     uint32_t block_size;         /* Size of each block */
-    uint32_t inode_table_block;  /* Starting block of inode table */
     uint32_t inode_count;        /* Number of inodes */
     uint32_t root_inode;         /* Root directory inode number */
-    uint32_t bitmap_block;       /* Starting block of free block bitmap */
-    uint32_t data_start_block;   /* Starting block of data area */
+    uint32_t snapshots_live;     /* Set once snapshots hold blocks; the next mount sweeps them */
+    uint64_t total_blocks;       /* Total number of blocks in the file system */
+    uint64_t inode_table_block;  /* Starting block of inode table */
+    uint64_t bitmap_block;       /* Starting block of free block bitmap */
+    uint64_t data_start_block;   /* Starting block of data area */
 } Superblock;
 
 /* Inode Structure (File Control Block) */
@@ -44,8 +87,8 @@ typedef struct {
     uint32_t inode_num;          /* Inode number */
     uint8_t type;                /* TYPE_FILE or TYPE_DIRECTORY */
     char name[MAX_FILENAME_LEN]; /* File or directory name */
-    uint32_t size;               /* Size of file in bytes */
-    uint32_t data_block;         /* Starting data block number */
+    uint64_t size;               /* Size of file in bytes */
+    uint64_t data_block;         /* Starting data block number */
     uint32_t parent_inode;       /* Parent directory inode */
     uint8_t used;                /* 1 if inode is in use, 0 if free */
 } Inode;
@@ -57,31 +100,247 @@ typedef struct {
     uint8_t type;                /* TYPE_FILE or TYPE_DIRECTORY */
 } DirectoryEntry;
 
+/* Directory Entry With Inode Attributes (readDirectoryPlus) */
+typedef struct {
+    char name[MAX_FILENAME_LEN]; /* File or directory name */
+    uint32_t inode_num;          /* Corresponding inode number */
+    uint8_t type;                /* TYPE_FILE or TYPE_DIRECTORY */
+    uint64_t size;               /* Size in bytes */
+    uint64_t block_count;        /* Data blocks in use */
+} DirectoryEntryPlus;
+
 /* Open File Table Entry */
 typedef struct {
     int fd;                      /* File descriptor */
     uint32_t inode_num;          /* Inode number of the file */
-    uint32_t position;           /* Current read/write position */
+    uint64_t position;           /* Current read/write position */
     uint8_t mode;                /* Access mode (read, write, append) */
     bool in_use;                 /* Whether this entry is in use */
+    int next_fd;                 /* Next descriptor on the same inode, or next free slot */
+    int prev_fd;                 /* Previous descriptor on the same inode */
+    uint8_t snapshot;            /* Snapshot the inode belongs to, 0 for the live volume */
 } OpenFileEntry;
 
+/* Bulk Transfer Summary */
+typedef struct {
+    uint32_t files;              /* Files copied */
+    uint32_t directories;        /* Directories created or visited */
+    uint64_t bytes;              /* File bytes copied */
+    uint32_t skipped;            /* Entries TinyFS cannot represent (special, too large, long name) */
+    uint32_t failed;             /* Entries that could not be copied */
+} TransferResult;
+
+/* Run of consecutive blocks */
+typedef struct {
+    uint64_t start;              /* First block number */
+    uint64_t count;              /* Number of blocks */
+} BlockExtent;
+
+/* Block Device Backend; the storage manager validates block numbers before calling in */
+typedef struct {
+    const char* name;
+    uint32_t capabilities;       /* BACKEND_CAP_* flags */
+    int (*open)(const char* path, uint64_t num_blocks, uint32_t block_size, bool create);
+    void (*close)();
+    int (*read)(uint64_t block_num, void* buffer);
+    int (*write)(uint64_t block_num, const void* buffer);
+    int (*write_run)(uint64_t start, uint64_t count, const uint8_t* const* blocks); /* Optional */
+    const uint8_t* (*pointer)(uint64_t block_num);   /* Zero-copy backends only */
+    uint64_t (*contiguous)(uint64_t block_num);      /* Zero-copy backends only */
+    int (*discard)(uint64_t start, uint64_t count);
+    int (*flush)();
+    uint64_t (*resident_bytes)();
+    int (*descriptor)();                             /* Host file descriptor, if any */
+} BlockBackend;
+
+/* Asynchronous Block I/O Request; owned by the caller and left untouched until reaped */
+typedef struct {
+    uint64_t block_num;          /* First block */
+    uint32_t count;              /* Consecutive blocks to transfer */
+    bool write;                  /* Write buffer to disk instead of reading into it */
+    void* buffer;                /* count blocks; DIRECT_IO_ALIGN aligned on the direct backend */
+    uint64_t tag;                /* Caller's cookie */
+    int result;                  /* Set on completion: 0, or a negative errno */
+} BlockIo;
+
+/* Statistics: API operations with their own latency histogram */
+enum {
+    STAT_OP_CREATE, STAT_OP_OPEN, STAT_OP_CLOSE, STAT_OP_READ, STAT_OP_WRITE,
+    STAT_OP_DELETE, STAT_OP_LOOKUP, STAT_OP_MKDIR, STAT_OP_RMDIR, STAT_OP_READDIR,
+    STAT_OP_READDIRPLUS, STAT_OP_LIST, STAT_OP_WRITE_WHOLE, STAT_OP_FSYNC, STAT_OP_CLONE,
+    STAT_OP_COUNT
+};
+
+/* Log-linear latency histogram: 2^SUB_BITS buckets per power of two up to 2^MAX_BITS ns */
+#define STAT_HIST_SUB_BITS 3
+#define STAT_HIST_SUB_BUCKETS (1 << STAT_HIST_SUB_BITS)
+#define STAT_HIST_MAX_BITS 40
+#define STAT_HIST_BUCKETS ((STAT_HIST_MAX_BITS - STAT_HIST_SUB_BITS + 2) * STAT_HIST_SUB_BUCKETS)
+
+/* Global event counters */
+typedef struct {
+    uint64_t block_reads;        /* read_block calls */
+    uint64_t block_writes;       /* write_block calls */
+    uint64_t bytes_copied;       /* Bytes moved by block and file data copies */
+    uint64_t block_allocs;       /* allocate_block calls */
+    uint64_t block_alloc_scan;   /* Bitmap positions examined by allocate_block */
+    uint64_t inode_allocs;       /* allocate_inode calls */
+    uint64_t inode_alloc_scan;   /* Inode slots examined by allocate_inode */
+    uint64_t chunks_mapped;      /* RAM disk chunks mapped on first write */
+    uint64_t chunks_released;    /* RAM disk chunks returned after their last block was discarded */
+    uint64_t discards;           /* Extents passed to discard_blocks */
+    uint64_t bytes_discarded;    /* Bytes returned with madvise or punched out of a file */
+    uint64_t huge_page_regions;  /* Regions mapped from reserved huge pages */
+    uint64_t huge_page_advised;  /* Regions advised for transparent huge pages */
+    uint64_t huge_page_fallbacks; /* Huge page requests the kernel refused */
+    uint64_t io_submitted;       /* Requests accepted by submit_block_io */
+    uint64_t io_submit_calls;    /* Hand-offs to the kernel or the worker threads */
+    uint64_t io_sync_fallbacks;  /* Requests run synchronously (backend or alignment) */
+    uint64_t io_queued;          /* Block writes held by a plugged scheduler queue */
+    uint64_t io_deduplicated;    /* Queued writes replaced by a later write to the same block */
+    uint64_t io_runs;            /* Runs of adjacent blocks dispatched from the queue */
+    uint64_t writeback_flushes;  /* Write-backs done by the flusher thread */
+    uint64_t writeback_throttles; /* Write-backs a writer had to do past the dirty limit */
+    uint64_t cow_copies;         /* Shared blocks replaced by a private one before a write */
+    uint64_t snapshot_reclaimed; /* Block references released by deleted snapshots */
+    uint64_t dedup_hits;         /* File block writes that shared an identical block instead */
+    uint64_t dedup_mismatches;   /* Hash matches whose bytes differed, or stale index entries */
+} TfsCounters;
+
+/* Per-operation statistics */
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t block_reads;        /* Block reads issued while the call ran */
+    uint64_t block_writes;       /* Block writes issued while the call ran */
+    uint64_t bytes_copied;
+    uint64_t histogram[STAT_HIST_BUCKETS];
+} TfsOpStats;
+
+/* Statistics snapshot returned by tfs_get_stats */
+typedef struct {
+    TfsOpStats ops[STAT_OP_COUNT];
+    TfsCounters totals;
+} TfsStats;
+
+/* Instrumentation hooks; build with -DTFS_ENABLE_STATS (make STATS=1, the default) */
+#ifdef TFS_ENABLE_STATS
+extern TfsCounters tfs_counters;
+uint64_t tfs_stat_op_begin();
+void tfs_stat_op_end(int op, uint64_t start, bool failed);
+#define TFS_STAT_ADD(counter, n) (tfs_counters.counter += (n))
+#define TFS_OP_BEGIN() uint64_t tfs_op_start_ = tfs_stat_op_begin()
+#define TFS_OP_END(op, result) tfs_stat_op_end((op), tfs_op_start_, (result) < 0)
+#else
+#define TFS_STAT_ADD(counter, n) ((void)0)
+#define TFS_OP_BEGIN() ((void)0)
+#define TFS_OP_END(op, result) ((void)0)
+#endif
+
 /* Function Prototypes */
 
 /* Storage Manager Functions */
-int init_disk(uint32_t num_blocks);
-int read_block(uint32_t block_num, void* buffer);
-int write_block(uint32_t block_num, const void* buffer);
+int init_disk(uint64_t num_blocks, uint32_t block_size);
+int read_block(uint64_t block_num, void* buffer);
+int read_disk_block(uint64_t block_num, void* buffer);
+int write_block(uint64_t block_num, const void* buffer);
+int write_block_vector(uint64_t start, uint64_t count, const uint8_t* const* blocks);
+int free_disk();
+int attach_disk_mapping(void* mapping, size_t length, size_t offset, uint64_t num_blocks,
+                        uint32_t block_size);
+bool is_valid_block_size(uint32_t block_size);
+uint32_t get_block_size();
+const uint8_t* get_block_pointer(uint64_t block_num);
+uint64_t get_contiguous_blocks(uint64_t block_num);
+uint64_t get_resident_bytes();
+int discard_blocks(uint64_t start, uint64_t count);
+int flush_disk();
+int sync_disk();
+int set_disk_backend(int backend, const char* path);
+int open_disk(int backend, const char* path);
+int get_disk_backend();
+const char* get_disk_backend_name();
+uint32_t get_disk_capabilities();
+int get_disk_descriptor();
+void account_block_io(uint64_t block_num, uint64_t count, bool write);
+int set_huge_page_mode(int mode);
+int get_huge_page_mode();
+void* map_disk_memory(size_t length);
+void unmap_disk_memory(void* memory, size_t length);
+uint64_t get_huge_page_bytes();
+uint64_t get_total_blocks();
+bool is_block_dirty(uint64_t block_num);
+uint64_t count_dirty_blocks();
+int next_dirty_extent(uint64_t* cursor, BlockExtent* extent);
+uint32_t get_checkpoint_epoch();
+uint64_t get_volume_id();
+void set_checkpoint_state(uint64_t id, uint32_t epoch);
+
+/* Host File Backends */
+extern const BlockBackend mmap_file_backend;
+extern const BlockBackend pread_file_backend;
+extern const BlockBackend direct_file_backend;
+
+/* Asynchronous Block I/O */
+int set_io_engine(int engine, uint32_t depth);
+const char* get_io_engine_name();
+int submit_block_io(BlockIo* const* ios, int count);
+int reap_block_io(BlockIo** done, int max, int min_complete);
+int drain_block_io();
+uint32_t get_block_io_inflight();
+void stop_io_engine();
+
+/* Block I/O Scheduler: write queue that sorts, merges and deduplicates */
+int plug_block_queue();
+int unplug_block_queue();
+int flush_block_queue();
+int flush_queued_range(uint64_t start, uint64_t count);
+uint64_t next_queued_block(uint64_t from);
+bool block_queue_plugged();
+int queue_block_write(uint64_t block_num, const void* buffer);
+bool read_queued_block(uint64_t block_num, void* buffer);
+void reset_block_queue();
+uint32_t get_queued_blocks();
+uint32_t get_block_queue_capacity();
+
+/* Write-Back: deferred metadata and block writes flushed by a background thread */
+int set_writeback(bool enabled, uint32_t expire_ms, uint32_t background_percent,
+                  uint32_t limit_percent);
+void get_writeback(uint32_t* expire_ms, uint32_t* background_percent, uint32_t* limit_percent);
+bool writeback_enabled();
+bool writeback_caches_blocks();
+void note_writeback_dirty();
+uint64_t count_writeback_dirty();
+int flush_writeback();
+void wake_flusher();
+void tfs_lock();
+void tfs_unlock();
+int tfs_sync();
 
 /* Allocator Functions */
 int init_bitmap();
-int allocate_block();
-int free_block(uint32_t block_num);
+uint64_t allocate_block();
+int free_block(uint64_t block_num);
 int load_bitmap();
 int save_bitmap();
+int flush_bitmap();
+int flush_discards();
+int flush_due_discards();
+uint64_t count_dirty_bitmap_blocks();
+int flush_block_allocation(uint64_t block_num);
+bool is_block_allocated(uint64_t block_num);
+int share_block(uint64_t block_num);
+uint32_t get_block_refs(uint64_t block_num);
+uint64_t replace_shared_block(uint64_t block_num);
+int rebuild_block_refs(uint64_t* blocks, uint32_t count);
+uint64_t find_unreferenced_blocks(uint64_t* blocks, uint32_t count, bool release);
 
 /* Metadata Manager Functions */
-int init_filesystem(uint32_t num_blocks);
+int init_filesystem(uint64_t num_blocks);
+int init_filesystem_with_block_size(uint64_t num_blocks, uint32_t block_size);
+int mount_filesystem();
 int load_superblock();
 int save_superblock();
 int load_inode_table();
@@ -91,8 +350,51 @@ int save_inode(const Inode* inode);
 uint32_t allocate_inode();
 int free_inode(uint32_t inode_num);
 int init_root_directory();
+int flush_inode_table();
+uint32_t count_dirty_inode_blocks();
+int flush_inode(uint32_t inode_num);
+int load_stored_inode(uint32_t inode_num, Inode* inode);
+void init_open_file_table();
 int get_open_file_index();
+int attach_open_file(int fd, uint32_t inode_num);
 int release_open_file(int fd);
+int first_open_file(uint32_t inode_num);
+int release_inode_open_files(uint32_t inode_num);
+int copy_inode_table(Inode* inodes);
+int select_inode_view(int snapshot);
+int get_inode_view();
+uint64_t get_orphan_blocks();
+
+/* Batched Metadata Updates */
+int tfs_begin_batch();
+int tfs_commit_batch();
+bool tfs_batch_active();
+bool metadata_deferred();
+
+/* Snapshots: copy-on-write images of the volume, readable through openSnapshot */
+int tfs_create_snapshot(const char* name);
+int tfs_delete_snapshot(const char* name);
+int tfs_list_snapshots(char names[][MAX_FILENAME_LEN], int max_names);
+int find_snapshot(const char* name);
+const Inode* get_snapshot_inodes(int snapshot);
+void hold_snapshot(int snapshot);
+void release_snapshot(int snapshot);
+bool snapshot_reclaim_pending();
+uint32_t reclaim_snapshots(uint32_t budget);
+void drop_snapshots();
+
+/* Content-Addressed Deduplication of File Data Blocks */
+int set_dedup(bool enabled);
+bool dedup_enabled();
+uint64_t find_duplicate_block(const void* data);
+void note_data_block(uint64_t block_num, const void* data);
+int get_dedup_usage(uint64_t* logical, uint64_t* physical);
+
+/* Statistics */
+int tfs_get_stats(TfsStats* stats);
+void tfs_reset_stats();
+const char* tfs_stat_op_name(int op);
+uint64_t tfs_stat_percentile(const TfsOpStats* op, double p);
 
 /* API Layer - File Operations */
 int createFile(const char* path, uint8_t type);
@@ -100,19 +402,54 @@ int openFile(const char* path, uint8_t mode);
 int closeFile(int fd);
 int readFile(int fd, void* buffer, uint32_t size);
 int writeFile(int fd, const void* buffer, uint32_t size);
+int fsyncFile(int fd);
 int deleteFile(const char* path);
 int searchFile(const char* path);
+int openInode(uint32_t inode_num, uint8_t mode);
+int writeWholeFile(const char* path, const void* buffer, uint32_t size, int flags);
+int cloneFile(const char* src_path, const char* dst_path);
 
 /* API Layer - Directory Operations */
 int makeDirectory(const char* path);
 int removeDirectory(const char* path);
 int listDirectory(const char* path, char* output, uint32_t output_size);
+int openDirectory(const char* path);
+int readDirectory(int dirfd, DirectoryEntry* entries, int max_entries);
+int tellDirectory(int dirfd, uint32_t* cookie);
+int seekDirectory(int dirfd, uint32_t cookie);
+int readDirectoryPlus(int dirfd, DirectoryEntryPlus* entries, int max_entries);
+int openSnapshot(const char* name);
+
+/* API Layer - Handle-Relative Operations (dirfd from openDirectory or TFS_ROOT_FD) */
+int openDirectoryAt(int dirfd, const char* path);
+int lookupAt(int dirfd, const char* path);
+int createFileAt(int dirfd, const char* path, uint8_t type);
+int openFileAt(int dirfd, const char* path, uint8_t mode);
+int deleteFileAt(int dirfd, const char* path);
+int searchFileAt(int dirfd, const char* path);
+int makeDirectoryAt(int dirfd, const char* path);
+int removeDirectoryAt(int dirfd, const char* path);
+int writeWholeFileAt(int dirfd, const char* path, const void* buffer, uint32_t size, int flags);
+int cloneFileAt(int src_dirfd, const char* src_path, int dst_dirfd, const char* dst_path);
+
+/* Bulk Transfer Between Host Directories and TinyFS */
+int tfs_import_tree(const char* host_dir, const char* tfs_dir, TransferResult* result);
+int tfs_export_tree(const char* tfs_dir, const char* host_dir, TransferResult* result);
+
+/* Volume Images */
+int tfs_save_image(const char* path);
+int tfs_load_image(const char* path, bool verify);
+int tfs_save_delta(const char* path);
+int tfs_apply_delta(const char* path);
 
 /* Helper Functions */
 int parse_path(const char* path, char components[][MAX_FILENAME_LEN], int* count);
 uint32_t find_inode_by_path(const char* path);
+uint32_t lookup_child(uint32_t dir_inode, const char* name);
 int get_file_descriptor(uint32_t inode_num, uint8_t mode);
 int read_directory_entries(uint32_t dir_inode, DirectoryEntry* entries, int max_entries);
+int read_directory_entries_from(uint32_t dir_inode, uint32_t* cookie,
+                                DirectoryEntry* entries, int max_entries);
 int add_directory_entry(uint32_t dir_inode, const char* name, uint32_t inode_num, uint8_t type);
 int remove_directory_entry(uint32_t dir_inode, const char* name);
 bool is_directory_empty(uint32_t dir_inode);
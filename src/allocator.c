@@ -7,14 +7,40 @@
 extern Superblock* get_superblock();
 
 static uint8_t* bitmap = NULL;
-static uint32_t bitmap_size = 0;
-static uint32_t bitmap_blocks = 0;
+static size_t bitmap_size = 0;
+static size_t bitmap_mapped = 0;    /* Length bitmap was mapped with */
+static uint64_t bitmap_blocks = 0;
+static bool bitmap_dirty = false;   /* Bitmap changed while deferred, not yet saved */
+static uint64_t dirty_first = 0;    /* Range of bitmap blocks changed while deferred */
+static uint64_t dirty_last = 0;
+static uint64_t free_hint = 0;      /* No block below this one is free */
+
+/* References to each block beyond its first owner, for blocks snapshots share with the
+ * live volume; kept in memory and rebuilt from the inode table on mount */
+static uint16_t* block_refs = NULL;
+static size_t block_refs_mapped = 0;
+
+/* Freed extents waiting to be discarded. A discard zeroes the block, so it may only run once
+ * the metadata that stopped referencing it has been written; see flush_due_discards */
+#define DISCARD_QUEUE_EXTENTS 64
+#define DISCARD_QUEUE_BLOCKS 1024
+static BlockExtent discard_queue[DISCARD_QUEUE_EXTENTS];
+static uint32_t discard_queued = 0;
+static uint64_t discard_queued_blocks = 0;
 
 /* Calculate how many blocks are needed for the bitmap */
-static uint32_t calculate_bitmap_blocks(uint32_t total_blocks) {
-    uint32_t bits_needed = total_blocks;
-    uint32_t bytes_needed = (bits_needed + 7) / 8;   // rounds up value to nearest integer
-    return (bytes_needed + BLOCK_SIZE - 1) / BLOCK_SIZE;  // gets number of blocks needed for bitmap
+static uint64_t calculate_bitmap_blocks(uint64_t total_blocks) {
+    uint64_t bits_needed = total_blocks;
+    uint64_t bytes_needed = (bits_needed + 7) / 8;   // rounds up value to nearest integer
+    return (bytes_needed + get_block_size() - 1) / get_block_size();  // gets number of blocks needed for bitmap
+}
+
+/* Map a zeroed reference count table for total_blocks blocks */
+static int map_block_refs(uint64_t total_blocks) {
+    unmap_disk_memory(block_refs, block_refs_mapped);
+    block_refs_mapped = (size_t)total_blocks * sizeof(uint16_t);
+    block_refs = map_disk_memory(block_refs_mapped);
+    return block_refs ? 0 : -1;
 }
 
 /* Initialize the free block bitmap */
@@ -29,32 +55,36 @@ int init_bitmap() {
     }
 
     bitmap_blocks = calculate_bitmap_blocks(sb->total_blocks);
-    bitmap_size = bitmap_blocks * BLOCK_SIZE;
-    
-    bitmap = calloc(bitmap_size, 1);
-    if (!bitmap) {
+    bitmap_size = (size_t)bitmap_blocks * get_block_size();
+    free_hint = 0;
+    discard_queued = 0;
+    discard_queued_blocks = 0;
+
+    unmap_disk_memory(bitmap, bitmap_mapped);
+    bitmap = map_disk_memory(bitmap_size);
+    bitmap_mapped = bitmap_size;
+    if (!bitmap || map_block_refs(sb->total_blocks) < 0) {
         return -1;
     }
 
-    /* Mark all blocks as free initially */
-    memset(bitmap, 0, bitmap_size);
+    /* All blocks start free: fresh bitmap memory is already zeroed */
 
     /* Mark block 0 (superblock) as used */
     bitmap[0] |= 0x01;
 
     /* Mark bitmap blocks as used */
-    uint32_t start = sb->bitmap_block;
-    for (uint32_t i = 0; i < bitmap_blocks; i++) {
-        uint32_t byte = (start + i) / 8;
+    uint64_t start = sb->bitmap_block;
+    for (uint64_t i = 0; i < bitmap_blocks; i++) {
+        uint64_t byte = (start + i) / 8;
         uint32_t bit = (start + i) % 8;
         bitmap[byte] |= (1 << bit);
     }
 
-    /* Mark inode table blocks as used */
-    uint32_t inode_blocks = (sb->inode_count * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    for (uint32_t i = 0; i < inode_blocks; i++) {
-        uint32_t block_num = sb->inode_table_block + i;
-        uint32_t byte = block_num / 8;
+    /* Mark inode table blocks as used (they end where the data area starts) */
+    uint64_t inode_blocks = sb->data_start_block - sb->inode_table_block;
+    for (uint64_t i = 0; i < inode_blocks; i++) {
+        uint64_t block_num = sb->inode_table_block + i;
+        uint64_t byte = block_num / 8;
         uint32_t bit = block_num % 8;
         bitmap[byte] |= (1 << bit);
     }
@@ -74,106 +104,258 @@ int load_bitmap() {
     }
 
     bitmap_blocks = calculate_bitmap_blocks(sb->total_blocks);
-    bitmap_size = bitmap_blocks * BLOCK_SIZE;
-
-    if (bitmap) {
-        free(bitmap);
-    }
-
-    bitmap = malloc(bitmap_size);
-    if (!bitmap) {
+    bitmap_size = (size_t)bitmap_blocks * get_block_size();
+    free_hint = 0;
+    discard_queued = 0;
+    discard_queued_blocks = 0;
+
+    unmap_disk_memory(bitmap, bitmap_mapped);
+    bitmap = map_disk_memory(bitmap_size);
+    bitmap_mapped = bitmap_size;
+    if (!bitmap || map_block_refs(sb->total_blocks) < 0) {
         return -1;
     }
 
-    /* Read bitmap blocks from disk */
-    uint8_t* block_buffer = malloc(BLOCK_SIZE);
-    if (!block_buffer) {
-        free(bitmap);
-        bitmap = NULL;
-        return -1;
-    }
-
-    for (uint32_t i = 0; i < bitmap_blocks; i++) {
-        if (read_block(sb->bitmap_block + i, block_buffer) < 0) {
-            free(block_buffer);
-            free(bitmap);
+    /* Read bitmap blocks from disk straight into place */
+    uint32_t block_size = get_block_size();
+    for (uint64_t i = 0; i < bitmap_blocks; i++) {
+        if (read_block(sb->bitmap_block + i, bitmap + (size_t)i * block_size) < 0) {
+            unmap_disk_memory(bitmap, bitmap_mapped);
             bitmap = NULL;
             return -1;
         }
-        memcpy(bitmap + (i * BLOCK_SIZE), block_buffer, BLOCK_SIZE);
     }
 
-    free(block_buffer);
+    bitmap_dirty = false;
     return 0;
 }
 
+/* Write bitmap blocks first..last (inclusive) to disk */
+static int write_bitmap_blocks(uint64_t first, uint64_t last) {
+    Superblock* sb = get_superblock();
+    if (!bitmap || !sb) {
+        return -1;
+    }
+
+    /* One vectored write for the whole range */
+    uint32_t block_size = get_block_size();
+    plug_block_queue();
+    int status = 0;
+    for (uint64_t i = first; i <= last && i < bitmap_blocks && status == 0; i++) {
+        if (write_block(sb->bitmap_block + i, bitmap + (size_t)i * block_size) < 0) {
+            status = -1;
+        }
+    }
+    if (unplug_block_queue() < 0) {
+        status = -1;
+    }
+    return status;
+}
+
 /* Save the bitmap*/
 int save_bitmap() {
     if (!bitmap || load_superblock() < 0) {
         return -1;
     }
 
+    if (write_bitmap_blocks(0, bitmap_blocks - 1) < 0) {
+        return -1;
+    }
+
+    bitmap_dirty = false;
+    return 0;
+}
+
+/* Persist the bitmap block covering block_num after a change, or defer it inside a batch
+ * or for write-back */
+static int sync_bitmap(uint64_t block_num) {
+    uint64_t index = block_num / 8 / get_block_size();
+    if (metadata_deferred()) {
+        if (!bitmap_dirty || index < dirty_first) {
+            dirty_first = index;
+        }
+        if (!bitmap_dirty || index > dirty_last) {
+            dirty_last = index;
+        }
+        bitmap_dirty = true;
+        note_writeback_dirty();
+        return 0;
+    }
+    return write_bitmap_blocks(index, index);
+}
+
+/* Number of bitmap blocks changed but not yet written */
+uint64_t count_dirty_bitmap_blocks() {
+    return bitmap_dirty ? dirty_last - dirty_first + 1 : 0;
+}
+
+/* Record block_num as allocated on the disk now, if its bitmap block has deferred changes.
+ * Only its own bit is set, in the block as last written: the other bits may record other
+ * files' allocations whose data is still queued, or frees the inodes on the disk do not
+ * reflect yet. The block stays deferred for the next full flush */
+int flush_block_allocation(uint64_t block_num) {
+    uint64_t index = block_num / 8 / get_block_size();
+    if (!bitmap_dirty || index < dirty_first || index > dirty_last) {
+        return 0;
+    }
     Superblock* sb = get_superblock();
-    if (!sb) {
+    uint8_t* block = malloc(get_block_size());
+    if (!sb || !block || read_block(sb->bitmap_block + index, block) < 0) {
+        free(block);
         return -1;
     }
 
-    uint8_t* block_buffer = malloc(BLOCK_SIZE);
-    if (!block_buffer) {
+    uint8_t bit = (uint8_t)(1u << (block_num % 8));
+    size_t byte = (size_t)(block_num / 8 - index * get_block_size());
+    int status = 0;
+    if (!(block[byte] & bit)) {
+        block[byte] |= bit;
+        if (write_block(sb->bitmap_block + index, block) < 0 ||
+            flush_queued_range(sb->bitmap_block + index, 1) < 0) {
+            status = -1;
+        }
+    }
+    free(block);
+    return status;
+}
+
+/* Save the bitmap blocks a batch or write-back left modified */
+int flush_bitmap() {
+    if (!bitmap_dirty) {
+        return 0;
+    }
+    if (write_bitmap_blocks(dirty_first, dirty_last) < 0) {
         return -1;
     }
+    bitmap_dirty = false;
+    return 0;
+}
 
-    for (uint32_t i = 0; i < bitmap_blocks; i++) {
-        memset(block_buffer, 0, BLOCK_SIZE);
-        uint32_t copy_size = (i == bitmap_blocks - 1) ? 
-                            (bitmap_size - i * BLOCK_SIZE) : BLOCK_SIZE;
-        memcpy(block_buffer, bitmap + (i * BLOCK_SIZE), copy_size);
-        
-        if (write_block(sb->bitmap_block + i, block_buffer) < 0) {
-            free(block_buffer);
-            return -1;
+/* Discard the queued extents, skipping any block that was allocated again since it was freed */
+static void discard_queued_extents() {
+    for (uint32_t i = 0; i < discard_queued; i++) {
+        uint64_t end = discard_queue[i].start + discard_queue[i].count;
+        uint64_t b = discard_queue[i].start;
+        while (b < end) {
+            if (is_block_allocated(b)) {
+                b++;
+                continue;
+            }
+            uint64_t run = b;
+            while (run < end && !is_block_allocated(run)) {
+                run++;
+            }
+            discard_blocks(b, run - b);
+            b = run;
+        }
+    }
+    discard_queued = 0;
+    discard_queued_blocks = 0;
+}
+
+/* Discard every queued extent now, first writing back metadata that still refers to them;
+ * inside a batch they wait for the commit */
+int flush_discards() {
+    tfs_lock();
+    int status = 0;
+    if (writeback_enabled() && !tfs_batch_active() && flush_writeback() < 0) {
+        status = -1;
+    } else if (!tfs_batch_active()) {
+        discard_queued_extents();
+    }
+    tfs_unlock();
+    return status;
+}
+
+/* Queue a freed block for discard, merging it into the last extent when adjacent */
+static void queue_discard(uint64_t block_num) {
+    BlockExtent* last = discard_queued ? &discard_queue[discard_queued - 1] : NULL;
+    if (last && block_num == last->start + last->count) {
+        last->count++;
+    } else if (last && block_num + 1 == last->start) {
+        last->start--;
+        last->count++;
+    } else {
+        if (discard_queued == DISCARD_QUEUE_EXTENTS) {
+            /* Full: the block keeps its memory until it is reused and freed again */
+            return;
         }
+        discard_queue[discard_queued].start = block_num;
+        discard_queue[discard_queued].count = 1;
+        discard_queued++;
     }
+    discard_queued_blocks++;
+}
 
-    free(block_buffer);
+/* Discard the queue once it has gathered enough to be worth it. Called only where the
+ * bitmap and inode blocks recording the frees have just been written */
+int flush_due_discards() {
+    if (discard_queued < DISCARD_QUEUE_EXTENTS && discard_queued_blocks < DISCARD_QUEUE_BLOCKS) {
+        return 0;
+    }
+    discard_queued_extents();
     return 0;
 }
 
-/* Allocate a free block */
-int allocate_block() {
+/* Allocate a free block; returns (uint64_t)-1 when the volume is full */
+uint64_t allocate_block() {
     if (!bitmap) {
         if (load_bitmap() < 0) {
-            return -1;
+            return (uint64_t)-1;
         }
     }
 
     if (load_superblock() < 0) {
-        return -1;
+        return (uint64_t)-1;
     }
 
     Superblock* sb = get_superblock();
     if (!sb) {
-        return -1;
+        return (uint64_t)-1;
     }
 
-    /* Find the first free block */
-    for (uint32_t i = 0; i < sb->total_blocks; i++) {
-        uint32_t byte = i / 8;
+    /* Deleted snapshots give their blocks back a little at a time */
+    if (snapshot_reclaim_pending()) {
+        reclaim_snapshots(SNAPSHOT_RECLAIM_BATCH);
+    }
+
+    TFS_STAT_ADD(block_allocs, 1);
+
+    /* Find the first free block, skipping fully used bytes of the bitmap */
+    uint64_t i = free_hint;
+    while (i < sb->total_blocks) {
+        uint64_t byte = i / 8;
         uint32_t bit = i % 8;
-        
+
+        if (bit == 0 && bitmap[byte] == 0xFF) {
+            i += 8;
+            continue;
+        }
+
         if (!(bitmap[byte] & (1 << bit))) {
+            TFS_STAT_ADD(block_alloc_scan, i - free_hint + 1);
+
             /* Mark block as used */
             bitmap[byte] |= (1 << bit);
-            save_bitmap();
+            free_hint = i + 1;
+            sync_bitmap(i);
             return i;
         }
+        i++;
     }
 
-    return -1; /* No free blocks */
+    TFS_STAT_ADD(block_alloc_scan, sb->total_blocks - free_hint);
+    free_hint = sb->total_blocks;
+
+    /* Out of space: finish reclaiming deleted snapshots before giving up */
+    if (snapshot_reclaim_pending() && reclaim_snapshots(UINT32_MAX) > 0) {
+        return allocate_block();
+    }
+    return (uint64_t)-1; /* No free blocks */
 }
 
 /* Free a block */
-int free_block(uint32_t block_num) {
+int free_block(uint64_t block_num) {
     if (!bitmap) {
         if (load_bitmap() < 0) {
             return -1;
@@ -193,12 +375,120 @@ int free_block(uint32_t block_num) {
         return -1;
     }
 
-    uint32_t byte = block_num / 8;
+    /* A shared block only loses a reference */
+    if (block_refs && block_refs[block_num] > 0) {
+        block_refs[block_num]--;
+        return 0;
+    }
+
+    uint64_t byte = block_num / 8;
     uint32_t bit = block_num % 8;
 
-    /* Mark block as free */
+    /* Mark block as free; its memory goes back to the OS with the next discard flush */
     bitmap[byte] &= ~(1 << bit);
-    return save_bitmap();
+    if (block_num < free_hint) {
+        free_hint = block_num;
+    }
+    queue_discard(block_num);
+    return sync_bitmap(block_num);
+}
+
+/* Check whether a block is marked used in the bitmap */
+bool is_block_allocated(uint64_t block_num) {
+    if (!bitmap && load_bitmap() < 0) {
+        return false;
+    }
+
+    if (block_num / 8 >= bitmap_size) {
+        return false;
+    }
+
+    return (bitmap[block_num / 8] & (1 << (block_num % 8))) != 0;
+}
+
+/* Add a reference to an allocated block so one more owner can point at it */
+int share_block(uint64_t block_num) {
+    if (!block_refs || !is_block_allocated(block_num) || block_num >= get_total_blocks() ||
+        block_refs[block_num] == UINT16_MAX) {
+        return -1;
+    }
+    block_refs[block_num]++;
+    return 0;
 }
 
+/* Owners of a block beyond the first; 0 for a block only one inode points at */
+uint32_t get_block_refs(uint64_t block_num) {
+    if (!block_refs || block_num >= get_total_blocks()) {
+        return 0;
+    }
+    return block_refs[block_num];
+}
 
+/* Block an owner should write instead of block_num: block_num itself if nobody shares it,
+ * else a newly allocated block, the owner's reference to the old one being dropped. The
+ * caller rewrites the whole block, so nothing is copied here */
+uint64_t replace_shared_block(uint64_t block_num) {
+    if (get_block_refs(block_num) == 0) {
+        return block_num;
+    }
+    uint64_t copy = allocate_block();
+    if (copy == (uint64_t)-1) {
+        return (uint64_t)-1;
+    }
+    /* Allocation may have reclaimed the other owners; free_block copes with either case */
+    free_block(block_num);
+    TFS_STAT_ADD(cow_copies, 1);
+    return copy;
+}
+
+static int compare_blocks(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Rebuild the reference counts from every block pointer on the volume (sorted in place) */
+int rebuild_block_refs(uint64_t* blocks, uint32_t count) {
+    if (!bitmap || !block_refs) {
+        return -1;
+    }
+    /* load_bitmap has just mapped the counts afresh, so they are already zero */
+    qsort(blocks, count, sizeof(uint64_t), compare_blocks);
+    for (uint32_t i = 1; i < count; i++) {
+        if (blocks[i] == blocks[i - 1] && block_refs[blocks[i]] < UINT16_MAX) {
+            block_refs[blocks[i]]++;
+        }
+    }
+    return 0;
+}
+
+/* Walk the data area for blocks marked used that none of blocks (sorted in place) points
+ * at, and free them with release. Returns how many there were, or (uint64_t)-1 on error.
+ * The walk covers the whole bitmap, so it only runs when asked for */
+uint64_t find_unreferenced_blocks(uint64_t* blocks, uint32_t count, bool release) {
+    Superblock* sb = get_superblock();
+    if (!bitmap || !sb) {
+        return (uint64_t)-1;
+    }
+    qsort(blocks, count, sizeof(uint64_t), compare_blocks);
+
+    uint64_t found = 0;
+    uint32_t next = 0;
+    for (uint64_t b = sb->data_start_block; b < sb->total_blocks; b++) {
+        if (b % 8 == 0 && bitmap[b / 8] == 0 && b + 8 <= sb->total_blocks) {
+            b += 7;
+            continue;
+        }
+        while (next < count && blocks[next] < b) {
+            next++;
+        }
+        if (!is_block_allocated(b) || (next < count && blocks[next] == b)) {
+            continue;
+        }
+        if (release && free_block(b) < 0) {
+            return (uint64_t)-1;
+        }
+        found++;
+    }
+    return found;
+}
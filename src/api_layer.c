@@ -6,8 +6,6 @@
 
 extern Superblock* get_superblock();
 extern OpenFileEntry* get_open_file_entry(int fd);
-extern void init_open_file_table();
-extern OpenFileEntry open_file_table[];
 
 /* Parse a path into components */
 int parse_path(const char* path, char components[][MAX_FILENAME_LEN], int* count) {
@@ -59,87 +57,149 @@ int parse_path(const char* path, char components[][MAX_FILENAME_LEN], int* count
     return 0;
 }
 
-/* Find inode by path */
-uint32_t find_inode_by_path(const char* path) {
-    if (!path) {
+/* Look up a single name in a directory */
+uint32_t lookup_child(uint32_t dir_inode, const char* name) {
+    Inode dir;
+    if (load_inode(dir_inode, &dir) < 0) {
         return (uint32_t)-1;
     }
 
-    if (load_superblock() < 0) {
+    if (dir.type != TYPE_DIRECTORY) {
         return (uint32_t)-1;
     }
 
-    /* Ensure inode table is loaded */
-    if (load_inode_table() < 0) {
+    uint8_t* block = malloc(get_block_size());
+    if (!block) {
         return (uint32_t)-1;
     }
 
-    Superblock* sb = get_superblock();
-    if (!sb) {
+    if (read_block(dir.data_block, block) < 0) {
+        free(block);
         return (uint32_t)-1;
     }
 
-    /* Root path */
-    if (strcmp(path, "/") == 0) {
-        return sb->root_inode;
+    DirectoryEntry* entries = (DirectoryEntry*)block;
+    int entries_per_block = get_block_size() / sizeof(DirectoryEntry);
+    uint32_t found = (uint32_t)-1;
+
+    for (int j = 0; j < entries_per_block; j++) {
+        if (entries[j].name[0] != '\0' &&
+            strcmp(entries[j].name, name) == 0) {
+            found = entries[j].inode_num;
+            break;
+        }
     }
 
+    free(block);
+    return found;
+}
+
+/* Resolve a path starting at a given directory inode */
+static uint32_t walk_path(uint32_t start_inode, const char* path) {
     char components[32][MAX_FILENAME_LEN];
     int count = 0;
-    
+
     if (parse_path(path, components, &count) < 0) {
         return (uint32_t)-1;
     }
 
-    /* Start from root */
-    uint32_t current_inode = sb->root_inode;
-    
-    for (int i = 0; i < count; i++) {
-        Inode current;
-        if (load_inode(current_inode, &current) < 0) {
-            return (uint32_t)-1;
-        }
+    uint32_t current_inode = start_inode;
 
-        if (current.type != TYPE_DIRECTORY) {
-            return (uint32_t)-1;
-        }
+    for (int i = 0; i < count && current_inode != (uint32_t)-1; i++) {
+        current_inode = lookup_child(current_inode, components[i]);
+    }
 
-        /* Read directory entries */
-        uint8_t* block = malloc(BLOCK_SIZE);
-        if (!block) {
-            return (uint32_t)-1;
-        }
+    return current_inode;
+}
 
-        if (read_block(current.data_block, block) < 0) {
-            free(block);
-            return (uint32_t)-1;
-        }
+/* Find inode by path */
+uint32_t find_inode_by_path(const char* path) {
+    if (!path) {
+        return (uint32_t)-1;
+    }
 
-        DirectoryEntry* entries = (DirectoryEntry*)block;
-        int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-        bool found = false;
+    Superblock* sb = get_superblock();
+    if (!sb || select_inode_view(0) < 0) {
+        return (uint32_t)-1;
+    }
 
-        for (int j = 0; j < entries_per_block; j++) {
-            if (entries[j].name[0] != '\0' && 
-                strcmp(entries[j].name, components[i]) == 0) {
-                current_inode = entries[j].inode_num;
-                found = true;
-                break;
-            }
-        }
+    return walk_path(sb->root_inode, path);
+}
 
-        free(block);
+/* Open file entry for fd, with the inode table it was opened in (live or a snapshot's)
+ * selected for load_inode */
+static OpenFileEntry* open_entry(int fd) {
+    OpenFileEntry* entry = get_open_file_entry(fd);
+    if (!entry || select_inode_view(entry->snapshot) < 0) {
+        return NULL;
+    }
+    return entry;
+}
 
-        if (!found) {
-            return (uint32_t)-1;
-        }
+/* Directory inode a *_at call starts from, selecting the inode table dirfd belongs to;
+ * absolute paths ignore dirfd and start at the live root */
+static uint32_t resolve_dirfd(int dirfd, const char* path) {
+    if (!path) {
+        return (uint32_t)-1;
     }
 
-    return current_inode;
+    if (path[0] == '/' || dirfd == TFS_ROOT_FD) {
+        Superblock* sb = get_superblock();
+        return (sb && select_inode_view(0) == 0) ? sb->root_inode : (uint32_t)-1;
+    }
+
+    OpenFileEntry* entry = open_entry(dirfd);
+    if (!entry) {
+        return (uint32_t)-1;
+    }
+
+    Inode dir;
+    if (load_inode(entry->inode_num, &dir) < 0 || dir.type != TYPE_DIRECTORY) {
+        return (uint32_t)-1;
+    }
+
+    return entry->inode_num;
 }
 
-/* Read directory entries */
-int read_directory_entries(uint32_t dir_inode, DirectoryEntry* entries, int max_entries) {
+/* Resolve the parent directory of path relative to dirfd and split off the final name;
+ * snapshots are read-only, so the parent must be on the live volume */
+static uint32_t resolve_parent_at(int dirfd, const char* path, char* filename) {
+    uint32_t start = resolve_dirfd(dirfd, path);
+    if (start == (uint32_t)-1 || get_inode_view() != 0) {
+        return (uint32_t)-1;
+    }
+
+    const char* last_slash = strrchr(path, '/');
+    const char* name = last_slash ? last_slash + 1 : path;
+    if (*name == '\0') {
+        return (uint32_t)-1;
+    }
+
+    strncpy(filename, name, MAX_FILENAME_LEN - 1);
+    filename[MAX_FILENAME_LEN - 1] = '\0';
+
+    if (!last_slash || last_slash == path) {
+        return start;
+    }
+
+    char parent_path[MAX_PATH_LEN];
+    size_t parent_len = last_slash - path;
+    if (parent_len >= MAX_PATH_LEN) {
+        return (uint32_t)-1;
+    }
+    memcpy(parent_path, path, parent_len);
+    parent_path[parent_len] = '\0';
+
+    return walk_path(start, parent_path);
+}
+
+/* Read directory entries starting at a slot cookie; the cookie is advanced past them */
+int read_directory_entries_from(uint32_t dir_inode, uint32_t* cookie,
+                                DirectoryEntry* entries, int max_entries) {
+    if (!cookie || !entries || max_entries < 0) {
+        return -1;
+    }
+
     Inode inode;
     if (load_inode(dir_inode, &inode) < 0) {
         return -1;
@@ -149,7 +209,12 @@ int read_directory_entries(uint32_t dir_inode, DirectoryEntry* entries, int max_
         return -1;
     }
 
-    uint8_t* block = malloc(BLOCK_SIZE);
+    uint32_t entries_per_block = get_block_size() / sizeof(DirectoryEntry);
+    if (*cookie >= entries_per_block || max_entries == 0) {
+        return 0;
+    }
+
+    uint8_t* block = malloc(get_block_size());
     if (!block) {
         return -1;
     }
@@ -160,19 +225,81 @@ int read_directory_entries(uint32_t dir_inode, DirectoryEntry* entries, int max_
     }
 
     DirectoryEntry* dir_entries = (DirectoryEntry*)block;
-    int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
+    uint32_t slot = *cookie;
     int count = 0;
 
-    for (int i = 0; i < entries_per_block && count < max_entries; i++) {
-        if (dir_entries[i].name[0] != '\0') {
-            entries[count++] = dir_entries[i];
+    for (; slot < entries_per_block && count < max_entries; slot++) {
+        if (dir_entries[slot].name[0] != '\0') {
+            entries[count++] = dir_entries[slot];
         }
     }
 
+    *cookie = slot;
     free(block);
     return count;
 }
 
+/* Read directory entries */
+int read_directory_entries(uint32_t dir_inode, DirectoryEntry* entries, int max_entries) {
+    uint32_t cookie = 0;
+    return read_directory_entries_from(dir_inode, &cookie, entries, max_entries);
+}
+
+/* Give an inode its own data block before a write if a snapshot shares the current one;
+ * the caller writes the whole block and saves the inode */
+static int unshare_data_block(Inode* inode) {
+    if (get_inode_view() != 0) {
+        return -1;
+    }
+    if (inode->data_block == 0) {
+        return 0;
+    }
+
+    uint64_t block = replace_shared_block(inode->data_block);
+    if (block == (uint64_t)-1) {
+        return -1;
+    }
+    inode->data_block = block;
+    return 0;
+}
+
+/* Write a file's whole data block, allocating it on first write. In dedup mode a block
+ * already holding the same bytes is shared instead; otherwise a shared block is first
+ * replaced by a private one. The caller saves the inode */
+static int store_data_block(Inode* inode, const uint8_t* block) {
+    if (get_inode_view() != 0) {
+        return -1;
+    }
+
+    uint64_t duplicate = find_duplicate_block(block);
+    if (duplicate != (uint64_t)-1) {
+        if (duplicate == inode->data_block) {
+            return 0; /* Unchanged */
+        }
+        if (share_block(duplicate) == 0) {
+            if (inode->data_block != 0) {
+                free_block(inode->data_block);
+            }
+            inode->data_block = duplicate;
+            TFS_STAT_ADD(dedup_hits, 1);
+            return 0;
+        }
+    }
+
+    if (inode->data_block == 0) {
+        inode->data_block = allocate_block();
+        if (inode->data_block == (uint64_t)-1) {
+            inode->data_block = 0;
+            return -1;
+        }
+    }
+    if (unshare_data_block(inode) < 0 || write_block(inode->data_block, block) < 0) {
+        return -1;
+    }
+    note_data_block(inode->data_block, block);
+    return 0;
+}
+
 /* Add directory entry */
 int add_directory_entry(uint32_t dir_inode, const char* name, uint32_t inode_num, uint8_t type) {
     Inode inode;
@@ -184,7 +311,7 @@ int add_directory_entry(uint32_t dir_inode, const char* name, uint32_t inode_num
         return -1;
     }
 
-    uint8_t* block = malloc(BLOCK_SIZE);
+    uint8_t* block = malloc(get_block_size());
     if (!block) {
         return -1;
     }
@@ -195,7 +322,7 @@ int add_directory_entry(uint32_t dir_inode, const char* name, uint32_t inode_num
     }
 
     DirectoryEntry* entries = (DirectoryEntry*)block;
-    int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
+    int entries_per_block = get_block_size() / sizeof(DirectoryEntry);
 
     /* Check if entry already exists */
     for (int i = 0; i < entries_per_block; i++) {
@@ -213,7 +340,7 @@ int add_directory_entry(uint32_t dir_inode, const char* name, uint32_t inode_num
             entries[i].inode_num = inode_num;
             entries[i].type = type;
             
-            if (write_block(inode.data_block, block) < 0) {
+            if (unshare_data_block(&inode) < 0 || write_block(inode.data_block, block) < 0) {
                 free(block);
                 return -1;
             }
@@ -240,7 +367,7 @@ int remove_directory_entry(uint32_t dir_inode, const char* name) {
         return -1;
     }
 
-    uint8_t* block = malloc(BLOCK_SIZE);
+    uint8_t* block = malloc(get_block_size());
     if (!block) {
         return -1;
     }
@@ -251,13 +378,13 @@ int remove_directory_entry(uint32_t dir_inode, const char* name) {
     }
 
     DirectoryEntry* entries = (DirectoryEntry*)block;
-    int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
+    int entries_per_block = get_block_size() / sizeof(DirectoryEntry);
 
     for (int i = 0; i < entries_per_block; i++) {
         if (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) == 0) {
             memset(&entries[i], 0, sizeof(DirectoryEntry));
             
-            if (write_block(inode.data_block, block) < 0) {
+            if (unshare_data_block(&inode) < 0 || write_block(inode.data_block, block) < 0) {
                 free(block);
                 return -1;
             }
@@ -275,8 +402,8 @@ int remove_directory_entry(uint32_t dir_inode, const char* name) {
 
 /* Check if directory is empty */
 bool is_directory_empty(uint32_t dir_inode) {
-    DirectoryEntry entries[16];
-    int count = read_directory_entries(dir_inode, entries, 16);
+    DirectoryEntry entry;
+    int count = read_directory_entries(dir_inode, &entry, 1);
     return count == 0;
 }
 
@@ -287,80 +414,20 @@ int get_file_descriptor(uint32_t inode_num, uint8_t mode) {
         return -1;
     }
 
-    open_file_table[index].inode_num = inode_num;
-    open_file_table[index].position = 0;
-    open_file_table[index].mode = mode;
-    open_file_table[index].in_use = true;
-
-    return index;
-}
+    OpenFileEntry* entry = get_open_file_entry(index);
+    entry->position = 0;
+    entry->mode = mode;
 
-/* Create a file or directory */
-int createFile(const char* path, uint8_t type) {
-    if (!path) {
+    if (attach_open_file(index, inode_num) < 0) {
+        release_open_file(index);
         return -1;
     }
 
-    if (load_superblock() < 0) {
-        return -1;
-    }
-
-    /* Find parent directory */
-    char parent_path[MAX_PATH_LEN];
-    char filename[MAX_FILENAME_LEN];
-    
-    const char* last_slash = strrchr(path, '/');
-    if (!last_slash || last_slash == path) {
-        /* Root directory or invalid path */
-        strncpy(parent_path, "/", MAX_PATH_LEN - 1);
-        strncpy(filename, path + (path[0] == '/' ? 1 : 0), MAX_FILENAME_LEN - 1);
-    } else {
-        size_t parent_len = last_slash - path;
-        if (parent_len == 0) parent_len = 1;
-        strncpy(parent_path, path, parent_len);
-        parent_path[parent_len] = '\0';
-        if (parent_path[0] != '/') {
-            parent_path[0] = '/';
-            parent_path[1] = '\0';
-        }
-        strncpy(filename, last_slash + 1, MAX_FILENAME_LEN - 1);
-    }
-
-    filename[MAX_FILENAME_LEN - 1] = '\0';
-
-    uint32_t parent_inode = find_inode_by_path(parent_path);
-    if (parent_inode == (uint32_t)-1) {
-        return -1;
-    }
-
-    /* Check if file already exists */
-    Inode parent;
-    if (load_inode(parent_inode, &parent) < 0) {
-        return -1;
-    }
-
-    uint8_t* block = malloc(BLOCK_SIZE);
-    if (!block) {
-        return -1;
-    }
-
-    if (read_block(parent.data_block, block) < 0) {
-        free(block);
-        return -1;
-    }
-
-    DirectoryEntry* entries = (DirectoryEntry*)block;
-    int entries_per_block = BLOCK_SIZE / sizeof(DirectoryEntry);
-
-    for (int i = 0; i < entries_per_block; i++) {
-        if (entries[i].name[0] != '\0' && strcmp(entries[i].name, filename) == 0) {
-            free(block);
-            return -1; /* File already exists */
-        }
-    }
-
-    free(block);
+    return index;
+}
 
+/* Allocate and link a new child the caller knows does not exist yet; returns its inode */
+static int new_child_inode(uint32_t parent_inode, const char* filename, uint8_t type) {
     /* Allocate new inode */
     uint32_t new_inode = allocate_inode();
     if (new_inode == (uint32_t)-1) {
@@ -379,13 +446,13 @@ int createFile(const char* path, uint8_t type) {
     if (type == TYPE_DIRECTORY) {
         /* Allocate data block for directory entries */
         inode.data_block = allocate_block();
-        if (inode.data_block == (uint32_t)-1) {
+        if (inode.data_block == (uint64_t)-1) {
             free_inode(new_inode);
             return -1;
         }
 
         /* Initialize directory as empty */
-        uint8_t* dir_block = calloc(BLOCK_SIZE, 1);
+        uint8_t* dir_block = calloc(get_block_size(), 1);
         if (!dir_block) {
             free_block(inode.data_block);
             free_inode(new_inode);
@@ -414,16 +481,53 @@ int createFile(const char* path, uint8_t type) {
         return -1;
     }
 
-    return 0;
+    return (int)new_inode;
 }
 
-/* Open a file */
-int openFile(const char* path, uint8_t mode) {
-    uint32_t inode_num = find_inode_by_path(path);
-    if (inode_num == (uint32_t)-1) {
+/* Create a file or directory inside a resolved parent (runs inside the caller's batch) */
+static int create_in_directory(uint32_t parent_inode, const char* filename, uint8_t type) {
+    /* Check if file already exists */
+    if (lookup_child(parent_inode, filename) != (uint32_t)-1) {
+        return -1;
+    }
+
+    return new_child_inode(parent_inode, filename, type);
+}
+
+/* Body of createFileAt */
+static int create_file_at(int dirfd, const char* path, uint8_t type) {
+    char filename[MAX_FILENAME_LEN];
+    uint32_t parent_inode = resolve_parent_at(dirfd, path, filename);
+    if (parent_inode == (uint32_t)-1) {
         return -1;
     }
 
+    /* Inode, bitmap and parent updates reach disk in one flush */
+    tfs_begin_batch();
+    int result = (create_in_directory(parent_inode, filename, type) < 0) ? -1 : 0;
+    if (tfs_commit_batch() < 0) {
+        return -1;
+    }
+    return result;
+}
+
+/* Create a file or directory relative to a directory handle */
+int createFileAt(int dirfd, const char* path, uint8_t type) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = create_file_at(dirfd, path, type);
+    TFS_OP_END(STAT_OP_CREATE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Create a file or directory */
+int createFile(const char* path, uint8_t type) {
+    return createFileAt(TFS_ROOT_FD, path, type);
+}
+
+/* Open an inode as a descriptor after checking its type */
+static int open_inode_as(uint32_t inode_num, uint8_t mode, uint8_t type) {
     Inode inode;
     if (load_inode(inode_num, &inode) < 0) {
         return -1;
@@ -434,20 +538,140 @@ int openFile(const char* path, uint8_t mode) {
         return -1;
     }
 
-    if (inode.type != TYPE_FILE) {
-        return -1; /* Not a file */
+    if (inode.type != type) {
+        return -1;
     }
 
-    int fd = get_file_descriptor(inode_num, mode);
-    if (fd < 0) {
+    return get_file_descriptor(inode_num, mode);
+}
+
+/* Body of openFileAt */
+static int open_file_at(int dirfd, const char* path, uint8_t mode) {
+    uint32_t start = resolve_dirfd(dirfd, path);
+    if (start == (uint32_t)-1) {
         return -1;
     }
 
-    return fd;
+    uint32_t inode_num = walk_path(start, path);
+    if (inode_num == (uint32_t)-1) {
+        return -1;
+    }
+
+    /* Files inside a snapshot open read-only */
+    if (get_inode_view() != 0 && (mode & (MODE_WRITE | MODE_APPEND))) {
+        return -1;
+    }
+
+    return open_inode_as(inode_num, mode, TYPE_FILE);
 }
 
-/* Close a file */
-int closeFile(int fd) {
+/* Open a file relative to a directory handle */
+int openFileAt(int dirfd, const char* path, uint8_t mode) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = open_file_at(dirfd, path, mode);
+    TFS_OP_END(STAT_OP_OPEN, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Open a file */
+int openFile(const char* path, uint8_t mode) {
+    return openFileAt(TFS_ROOT_FD, path, mode);
+}
+
+/* Body of openInode */
+static int open_inode(uint32_t inode_num, uint8_t mode) {
+    if (select_inode_view(0) < 0) {
+        return -1;
+    }
+    return open_inode_as(inode_num, mode, TYPE_FILE);
+}
+
+/* Open a file directly by inode number, skipping path resolution */
+int openInode(uint32_t inode_num, uint8_t mode) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = open_inode(inode_num, mode);
+    TFS_OP_END(STAT_OP_OPEN, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of openDirectoryAt */
+static int open_directory_at(int dirfd, const char* path) {
+    uint32_t start = resolve_dirfd(dirfd, path);
+    if (start == (uint32_t)-1) {
+        return -1;
+    }
+
+    uint32_t inode_num = walk_path(start, path);
+    if (inode_num == (uint32_t)-1) {
+        return -1;
+    }
+
+    return open_inode_as(inode_num, MODE_READ, TYPE_DIRECTORY);
+}
+
+/* Open a directory handle relative to another one */
+int openDirectoryAt(int dirfd, const char* path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = open_directory_at(dirfd, path);
+    TFS_OP_END(STAT_OP_OPEN, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Open a directory handle for use with the *_at calls */
+int openDirectory(const char* path) {
+    return openDirectoryAt(TFS_ROOT_FD, path);
+}
+
+/* Body of openSnapshot */
+static int open_snapshot(const char* name) {
+    Superblock* sb = get_superblock();
+    int snapshot = find_snapshot(name);
+    if (!sb || snapshot < 0 || select_inode_view(snapshot) < 0) {
+        return -1;
+    }
+    return open_inode_as(sb->root_inode, MODE_READ, TYPE_DIRECTORY);
+}
+
+/* Open the root of a snapshot as a directory handle; everything reached through it is
+ * read-only and unaffected by later changes to the live volume */
+int openSnapshot(const char* name) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = open_snapshot(name);
+    TFS_OP_END(STAT_OP_OPEN, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of lookupAt */
+static int lookup_at(int dirfd, const char* path) {
+    uint32_t start = resolve_dirfd(dirfd, path);
+    if (start == (uint32_t)-1) {
+        return -1;
+    }
+
+    uint32_t inode_num = walk_path(start, path);
+    return (inode_num != (uint32_t)-1) ? (int)inode_num : -1;
+}
+
+/* Resolve a path relative to a directory handle to an inode number */
+int lookupAt(int dirfd, const char* path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = lookup_at(dirfd, path);
+    TFS_OP_END(STAT_OP_LOOKUP, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of closeFile */
+static int close_file(int fd) {
     OpenFileEntry* entry = get_open_file_entry(fd);
     if (!entry) {
         return -1;
@@ -456,9 +680,19 @@ int closeFile(int fd) {
     return release_open_file(fd);
 }
 
-/* Read from a file */
-int readFile(int fd, void* buffer, uint32_t size) {
-    OpenFileEntry* entry = get_open_file_entry(fd);
+/* Close a file */
+int closeFile(int fd) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = close_file(fd);
+    TFS_OP_END(STAT_OP_CLOSE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of readFile */
+static int read_file(int fd, void* buffer, uint32_t size) {
+    OpenFileEntry* entry = open_entry(fd);
     if (!entry || !buffer) {
         return -1;
     }
@@ -486,10 +720,10 @@ int readFile(int fd, void* buffer, uint32_t size) {
 
     uint32_t bytes_to_read = size;
     if (entry->position + bytes_to_read > inode.size) {
-        bytes_to_read = inode.size - entry->position;
+        bytes_to_read = (uint32_t)(inode.size - entry->position);
     }
 
-    uint8_t* block = malloc(BLOCK_SIZE);
+    uint8_t* block = malloc(get_block_size());
     if (!block) {
         return -1;
     }
@@ -500,15 +734,26 @@ int readFile(int fd, void* buffer, uint32_t size) {
     }
 
     memcpy(buffer, block + entry->position, bytes_to_read);
+    TFS_STAT_ADD(bytes_copied, bytes_to_read);
     entry->position += bytes_to_read;
 
     free(block);
     return bytes_to_read;
 }
 
-/* Write to a file */
-int writeFile(int fd, const void* buffer, uint32_t size) {
-    OpenFileEntry* entry = get_open_file_entry(fd);
+/* Read from a file */
+int readFile(int fd, void* buffer, uint32_t size) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = read_file(fd, buffer, size);
+    TFS_OP_END(STAT_OP_READ, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of writeFile */
+static int write_file(int fd, const void* buffer, uint32_t size) {
+    OpenFileEntry* entry = open_entry(fd);
     if (!entry || !buffer) {
         return -1;
     }
@@ -526,33 +771,29 @@ int writeFile(int fd, const void* buffer, uint32_t size) {
         return -1;
     }
 
-    /* Allocate data block if needed */
-    if (inode.data_block == 0) {
-        inode.data_block = allocate_block();
-        if (inode.data_block == (uint32_t)-1) {
-            return -1;
-        }
-    }
-
-    uint8_t* block = malloc(BLOCK_SIZE);
+    /* A file without a data block reads as zeros; the block is allocated when written */
+    uint8_t* block = calloc(get_block_size(), 1);
     if (!block) {
         return -1;
     }
 
-    if (read_block(inode.data_block, block) < 0) {
+    if (inode.data_block != 0 && read_block(inode.data_block, block) < 0) {
         free(block);
         return -1;
     }
 
-    uint32_t write_pos = (entry->mode & MODE_APPEND) ? inode.size : entry->position;
+    uint64_t write_pos = (entry->mode & MODE_APPEND) ? inode.size : entry->position;
     uint32_t bytes_to_write = size;
-    if (write_pos + bytes_to_write > BLOCK_SIZE) {
-        bytes_to_write = BLOCK_SIZE - write_pos;
+    if (write_pos >= get_block_size()) {
+        bytes_to_write = 0;
+    } else if (write_pos + bytes_to_write > get_block_size()) {
+        bytes_to_write = get_block_size() - (uint32_t)write_pos;
     }
 
     memcpy(block + write_pos, buffer, bytes_to_write);
+    TFS_STAT_ADD(bytes_copied, bytes_to_write);
     
-    if (write_block(inode.data_block, block) < 0) {
+    if (store_data_block(&inode, block) < 0) {
         free(block);
         return -1;
     }
@@ -568,13 +809,106 @@ int writeFile(int fd, const void* buffer, uint32_t size) {
     return bytes_to_write;
 }
 
-/* Delete a file */
-int deleteFile(const char* path) {
-    uint32_t inode_num = find_inode_by_path(path);
-    if (inode_num == (uint32_t)-1) {
+/* Write to a file */
+int writeFile(int fd, const void* buffer, uint32_t size) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = write_file(fd, buffer, size);
+    TFS_OP_END(STAT_OP_WRITE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Write a file's entry into its parent's directory block as the disk has it, leaving the
+ * parent's other changes held. A parent whose inode on the disk does not point at that block
+ * yet (a directory made, or moved off a shared block, since the last write-back) has no
+ * block there to add to; then everything held is written back instead */
+static int flush_directory_entry(const Inode* inode) {
+    Superblock* sb = get_superblock();
+    if (!sb || inode->inode_num == sb->root_inode) {
+        return 0;
+    }
+    Inode parent;
+    Inode stored;
+    if (load_inode(inode->parent_inode, &parent) < 0 ||
+        load_stored_inode(inode->parent_inode, &stored) < 0) {
+        return -1;
+    }
+    if (!stored.used || stored.type != TYPE_DIRECTORY || stored.data_block != parent.data_block) {
+        return tfs_batch_active() ? -1 : flush_writeback();
+    }
+
+    uint32_t block_size = get_block_size();
+    uint8_t* current = malloc(block_size);
+    uint8_t* on_disk = malloc(block_size);
+    if (!current || !on_disk || read_block(parent.data_block, current) < 0 ||
+        read_disk_block(parent.data_block, on_disk) < 0) {
+        free(current);
+        free(on_disk);
+        return -1;
+    }
+
+    /* The queued block keeps its other changes; this one entry goes straight to the disk */
+    DirectoryEntry* entries = (DirectoryEntry*)current;
+    DirectoryEntry* stored_entries = (DirectoryEntry*)on_disk;
+    int entries_per_block = block_size / sizeof(DirectoryEntry);
+    int status = 0;
+    for (int i = 0; i < entries_per_block; i++) {
+        if (entries[i].name[0] == '\0' || entries[i].inode_num != inode->inode_num) {
+            continue;
+        }
+        if (memcmp(&stored_entries[i], &entries[i], sizeof(DirectoryEntry)) != 0) {
+            stored_entries[i] = entries[i];
+            const uint8_t* run[1] = {on_disk};
+            status = write_block_vector(parent.data_block, 1, run);
+        }
+        break;
+    }
+    free(current);
+    free(on_disk);
+    return status;
+}
+
+/* Body of fsyncFile */
+static int fsync_file(int fd) {
+    OpenFileEntry* entry = open_entry(fd);
+    if (!entry) {
+        return -1;
+    }
+    if (entry->snapshot != 0) {
+        return 0; /* Snapshot files never change */
+    }
+
+    Inode inode;
+    if (load_inode(entry->inode_num, &inode) < 0) {
+        return -1;
+    }
+
+    /* The data first, then its allocation bit, the inode pointing at it and the entry naming
+     * the inode, so the disk never holds metadata ahead of what it refers to. Each goes into
+     * its block as the disk has it, without other files' changes held in the same block */
+    if (inode.data_block != 0 && (flush_queued_range(inode.data_block, 1) < 0 ||
+                                  flush_block_allocation(inode.data_block) < 0)) {
+        return -1;
+    }
+    if (flush_inode(inode.inode_num) < 0 || flush_directory_entry(&inode) < 0) {
         return -1;
     }
+    return sync_disk();
+}
+
+/* Make one file's data and metadata durable without writing back anything else held */
+int fsyncFile(int fd) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = fsync_file(fd);
+    TFS_OP_END(STAT_OP_FSYNC, result);
+    tfs_unlock();
+    return result;
+}
 
+/* Delete a file by inode (runs inside the caller's batch) */
+static int delete_file_inode(uint32_t inode_num) {
     Inode inode;
     if (load_inode(inode_num, &inode) < 0) {
         return -1;
@@ -590,18 +924,14 @@ int deleteFile(const char* path) {
     }
 
     /* Close any open file descriptors for this file */
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (open_file_table[i].in_use && open_file_table[i].inode_num == inode_num) {
-            release_open_file(i);
-        }
-    }
+    release_inode_open_files(inode_num);
 
     /* Store filename before removing directory entry (inode.name might be needed) */
     char filename[MAX_FILENAME_LEN];
     strncpy(filename, inode.name, MAX_FILENAME_LEN - 1);
     filename[MAX_FILENAME_LEN - 1] = '\0';
     uint32_t parent_inode = inode.parent_inode;
-    uint32_t data_block = inode.data_block;
+    uint64_t data_block = inode.data_block;
 
     /* Remove from parent directory */
     if (remove_directory_entry(parent_inode, filename) < 0) {
@@ -625,24 +955,227 @@ int deleteFile(const char* path) {
     return 0;
 }
 
+/* Body of deleteFileAt */
+static int delete_file_at(int dirfd, const char* path) {
+    int inode_num = lookup_at(dirfd, path);
+    if (inode_num < 0 || get_inode_view() != 0) {
+        return -1;
+    }
+
+    tfs_begin_batch();
+    int result = delete_file_inode((uint32_t)inode_num);
+    if (tfs_commit_batch() < 0) {
+        return -1;
+    }
+    return result;
+}
+
+/* Delete a file relative to a directory handle */
+int deleteFileAt(int dirfd, const char* path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = delete_file_at(dirfd, path);
+    TFS_OP_END(STAT_OP_DELETE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Delete a file */
+int deleteFile(const char* path) {
+    return deleteFileAt(TFS_ROOT_FD, path);
+}
+
+/* Store buf as the file's contents (runs inside the caller's batch) */
+static int write_whole_inode(uint32_t inode_num, const void* buffer, uint32_t size, int flags) {
+    Inode inode;
+    if (load_inode(inode_num, &inode) < 0) {
+        return -1;
+    }
+
+    if (!inode.used || inode.type != TYPE_FILE) {
+        return -1;
+    }
+
+    uint32_t bytes_to_write = (size > get_block_size()) ? get_block_size() : size;
+
+    uint8_t* block = calloc(get_block_size(), 1);
+    if (!block) {
+        return -1;
+    }
+
+    if (inode.data_block != 0 && !(flags & WRITE_TRUNCATE)) {
+        /* Keep the old tail beyond the new contents */
+        if (read_block(inode.data_block, block) < 0) {
+            free(block);
+            return -1;
+        }
+    }
+
+    if (bytes_to_write > 0) {
+        memcpy(block, buffer, bytes_to_write);
+        TFS_STAT_ADD(bytes_copied, bytes_to_write);
+    }
+
+    if (store_data_block(&inode, block) < 0) {
+        free(block);
+        return -1;
+    }
+    free(block);
+
+    if ((flags & WRITE_TRUNCATE) || bytes_to_write > inode.size) {
+        inode.size = bytes_to_write;
+    }
+
+    /* Keep descriptors already open on the file inside the new size */
+    for (int fd = first_open_file(inode_num); fd >= 0; ) {
+        OpenFileEntry* entry = get_open_file_entry(fd);
+        if (entry->position > inode.size) {
+            entry->position = inode.size;
+        }
+        fd = entry->next_fd;
+    }
+
+    if (save_inode(&inode) < 0) {
+        return -1;
+    }
+
+    return (int)bytes_to_write;
+}
+
+/* Body of writeWholeFileAt */
+static int write_whole_file_at(int dirfd, const char* path, const void* buffer, uint32_t size, int flags) {
+    if (!buffer && size > 0) {
+        return -1;
+    }
+
+    char filename[MAX_FILENAME_LEN];
+    uint32_t parent_inode = resolve_parent_at(dirfd, path, filename);
+    if (parent_inode == (uint32_t)-1) {
+        return -1;
+    }
+
+    /* Creation, allocation and size update go out in a single metadata flush */
+    tfs_begin_batch();
+
+    bool created = false;
+    int inode_num = (int)lookup_child(parent_inode, filename);
+    if (inode_num < 0 && (flags & WRITE_CREATE)) {
+        inode_num = new_child_inode(parent_inode, filename, TYPE_FILE);
+        created = (inode_num >= 0);
+    }
+
+    int result = -1;
+    if (inode_num >= 0) {
+        result = write_whole_inode((uint32_t)inode_num, buffer, size, flags);
+        if (result < 0 && created) {
+            delete_file_inode((uint32_t)inode_num);
+        }
+    }
+
+    if (tfs_commit_batch() < 0) {
+        return -1;
+    }
+    return result;
+}
+
+/* Replace a file's contents in one call, optionally creating it first */
+int writeWholeFileAt(int dirfd, const char* path, const void* buffer, uint32_t size, int flags) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = write_whole_file_at(dirfd, path, buffer, size, flags);
+    TFS_OP_END(STAT_OP_WRITE_WHOLE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Replace a file's contents in one call, optionally creating it first */
+int writeWholeFile(const char* path, const void* buffer, uint32_t size, int flags) {
+    return writeWholeFileAt(TFS_ROOT_FD, path, buffer, size, flags);
+}
+
+/* Body of cloneFileAt */
+static int clone_file_at(int src_dirfd, const char* src_path, int dst_dirfd, const char* dst_path) {
+    /* The source may be inside a snapshot; read it before the destination selects the live
+     * inode table */
+    uint32_t start = resolve_dirfd(src_dirfd, src_path);
+    Inode source;
+    if (start == (uint32_t)-1 || load_inode(walk_path(start, src_path), &source) < 0 ||
+        !source.used || source.type != TYPE_FILE) {
+        return -1;
+    }
+
+    char filename[MAX_FILENAME_LEN];
+    uint32_t parent_inode = resolve_parent_at(dst_dirfd, dst_path, filename);
+    if (parent_inode == (uint32_t)-1) {
+        return -1;
+    }
+
+    tfs_begin_batch();
+
+    int result = -1;
+    int inode_num = create_in_directory(parent_inode, filename, TYPE_FILE);
+    if (inode_num >= 0) {
+        /* The clone points at the source's block; the first write to either copies it */
+        Inode clone;
+        if (load_inode((uint32_t)inode_num, &clone) == 0 &&
+            (source.data_block == 0 || share_block(source.data_block) == 0)) {
+            clone.data_block = source.data_block;
+            clone.size = source.size;
+            result = save_inode(&clone);
+        }
+        if (result < 0) {
+            delete_file_inode((uint32_t)inode_num);
+        }
+    }
+
+    if (tfs_commit_batch() < 0) {
+        return -1;
+    }
+    return result;
+}
+
+/* Create dst_path as a copy of src_path that shares its data until either is written */
+int cloneFileAt(int src_dirfd, const char* src_path, int dst_dirfd, const char* dst_path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = clone_file_at(src_dirfd, src_path, dst_dirfd, dst_path);
+    TFS_OP_END(STAT_OP_CLONE, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Create dst_path as a copy of src_path that shares its data until either is written */
+int cloneFile(const char* src_path, const char* dst_path) {
+    return cloneFileAt(TFS_ROOT_FD, src_path, TFS_ROOT_FD, dst_path);
+}
+
+/* Search for a file relative to a directory handle */
+int searchFileAt(int dirfd, const char* path) {
+    return (lookupAt(dirfd, path) >= 0) ? 0 : -1;
+}
+
 /* Search for a file */
 int searchFile(const char* path) {
-    uint32_t inode_num = find_inode_by_path(path);
-    return (inode_num != (uint32_t)-1) ? 0 : -1;
+    return searchFileAt(TFS_ROOT_FD, path);
+}
+
+/* Make a directory relative to a directory handle */
+int makeDirectoryAt(int dirfd, const char* path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = create_file_at(dirfd, path, TYPE_DIRECTORY);
+    TFS_OP_END(STAT_OP_MKDIR, result);
+    tfs_unlock();
+    return result;
 }
 
 /* Make a directory */
 int makeDirectory(const char* path) {
-    return createFile(path, TYPE_DIRECTORY);
+    return makeDirectoryAt(TFS_ROOT_FD, path);
 }
 
-/* Remove a directory */
-int removeDirectory(const char* path) {
-    uint32_t inode_num = find_inode_by_path(path);
-    if (inode_num == (uint32_t)-1) {
-        return -1;
-    }
-
+/* Remove a directory by inode (runs inside the caller's batch) */
+static int remove_directory_inode(uint32_t inode_num) {
     Inode inode;
     if (load_inode(inode_num, &inode) < 0) {
         return -1;
@@ -672,6 +1205,9 @@ int removeDirectory(const char* path) {
         return -1;
     }
 
+    /* Invalidate any directory handles */
+    release_inode_open_files(inode_num);
+
     /* Free data block */
     if (inode.data_block != 0) {
         free_block(inode.data_block);
@@ -683,46 +1219,186 @@ int removeDirectory(const char* path) {
     return 0;
 }
 
-/* List directory contents */
-int listDirectory(const char* path, char* output, uint32_t output_size) {
-    uint32_t inode_num = find_inode_by_path(path);
-    if (inode_num == (uint32_t)-1) {
+/* Body of removeDirectoryAt */
+static int remove_directory_at(int dirfd, const char* path) {
+    int inode_num = lookup_at(dirfd, path);
+    if (inode_num < 0 || get_inode_view() != 0) {
         return -1;
     }
 
-    Inode inode;
-    if (load_inode(inode_num, &inode) < 0) {
+    tfs_begin_batch();
+    int result = remove_directory_inode((uint32_t)inode_num);
+    if (tfs_commit_batch() < 0) {
         return -1;
     }
+    return result;
+}
 
-    if (inode.type != TYPE_DIRECTORY) {
+/* Remove a directory relative to a directory handle */
+int removeDirectoryAt(int dirfd, const char* path) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = remove_directory_at(dirfd, path);
+    TFS_OP_END(STAT_OP_RMDIR, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Remove a directory */
+int removeDirectory(const char* path) {
+    return removeDirectoryAt(TFS_ROOT_FD, path);
+}
+
+/* Body of readDirectory */
+static int read_directory(int dirfd, DirectoryEntry* entries, int max_entries) {
+    OpenFileEntry* entry = open_entry(dirfd);
+    if (!entry) {
         return -1;
     }
 
-    DirectoryEntry entries[16];
-    int count = read_directory_entries(inode_num, entries, 16);
-    if (count < 0) {
+    /* The handle's position is the resume cookie */
+    uint32_t cookie = (uint32_t)entry->position;
+    int count = read_directory_entries_from(entry->inode_num, &cookie, entries, max_entries);
+    entry->position = cookie;
+    return count;
+}
+
+/* Read the next batch of entries from a directory handle */
+int readDirectory(int dirfd, DirectoryEntry* entries, int max_entries) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = read_directory(dirfd, entries, max_entries);
+    TFS_OP_END(STAT_OP_READDIR, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of readDirectoryPlus */
+static int read_directory_plus(int dirfd, DirectoryEntryPlus* entries, int max_entries) {
+    if (!entries || max_entries < 0) {
         return -1;
     }
 
-    output[0] = '\0';
-    int written = 0;
-
-    for (int i = 0; i < count; i++) {
-        char line[MAX_FILENAME_LEN + 10];
-        snprintf(line, sizeof(line), "%s %s\n", 
-                entries[i].type == TYPE_DIRECTORY ? "DIR" : "FILE",
-                entries[i].name);
-        
-        if (written + strlen(line) >= output_size - 1) {
+    DirectoryEntry batch[16];
+    int total = 0;
+
+    while (total < max_entries) {
+        int want = max_entries - total;
+        int count = read_directory(dirfd, batch, want < 16 ? want : 16);
+        if (count < 0) {
+            return -1;
+        }
+        if (count == 0) {
             break;
         }
-        
-        strcat(output, line);
-        written += strlen(line);
+
+        /* Attributes come straight from the cached inode table: no path walk per entry */
+        for (int i = 0; i < count; i++) {
+            Inode inode;
+            if (load_inode(batch[i].inode_num, &inode) < 0) {
+                return -1;
+            }
+
+            DirectoryEntryPlus* out = &entries[total++];
+            memcpy(out->name, batch[i].name, MAX_FILENAME_LEN);
+            out->inode_num = batch[i].inode_num;
+            out->type = inode.type;
+            out->size = inode.size;
+            out->block_count = (inode.data_block != 0) ? 1 : 0;
+        }
     }
 
-    return count;
+    return total;
+}
+
+/* Read the next batch of entries together with their inode attributes */
+int readDirectoryPlus(int dirfd, DirectoryEntryPlus* entries, int max_entries) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = read_directory_plus(dirfd, entries, max_entries);
+    TFS_OP_END(STAT_OP_READDIRPLUS, result);
+    tfs_unlock();
+    return result;
+}
+
+/* Entry of an open directory handle, or NULL for a file or closed handle */
+static OpenFileEntry* open_directory_entry(int dirfd) {
+    OpenFileEntry* entry = open_entry(dirfd);
+    if (!entry) {
+        return NULL;
+    }
+
+    Inode inode;
+    if (load_inode(entry->inode_num, &inode) < 0 || inode.type != TYPE_DIRECTORY) {
+        return NULL;
+    }
+    return entry;
 }
 
+/* Get the resume cookie of a directory handle */
+int tellDirectory(int dirfd, uint32_t* cookie) {
+    tfs_lock();
+    OpenFileEntry* entry = cookie ? open_directory_entry(dirfd) : NULL;
+    if (entry) {
+        *cookie = (uint32_t)entry->position;
+    }
+    tfs_unlock();
+    return entry ? 0 : -1;
+}
 
+/* Resume a directory handle from a cookie returned by tellDirectory (0 rewinds) */
+int seekDirectory(int dirfd, uint32_t cookie) {
+    tfs_lock();
+    OpenFileEntry* entry = open_directory_entry(dirfd);
+    if (entry) {
+        entry->position = cookie;
+    }
+    tfs_unlock();
+    return entry ? 0 : -1;
+}
+
+/* Body of listDirectory */
+static int list_directory(const char* path, char* output, uint32_t output_size) {
+    if (!output || output_size == 0) {
+        return -1;
+    }
+
+    uint32_t inode_num = find_inode_by_path(path);
+    if (inode_num == (uint32_t)-1) {
+        return -1;
+    }
+
+    output[0] = '\0';
+    uint32_t written = 0;
+    uint32_t cookie = 0;
+    int total = 0;
+    DirectoryEntry entries[16];
+    int count;
+
+    while ((count = read_directory_entries_from(inode_num, &cookie, entries, 16)) > 0) {
+        for (int i = 0; i < count; i++) {
+            /* Append in place; lines that do not fit are counted but dropped */
+            int len = snprintf(output + written, output_size - written, "%s %s\n",
+                               entries[i].type == TYPE_DIRECTORY ? "DIR" : "FILE",
+                               entries[i].name);
+            if (len < 0 || written + (uint32_t)len >= output_size) {
+                output[written] = '\0';
+            } else {
+                written += (uint32_t)len;
+            }
+        }
+        total += count;
+    }
+
+    return (count < 0) ? -1 : total;
+}
+
+/* List directory contents */
+int listDirectory(const char* path, char* output, uint32_t output_size) {
+    tfs_lock();
+    TFS_OP_BEGIN();
+    int result = list_directory(path, output, output_size);
+    TFS_OP_END(STAT_OP_LIST, result);
+    tfs_unlock();
+    return result;
+}
@@ -0,0 +1,558 @@
+#define _GNU_SOURCE /* syscall */
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define IO_WORKER_THREADS 4
+#define IO_MAX_QUEUE_DEPTH 4096
+
+static const char* engine_names[] = {"auto", "io_uring", "threads", "sync"};
+
+static int requested_engine = IO_ENGINE_AUTO;
+static uint32_t queue_depth = IO_QUEUE_DEPTH;
+static int active_engine = -1;        /* Engine serving the current disk; -1 until first use */
+static int disk_fd = -1;              /* Descriptor the engine was started on */
+static uint32_t inflight = 0;         /* Submitted and not yet reaped */
+
+/* Finished requests waiting to be reaped: worker threads, sync runs and rejects */
+static BlockIo** done_ring = NULL;
+static uint32_t done_head = 0;
+static uint32_t done_count = 0;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Worker thread engine: requests handed over but not yet picked up */
+static BlockIo** work_ring = NULL;
+static uint32_t work_head = 0;
+static uint32_t work_count = 0;
+static bool workers_stopping = false;
+static pthread_t workers[IO_WORKER_THREADS];
+static int worker_count = 0;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+/* io_uring engine: rings shared with the kernel */
+static struct {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    uint32_t entries;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+} ring = {.fd = -1};
+
+/* Choose the engine and queue depth for the next disk I/O; stops the running engine */
+int set_io_engine(int engine, uint32_t depth) {
+    if (engine < IO_ENGINE_AUTO || engine > IO_ENGINE_SYNC || depth > IO_MAX_QUEUE_DEPTH) {
+        return -1;
+    }
+    stop_io_engine();
+    requested_engine = engine;
+    queue_depth = depth ? depth : IO_QUEUE_DEPTH;
+    return 0;
+}
+
+/* Engine in use, or the one requested if nothing has been submitted yet */
+const char* get_io_engine_name() {
+    return engine_names[active_engine >= 0 ? active_engine : requested_engine];
+}
+
+/* Requests submitted and not yet reaped */
+uint32_t get_block_io_inflight() {
+    return inflight;
+}
+
+/* Bytes moved by a request */
+static size_t request_bytes(const BlockIo* io) {
+    return (size_t)io->count * get_block_size();
+}
+
+/* File offset of a request */
+static off_t request_offset(const BlockIo* io) {
+    return (off_t)(io->block_num * get_block_size());
+}
+
+/* Move what is left of a request after done bytes with plain pread/pwrite */
+static int transfer_rest(BlockIo* io, size_t done) {
+    uint8_t* p = (uint8_t*)io->buffer + done;
+    size_t length = request_bytes(io) - done;
+    off_t offset = request_offset(io) + (off_t)done;
+    while (length > 0) {
+        ssize_t n = io->write ? pwrite(disk_fd, p, length, offset)
+                              : pread(disk_fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -errno : -EIO;
+        }
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Queue a finished request for reaping */
+static void post_done(BlockIo* io) {
+    pthread_mutex_lock(&done_lock);
+    done_ring[(done_head + done_count) % queue_depth] = io;
+    done_count++;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+}
+
+/* Run a request through read_block/write_block and complete it at once */
+static void run_sync(BlockIo* io) {
+    uint32_t block_size = get_block_size();
+    io->result = 0;
+    for (uint32_t i = 0; i < io->count && io->result == 0; i++) {
+        uint8_t* p = (uint8_t*)io->buffer + (size_t)i * block_size;
+        int status = io->write ? write_block(io->block_num + i, p) : read_block(io->block_num + i, p);
+        io->result = status < 0 ? -EIO : 0;
+    }
+    TFS_STAT_ADD(io_sync_fallbacks, 1);
+    post_done(io);
+}
+
+/* Worker thread: pread/pwrite requests until the engine stops */
+static void* worker_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&work_lock);
+    while (true) {
+        while (work_count == 0 && !workers_stopping) {
+            pthread_cond_wait(&work_cond, &work_lock);
+        }
+        if (work_count == 0) {
+            break;
+        }
+        BlockIo* io = work_ring[work_head];
+        work_head = (work_head + 1) % queue_depth;
+        work_count--;
+        pthread_mutex_unlock(&work_lock);
+
+        io->result = transfer_rest(io, 0);
+        post_done(io);
+
+        pthread_mutex_lock(&work_lock);
+    }
+    pthread_mutex_unlock(&work_lock);
+    return NULL;
+}
+
+/* Stop the worker threads once they have finished everything handed to them */
+static void threads_stop() {
+    pthread_mutex_lock(&work_lock);
+    workers_stopping = true;
+    pthread_cond_broadcast(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    worker_count = 0;
+    free(work_ring);
+    work_ring = NULL;
+}
+
+/* Start the worker thread pool */
+static int threads_start() {
+    work_ring = calloc(queue_depth, sizeof(BlockIo*));
+    if (!work_ring) {
+        return -1;
+    }
+    work_head = 0;
+    work_count = 0;
+    workers_stopping = false;
+    for (worker_count = 0; worker_count < IO_WORKER_THREADS; worker_count++) {
+        if (pthread_create(&workers[worker_count], NULL, worker_main, NULL) != 0) {
+            threads_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int uring_setup(uint32_t entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(uint32_t opcode, void* arg, uint32_t count) {
+    return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, count, NULL, 0);
+}
+
+/* Whether the kernel has IORING_OP_READ and IORING_OP_WRITE. Both arrived in Linux 5.6 with
+ * the probe itself, so a kernel that cannot be probed does not have them */
+static bool uring_supports_rw() {
+    uint32_t ops = IORING_OP_WRITE + 1;
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + ops * sizeof(probe->ops[0]));
+    bool supported = probe && uring_register(IORING_REGISTER_PROBE, probe, ops) == 0 &&
+                     probe->ops_len >= ops &&
+                     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/* Release whatever part of the io_uring instance has been set up */
+static void uring_stop() {
+    if (ring.sqes != NULL) {
+        munmap(ring.sqes, ring.sqes_size);
+    }
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    if (ring.sq_ring != NULL) {
+        munmap(ring.sq_ring, ring.sq_ring_size);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+/* Create an io_uring instance and map its rings; fails where the kernel or a sandbox
+ * does not allow io_uring, or the kernel lacks the opcodes used */
+static int uring_start() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = uring_setup(queue_depth, &params);
+    if (ring.fd < 0) {
+        ring.fd = -1;
+        return -1;
+    }
+    if (!uring_supports_rw()) {
+        uring_stop();
+        return -1;
+    }
+    ring.entries = params.sq_entries;
+
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring.cq_ring_size > ring.sq_ring_size) {
+        ring.sq_ring_size = ring.cq_ring_size;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        ring.sq_ring = NULL;
+        uring_stop();
+        return -1;
+    }
+    ring.cq_ring = single_mmap ? ring.sq_ring
+                               : mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ring == MAP_FAILED) {
+        ring.cq_ring = NULL;
+        uring_stop();
+        return -1;
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_stop();
+        return -1;
+    }
+
+    uint8_t* sq = ring.sq_ring;
+    uint8_t* cq = ring.cq_ring;
+    ring.sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring.sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring.sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (uint32_t*)(sq + params.sq_off.array);
+    ring.cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring.cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring.cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/* Hand the queued submission entries to the kernel */
+static int uring_flush(uint32_t queued) {
+    while (queued > 0) {
+        int n = uring_enter(queued, 0, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        TFS_STAT_ADD(io_submit_calls, 1);
+        queued -= (uint32_t)n;
+    }
+    return 0;
+}
+
+/* Submit the last queued ring entries, counting each transfer once the kernel has taken it.
+ * Entries it refuses are withdrawn from the ring; returns how many */
+static uint32_t uring_submit(uint32_t queued) {
+    uint32_t tail = *ring.sq_tail;
+    uint32_t taken = tail;
+    if (uring_flush(queued) < 0) {
+        /* Without SQPOLL the kernel only reads the ring inside io_uring_enter */
+        taken = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(ring.sq_tail, taken, __ATOMIC_RELEASE);
+    }
+    for (uint32_t t = tail - queued; t != taken; t++) {
+        const BlockIo* io = (const BlockIo*)(uintptr_t)ring.sqes[t & *ring.sq_mask].user_data;
+        account_block_io(io->block_num, io->count, io->write);
+    }
+    return tail - taken;
+}
+
+/* Take finished io_uring requests off the completion ring */
+static int uring_collect(BlockIo** done, int max) {
+    uint32_t head = *ring.cq_head;
+    uint32_t tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail && n < max) {
+        struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+        BlockIo* io = (BlockIo*)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0) {
+            io->result = cqe->res;
+        } else {
+            /* A short transfer is finished synchronously */
+            io->result = ((size_t)cqe->res < request_bytes(io)) ? transfer_rest(io, cqe->res) : 0;
+        }
+        done[n++] = io;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* Bring up the engine for the current disk: sync for backends without a descriptor or
+ * async support, otherwise io_uring, falling back to worker threads */
+static int start_engine() {
+    disk_fd = get_disk_descriptor();
+    done_ring = calloc(queue_depth, sizeof(BlockIo*));
+    if (!done_ring) {
+        return -1;
+    }
+    done_head = 0;
+    done_count = 0;
+    inflight = 0;
+
+    int engine = requested_engine;
+    if (disk_fd < 0 || !(get_disk_capabilities() & BACKEND_CAP_ASYNC)) {
+        engine = IO_ENGINE_SYNC;
+    }
+    if ((engine == IO_ENGINE_AUTO || engine == IO_ENGINE_URING) && uring_start() == 0) {
+        engine = IO_ENGINE_URING;
+    } else if (engine != IO_ENGINE_SYNC) {
+        engine = (threads_start() == 0) ? IO_ENGINE_THREADS : IO_ENGINE_SYNC;
+    }
+    active_engine = engine;
+    return 0;
+}
+
+/* Wait for everything in flight, then shut the engine down; the next submit restarts it */
+void stop_io_engine() {
+    if (active_engine < 0) {
+        return;
+    }
+    drain_block_io();
+    if (active_engine == IO_ENGINE_URING) {
+        uring_stop();
+    } else if (active_engine == IO_ENGINE_THREADS) {
+        threads_stop();
+    }
+    free(done_ring);
+    done_ring = NULL;
+    active_engine = -1;
+    disk_fd = -1;
+}
+
+/* Whether a request has to run synchronously: no async engine, or O_DIRECT alignment rules
+ * it cannot meet */
+static bool needs_sync(const BlockIo* io) {
+    if (active_engine == IO_ENGINE_SYNC) {
+        return true;
+    }
+    if (get_disk_capabilities() & BACKEND_CAP_UNCACHED) {
+        return get_block_size() % DIRECT_IO_ALIGN != 0 ||
+               (uintptr_t)io->buffer % DIRECT_IO_ALIGN != 0;
+    }
+    return false;
+}
+
+/* Body of submit_block_io */
+static int submit_ios(BlockIo* const* ios, int count) {
+    uint64_t total = get_total_blocks();
+    if (!ios || count < 0 || total == 0) {
+        return -1;
+    }
+    if (active_engine < 0 && start_engine() < 0) {
+        return -1;
+    }
+    /* Requests go around the scheduler queue; nothing may still be waiting in it */
+    if (flush_block_queue() < 0) {
+        return -1;
+    }
+
+    int accepted = 0;
+    uint32_t queued = 0;
+    uint32_t withdrawn = 0;
+    for (; accepted < count && inflight < queue_depth; accepted++) {
+        BlockIo* io = ios[accepted];
+        bool invalid = !io->buffer || io->count == 0 || io->block_num >= total ||
+                       io->count > total - io->block_num;
+        bool sync = invalid || needs_sync(io);
+
+        /* Ring entries the kernel refuses are handed back as not accepted, which only works
+         * while they are the last ones accepted: submit them before finishing any request
+         * here, and when the ring is full */
+        if (queued > 0 && (sync || queued == ring.entries)) {
+            withdrawn = uring_submit(queued);
+            queued = 0;
+            if (withdrawn > 0) {
+                break;
+            }
+        }
+        inflight++;
+        TFS_STAT_ADD(io_submitted, 1);
+
+        if (invalid) {
+            io->result = -EINVAL;
+            post_done(io);
+            continue;
+        }
+        if (sync) {
+            run_sync(io);
+            continue;
+        }
+
+        if (active_engine == IO_ENGINE_THREADS) {
+            /* Async paths bypass write_block; count the transfer and mark it dirty up front */
+            account_block_io(io->block_num, io->count, io->write);
+            pthread_mutex_lock(&work_lock);
+            work_ring[(work_head + work_count) % queue_depth] = io;
+            work_count++;
+            pthread_cond_signal(&work_cond);
+            pthread_mutex_unlock(&work_lock);
+            TFS_STAT_ADD(io_submit_calls, 1);
+            continue;
+        }
+
+        uint32_t tail = *ring.sq_tail;
+        uint32_t index = tail & *ring.sq_mask;
+        struct io_uring_sqe* sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = disk_fd;
+        sqe->off = (uint64_t)request_offset(io);
+        sqe->addr = (uint64_t)(uintptr_t)io->buffer;
+        sqe->len = (uint32_t)request_bytes(io);
+        sqe->user_data = (uint64_t)(uintptr_t)io;
+        ring.sq_array[index] = index;
+        __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    if (queued > 0) {
+        withdrawn = uring_submit(queued);
+    }
+    /* Withdrawn entries never reached the kernel and will not come back from reap */
+    inflight -= withdrawn;
+    TFS_STAT_ADD(io_submitted, (uint64_t)0 - withdrawn);
+    return accepted - (int)withdrawn;
+}
+
+/* Queue requests; returns how many were accepted (fewer once the queue depth is reached or
+ * the kernel refuses more), or -1 without a disk. Each accepted request comes back exactly
+ * once from reap_block_io. Flushing the scheduler queue, the synchronous fallback and the
+ * dirty accounting all share state with the write-back flusher, so submission holds the
+ * file system lock; only the transfers themselves run outside it */
+int submit_block_io(BlockIo* const* ios, int count) {
+    tfs_lock();
+    int result = submit_ios(ios, count);
+    tfs_unlock();
+    return result;
+}
+
+/* Collect up to max finished requests, waiting until at least min_complete are done (capped
+ * at the number in flight); returns how many were stored in done */
+int reap_block_io(BlockIo** done, int max, int min_complete) {
+    if (!done || max <= 0 || active_engine < 0) {
+        return 0;
+    }
+    if (min_complete > max) {
+        min_complete = max;
+    }
+    if ((uint32_t)min_complete > inflight) {
+        min_complete = (int)inflight;
+    }
+
+    int n = 0;
+    while (true) {
+        pthread_mutex_lock(&done_lock);
+        while (done_count > 0 && n < max) {
+            done[n++] = done_ring[done_head];
+            done_head = (done_head + 1) % queue_depth;
+            done_count--;
+        }
+        if (n >= min_complete || active_engine == IO_ENGINE_URING) {
+            pthread_mutex_unlock(&done_lock);
+        } else {
+            pthread_cond_wait(&done_cond, &done_lock);
+            pthread_mutex_unlock(&done_lock);
+            continue;
+        }
+
+        if (active_engine == IO_ENGINE_URING && n < max) {
+            n += uring_collect(done + n, max - n);
+        }
+        if (n >= min_complete) {
+            break;
+        }
+        /* Only the kernel's completions are left to wait for */
+        if (uring_enter(0, (uint32_t)(min_complete - n), IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            break;
+        }
+    }
+    inflight -= (uint32_t)n;
+    return n;
+}
+
+/* Wait for every request in flight; their results are left in the requests themselves */
+int drain_block_io() {
+    BlockIo* done[64];
+    int failed = 0;
+    while (inflight > 0) {
+        int n = reap_block_io(done, 64, 1);
+        if (n == 0) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            failed |= done[i]->result < 0;
+        }
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,549 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Latency samples for one benchmark */
+typedef struct {
+    const char* name;
+    uint64_t* samples;   /* Per-operation latency in nanoseconds */
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t total_ns;   /* Wall time across all recorded operations */
+} BenchResult;
+
+#define BENCH_BLOCKS 1024            /* Volume size for every benchmark */
+
+static uint32_t iterations = 10000;
+static uint32_t block_size = DEFAULT_BLOCK_SIZE;
+static int backend = BACKEND_RAM;
+static const char* backend_file = NULL;
+static int io_engine = IO_ENGINE_AUTO;
+static uint32_t queue_depth = 32;
+static int results_printed = 0;
+
+/* Monotonic clock in nanoseconds */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Small deterministic PRNG so runs are comparable between releases */
+static uint32_t rng_state = 0x12345678;
+static uint32_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void bench_init(BenchResult* r, const char* name, uint32_t capacity) {
+    r->name = name;
+    r->samples = malloc(capacity * sizeof(uint64_t));
+    r->count = 0;
+    r->capacity = r->samples ? capacity : 0;
+    r->total_ns = 0;
+}
+
+static void bench_record(BenchResult* r, uint64_t start) {
+    uint64_t elapsed = now_ns() - start;
+    if (r->count < r->capacity) {
+        r->samples[r->count++] = elapsed;
+    }
+    r->total_ns += elapsed;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const BenchResult* r, double p) {
+    if (r->count == 0) {
+        return 0;
+    }
+    uint32_t index = (uint32_t)(p * (r->count - 1) + 0.5);
+    return r->samples[index];
+}
+
+/* Print one result as a JSON object and release its samples */
+static void bench_report(BenchResult* r) {
+    qsort(r->samples, r->count, sizeof(uint64_t), compare_u64);
+    double ops_per_sec = r->total_ns ? (double)r->count * 1e9 / (double)r->total_ns : 0.0;
+
+    printf("%s    {\"name\": \"%s\", \"ops\": %u, \"ops_per_sec\": %.1f, "
+           "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+           results_printed++ ? ",\n" : "", r->name, r->count, ops_per_sec,
+           (unsigned long long)percentile(r, 0.50),
+           (unsigned long long)percentile(r, 0.99),
+           (unsigned long long)percentile(r, 0.999));
+
+    free(r->samples);
+    r->samples = NULL;
+}
+
+/* Start every benchmark from a fresh, full-size volume */
+static int fresh_filesystem() {
+    return init_filesystem_with_block_size(BENCH_BLOCKS, block_size);
+}
+
+/* Storage manager: raw block copies */
+static void bench_block_io() {
+    uint8_t* block = malloc(block_size);
+    memset(block, 0xA5, block_size);
+    fresh_filesystem();
+
+    BenchResult w, r;
+    bench_init(&w, "write_block", iterations);
+    bench_init(&r, "read_block", iterations);
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t block_num = 1 + next_random() % (BENCH_BLOCKS - 1);
+        uint64_t start = now_ns();
+        write_block(block_num, block);
+        bench_record(&w, start);
+    }
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t block_num = next_random() % BENCH_BLOCKS;
+        uint64_t start = now_ns();
+        read_block(block_num, block);
+        bench_record(&r, start);
+    }
+
+    bench_report(&w);
+    bench_report(&r);
+    free(block);
+}
+
+/* Allocator: first-fit bitmap scans */
+static void bench_allocator() {
+    fresh_filesystem();
+
+    uint32_t batch = 256;
+    uint64_t blocks[256];
+    BenchResult a, f;
+    bench_init(&a, "allocate_block", iterations);
+    bench_init(&f, "free_block", iterations);
+
+    for (uint32_t done = 0; done < iterations; done += batch) {
+        uint32_t n = (iterations - done < batch) ? iterations - done : batch;
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+            blocks[i] = allocate_block();
+            bench_record(&a, start);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+            free_block(blocks[i]);
+            bench_record(&f, start);
+        }
+    }
+
+    bench_report(&a);
+    bench_report(&f);
+}
+
+/* Async engine: keep queue_depth single-block requests in flight; ops_per_sec is measured
+ * against wall time since requests overlap */
+static void bench_async_pattern(const char* name, bool write, bool random) {
+    uint8_t* buffers = NULL;
+    BlockIo* ios = calloc(queue_depth, sizeof(BlockIo));
+    BlockIo** done = calloc(queue_depth, sizeof(BlockIo*));
+    uint64_t* started = calloc(queue_depth, sizeof(uint64_t));
+    if (posix_memalign((void**)&buffers, DIRECT_IO_ALIGN, (size_t)queue_depth * block_size) != 0 ||
+        !ios || !done || !started) {
+        free(buffers);
+        free(ios);
+        free(done);
+        free(started);
+        return;
+    }
+    memset(buffers, 0x5A, (size_t)queue_depth * block_size);
+
+    BenchResult r;
+    bench_init(&r, name, iterations);
+    uint32_t issued = 0;
+    uint64_t wall = now_ns();
+    for (uint32_t slot = 0; slot < queue_depth && issued < iterations; slot++, issued++) {
+        BlockIo* io = &ios[slot];
+        io->block_num = 1 + (random ? next_random() : issued) % (BENCH_BLOCKS - 1);
+        io->count = 1;
+        io->write = write;
+        io->buffer = buffers + (size_t)slot * block_size;
+        io->tag = slot;
+        started[slot] = now_ns();
+        submit_block_io(&io, 1);
+    }
+
+    while (r.count < iterations) {
+        int n = reap_block_io(done, (int)queue_depth, 1);
+        if (n <= 0) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            BlockIo* io = done[i];
+            if (r.count < r.capacity) {
+                r.samples[r.count++] = now_ns() - started[io->tag];
+            }
+            if (issued < iterations) {
+                io->block_num = 1 + (random ? next_random() : issued) % (BENCH_BLOCKS - 1);
+                started[io->tag] = now_ns();
+                submit_block_io(&io, 1);
+                issued++;
+            }
+        }
+    }
+    drain_block_io();
+    r.total_ns = now_ns() - wall;
+
+    bench_report(&r);
+    free(buffers);
+    free(ios);
+    free(done);
+    free(started);
+}
+
+/* Writes go first so the reads hit written blocks rather than holes in a backing file */
+static void bench_async_io() {
+    fresh_filesystem();
+    bench_async_pattern("async_rand_write", true, true);
+    bench_async_pattern("async_seq_read", false, false);
+    bench_async_pattern("async_rand_read", false, true);
+}
+
+/* Metadata manager: inode allocation */
+static void bench_inodes() {
+    fresh_filesystem();
+
+    uint32_t batch = MAX_INODES - 1;
+    uint32_t inodes[MAX_INODES];
+    BenchResult a;
+    bench_init(&a, "allocate_inode", iterations);
+
+    for (uint32_t done = 0; done < iterations; done += batch) {
+        uint32_t n = (iterations - done < batch) ? iterations - done : batch;
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t start = now_ns();
+            inodes[i] = allocate_inode();
+            bench_record(&a, start);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            free_inode(inodes[i]);
+        }
+    }
+
+    bench_report(&a);
+}
+
+/* Path resolution at several directory depths */
+static void bench_lookup() {
+    static const int depths[] = {1, 2, 4, 8};
+    static char names[4][48];
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        fresh_filesystem();
+
+        char path[MAX_PATH_LEN] = "";
+        for (int i = 0; i < depths[d] - 1; i++) {
+            size_t len = strlen(path);
+            snprintf(path + len, sizeof(path) - len, "/d%d", i);
+            makeDirectory(path);
+        }
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/leaf");
+        createFile(path, TYPE_FILE);
+
+        snprintf(names[d], sizeof(names[d]), "find_inode_by_path_depth_%d", depths[d]);
+        BenchResult r;
+        bench_init(&r, names[d], iterations);
+        for (uint32_t i = 0; i < iterations; i++) {
+            uint64_t start = now_ns();
+            find_inode_by_path(path);
+            bench_record(&r, start);
+        }
+        bench_report(&r);
+    }
+}
+
+/* API layer: file lifecycle, refilling one directory to capacity each round */
+static void bench_file_api() {
+    const uint32_t slots = block_size / sizeof(DirectoryEntry);
+    char* payload = malloc(block_size);
+    char* buffer = malloc(block_size);
+    char path[MAX_PATH_LEN];
+    memset(payload, 'x', block_size);
+    fresh_filesystem();
+    makeDirectory("/bench");
+
+    BenchResult c, o, w, r, x, d;
+    bench_init(&c, "createFile", iterations);
+    bench_init(&o, "openFile", iterations);
+    bench_init(&w, "writeFile", iterations);
+    bench_init(&r, "readFile", iterations);
+    bench_init(&x, "closeFile", iterations);
+    bench_init(&d, "deleteFile", iterations);
+
+    for (uint32_t done = 0; done < iterations; done += slots) {
+        uint32_t n = (iterations - done < slots) ? iterations - done : slots;
+        for (uint32_t i = 0; i < n; i++) {
+            snprintf(path, sizeof(path), "/bench/f%u", i);
+            uint64_t start = now_ns();
+            createFile(path, TYPE_FILE);
+            bench_record(&c, start);
+
+            start = now_ns();
+            int fd = openFile(path, MODE_READ | MODE_WRITE);
+            bench_record(&o, start);
+
+            start = now_ns();
+            writeFile(fd, payload, 64);
+            bench_record(&w, start);
+
+            closeFile(fd);
+            fd = openFile(path, MODE_READ);
+
+            start = now_ns();
+            readFile(fd, buffer, block_size);
+            bench_record(&r, start);
+
+            start = now_ns();
+            closeFile(fd);
+            bench_record(&x, start);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            snprintf(path, sizeof(path), "/bench/f%u", i);
+            uint64_t start = now_ns();
+            deleteFile(path);
+            bench_record(&d, start);
+        }
+    }
+
+    bench_report(&c);
+    bench_report(&o);
+    bench_report(&w);
+    bench_report(&r);
+    bench_report(&x);
+    bench_report(&d);
+    free(payload);
+    free(buffer);
+}
+
+/* Template instantiation: duplicate one file by reading and rewriting it, or by cloning */
+static void bench_clone() {
+    const uint32_t slots = block_size / sizeof(DirectoryEntry) - 1;
+    const uint32_t batch = slots < MAX_INODES - 4 ? slots : MAX_INODES - 4;
+    char* payload = malloc(block_size);
+    char* buffer = malloc(block_size);
+    char path[MAX_PATH_LEN];
+    memset(payload, 't', block_size);
+
+    static const char* names[] = {"copy_read_write", "cloneFile"};
+    for (int mode = 0; mode < 2; mode++) {
+        fresh_filesystem();
+        makeDirectory("/bench");
+        writeWholeFile("/bench/template", payload, block_size, WRITE_CREATE);
+
+        BenchResult r;
+        bench_init(&r, names[mode], iterations);
+        for (uint32_t done = 0; done < iterations; done += batch) {
+            uint32_t n = (iterations - done < batch) ? iterations - done : batch;
+            for (uint32_t i = 0; i < n; i++) {
+                snprintf(path, sizeof(path), "/bench/f%u", i);
+                uint64_t start = now_ns();
+                if (mode == 0) {
+                    int fd = openFile("/bench/template", MODE_READ);
+                    int length = readFile(fd, buffer, block_size);
+                    closeFile(fd);
+                    writeWholeFile(path, buffer, (uint32_t)length, WRITE_CREATE | WRITE_TRUNCATE);
+                } else {
+                    cloneFile("/bench/template", path);
+                }
+                bench_record(&r, start);
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                snprintf(path, sizeof(path), "/bench/f%u", i);
+                deleteFile(path);
+            }
+        }
+        bench_report(&r);
+    }
+    free(payload);
+    free(buffer);
+}
+
+/* Macro workload: random mix of whole-file writes, reads, lookups and deletes */
+static void bench_mixed() {
+    const uint32_t dirs = 16;
+    const uint32_t slots = block_size / sizeof(DirectoryEntry);
+    char* payload = malloc(block_size);
+    char* buffer = malloc(block_size);
+    char path[MAX_PATH_LEN];
+    memset(payload, 'm', block_size);
+    fresh_filesystem();
+
+    for (uint32_t i = 0; i < dirs; i++) {
+        snprintf(path, sizeof(path), "/m%u", i);
+        makeDirectory(path);
+    }
+
+    BenchResult m;
+    bench_init(&m, "mixed_write40_read40_lookup10_delete10", iterations);
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t pick = next_random();
+        snprintf(path, sizeof(path), "/m%u/f%u", pick % dirs, (pick >> 8) % slots);
+        uint32_t op = (pick >> 16) % 10;
+
+        uint64_t start = now_ns();
+        if (op < 4) {
+            writeWholeFile(path, payload, 32 + (pick >> 24) % (block_size - 32),
+                           WRITE_CREATE | WRITE_TRUNCATE);
+        } else if (op < 8) {
+            int fd = openFile(path, MODE_READ);
+            if (fd >= 0) {
+                readFile(fd, buffer, block_size);
+                closeFile(fd);
+            }
+        } else if (op < 9) {
+            searchFile(path);
+        } else {
+            deleteFile(path);
+        }
+        bench_record(&m, start);
+    }
+
+    bench_report(&m);
+    free(payload);
+    free(buffer);
+}
+
+/* Macro workload: bulk ingest of many small files, with and without a batch, and with
+ * write-back leaving the metadata to the flusher thread */
+static void bench_ingest() {
+    const uint32_t dirs = 16;
+    const uint32_t slots = block_size / sizeof(DirectoryEntry);
+    char* payload = malloc(block_size);
+    char path[MAX_PATH_LEN];
+    memset(payload, 'i', block_size);
+
+    static const char* names[] = {"ingest_unbatched", "ingest_batched", "ingest_writeback"};
+    for (int mode = 0; mode < 3; mode++) {
+        bool batched = mode == 1;
+        BenchResult r;
+        bench_init(&r, names[mode], iterations);
+        if (mode == 2) {
+            set_writeback(true, WRITEBACK_EXPIRE_MS, WRITEBACK_BACKGROUND_PERCENT,
+                          WRITEBACK_LIMIT_PERCENT);
+        }
+
+        while (r.count < iterations) {
+            fresh_filesystem();
+            for (uint32_t i = 0; i < dirs; i++) {
+                snprintf(path, sizeof(path), "/i%u", i);
+                makeDirectory(path);
+            }
+
+            if (batched) {
+                tfs_begin_batch();
+            }
+            for (uint32_t i = 0; i < dirs * slots && r.count < iterations; i++) {
+                snprintf(path, sizeof(path), "/i%u/f%u", i % dirs, i / dirs);
+                uint64_t start = now_ns();
+                writeWholeFile(path, payload, 100, WRITE_CREATE);
+                bench_record(&r, start);
+            }
+            if (batched) {
+                /* The deferred flush is part of the ingest cost */
+                uint64_t start = now_ns();
+                tfs_commit_batch();
+                r.total_ns += now_ns() - start;
+            }
+            if (mode == 2) {
+                /* So is getting everything write-back held onto the disk */
+                uint64_t start = now_ns();
+                tfs_sync();
+                r.total_ns += now_ns() - start;
+            }
+        }
+
+        set_writeback(false, 0, 0, 0);
+        bench_report(&r);
+    }
+    free(payload);
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            block_size = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            backend = strcmp(name, "ram") == 0 ? BACKEND_RAM :
+                      strcmp(name, "mmap") == 0 ? BACKEND_MMAP :
+                      strcmp(name, "pread") == 0 ? BACKEND_PREAD :
+                      strcmp(name, "direct") == 0 ? BACKEND_DIRECT : -1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            backend_file = argv[++i];
+        } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            io_engine = strcmp(name, "auto") == 0 ? IO_ENGINE_AUTO :
+                        strcmp(name, "uring") == 0 ? IO_ENGINE_URING :
+                        strcmp(name, "threads") == 0 ? IO_ENGINE_THREADS :
+                        strcmp(name, "sync") == 0 ? IO_ENGINE_SYNC : -1;
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            queue_depth = (uint32_t)atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [-n iterations] [-b block_size] "
+                    "[-B ram|mmap|pread|direct -f host_file] [-E auto|uring|threads|sync] "
+                    "[-q queue_depth]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (iterations == 0) {
+        fprintf(stderr, "Error: iterations must be positive\n");
+        return 1;
+    }
+    if (!is_valid_block_size(block_size)) {
+        fprintf(stderr, "Error: block size must be a power of two between %d and %d\n",
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return 1;
+    }
+
+    if (set_disk_backend(backend, backend_file) < 0 || fresh_filesystem() < 0) {
+        fprintf(stderr, "Error: cannot create a volume on that backend (file backends need -f)\n");
+        return 1;
+    }
+    if (queue_depth == 0 || set_io_engine(io_engine, queue_depth) < 0) {
+        fprintf(stderr, "Error: unknown I/O engine or queue depth out of range\n");
+        return 1;
+    }
+
+    printf("{\n  \"block_size\": %u,\n  \"backend\": \"%s\",\n  \"io_engine\": \"%s\",\n"
+           "  \"queue_depth\": %u,\n  \"iterations\": %u,\n  \"benchmarks\": [\n",
+           block_size, get_disk_backend_name(), get_io_engine_name(), queue_depth, iterations);
+
+    bench_block_io();
+    bench_async_io();
+    bench_allocator();
+    bench_inodes();
+    bench_lookup();
+    bench_file_api();
+    bench_mixed();
+    bench_ingest();
+    bench_clone();
+
+    printf("\n  ]\n}\n");
+
+    extern int free_disk(void);
+    free_disk();
+    return 0;
+}
@@ -1,19 +1,28 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "../include/tinyfs.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
-extern void init_open_file_table();
 extern Superblock* get_superblock();
 
 
 /* Print usage information */
 void print_usage(const char* program_name) {
-    printf("Usage: %s [shell]\n\n", program_name);
+    printf("Usage: %s [shell] [-f script.tfs] [--time]\n\n", program_name);
     printf("Starts the TinyFS interactive shell.\n");
     printf("Type 'help' in the shell for available commands.\n");
     printf("\n");
+    printf("  -f <script>  Run commands from a file ('-' for stdin) without prompts\n");
+    printf("  --time       Print per-command and total wall time to stderr\n");
+    printf("\n");
+    printf("Commands piped on stdin also run without prompts. Lines starting\n");
+    printf("with '#' are comments. The exit status is 1 if any command failed.\n");
+    printf("\n");
 }
 
 
@@ -32,10 +41,6 @@ static int shell_touch(int argc, char* argv[]) {
         fprintf(stderr, "Error: Failed to create file: %s\n", argv[1]);
         return 1;
     }
-    /* Reload inode table to ensure we have the latest data */
-    if (reload_inode_table() < 0) {
-        fprintf(stderr, "Warning: Failed to reload inode table\n");
-    }
     printf("File created: %s\n", argv[1]);
     return 0;
 }
@@ -54,13 +59,46 @@ static int shell_mkdir(int argc, char* argv[]) {
 }
 
 static int shell_ls(int argc, char* argv[]) {
+    bool long_format = (argc >= 2 && strcmp(argv[1], "-l") == 0);
+    if (long_format) {
+        argc--;
+        argv++;
+    }
+
     const char* path = (argc >= 2) ? argv[1] : "/";
-    char output[4096];
-    if (listDirectory(path, output, sizeof(output)) < 0) {
+    int dirfd = openDirectory(path);
+    if (dirfd < 0) {
+        fprintf(stderr, "Error: Failed to list directory: %s\n", path);
+        return 1;
+    }
+
+    /* Stream entries in fixed-size batches */
+    int count;
+    if (long_format) {
+        DirectoryEntryPlus entries[16];
+        while ((count = readDirectoryPlus(dirfd, entries, 16)) > 0) {
+            for (int i = 0; i < count; i++) {
+                printf("%-4s %5u %8llu %3llu %s\n",
+                       entries[i].type == TYPE_DIRECTORY ? "DIR" : "FILE",
+                       entries[i].inode_num, (unsigned long long)entries[i].size,
+                       (unsigned long long)entries[i].block_count, entries[i].name);
+            }
+        }
+    } else {
+        DirectoryEntry entries[16];
+        while ((count = readDirectory(dirfd, entries, 16)) > 0) {
+            for (int i = 0; i < count; i++) {
+                printf("%s %s\n", entries[i].type == TYPE_DIRECTORY ? "DIR" : "FILE",
+                       entries[i].name);
+            }
+        }
+    }
+    closeFile(dirfd);
+
+    if (count < 0) {
         fprintf(stderr, "Error: Failed to list directory: %s\n", path);
         return 1;
     }
-    printf("%s", output);
     return 0;
 }
 
@@ -100,9 +138,9 @@ static int shell_cat(int argc, char* argv[]) {
         fprintf(stderr, "Error: Failed to open file: %s\n", argv[1]);
         return 1;
     }
-    char buffer[BLOCK_SIZE];
+    char buffer[4096];
     int bytes_read;
-    while ((bytes_read = readFile(fd, buffer, BLOCK_SIZE)) > 0) {
+    while ((bytes_read = readFile(fd, buffer, sizeof(buffer))) > 0) {
         fwrite(buffer, 1, bytes_read, stdout);
     }
     printf("\n");
@@ -124,25 +162,159 @@ static int shell_write(int argc, char* argv[]) {
         text++;
     }
     
-    if (searchFile(argv[1]) < 0) {
-        if (createFile(argv[1], TYPE_FILE) < 0) {
-            fprintf(stderr, "Error: Failed to create file: %s\n", argv[1]);
+    if (writeWholeFile(argv[1], text, strlen(text), WRITE_CREATE | WRITE_TRUNCATE) < 0) {
+        fprintf(stderr, "Error: Failed to write to file: %s\n", argv[1]);
+        return 1;
+    }
+    printf("Text written to: %s\n", argv[1]);
+    return 0;
+}
+
+static int shell_clone(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: clone <src_file> <dst_file>\n");
+        return 1;
+    }
+    if (cloneFile(argv[1], argv[2]) < 0) {
+        fprintf(stderr, "Error: Failed to clone %s to %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    printf("Cloned %s to %s\n", argv[1], argv[2]);
+    return 0;
+}
+
+static int shell_dedup(int argc, char* argv[]) {
+    bool on = argc >= 2 && strcmp(argv[1], "on") == 0;
+    if (argc < 2 || (!on && strcmp(argv[1], "off") != 0)) {
+        fprintf(stderr, "Usage: dedup on|off\n");
+        return 1;
+    }
+    if (set_dedup(on) < 0) {
+        fprintf(stderr, "Error: Failed to index the volume for dedup\n");
+        return 1;
+    }
+    printf(on ? "Dedup on: identical file blocks are stored once\n" : "Dedup off\n");
+    return 0;
+}
+
+static int shell_batch(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: batch <begin|commit>\n");
+        return 1;
+    }
+    if (strcmp(argv[1], "begin") == 0) {
+        tfs_begin_batch();
+        printf("Batch started\n");
+        return 0;
+    }
+    if (strcmp(argv[1], "commit") == 0) {
+        if (tfs_commit_batch() < 0) {
+            fprintf(stderr, "Error: Failed to commit batch\n");
             return 1;
         }
+        printf("Batch committed\n");
+        return 0;
     }
-    
-    int fd = openFile(argv[1], MODE_WRITE);
-    if (fd < 0) {
-        fprintf(stderr, "Error: Failed to open file: %s\n", argv[1]);
+    fprintf(stderr, "Usage: batch <begin|commit>\n");
+    return 1;
+}
+
+static int shell_stats(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+        tfs_reset_stats();
+        printf("Statistics reset\n");
+        return 0;
+    }
+
+    static TfsStats stats;
+    if (tfs_get_stats(&stats) < 0) {
+        fprintf(stderr, "Error: Statistics are not compiled in (build with STATS=1)\n");
         return 1;
     }
-    if (writeFile(fd, text, strlen(text)) < 0) {
-        fprintf(stderr, "Error: Failed to write to file: %s\n", argv[1]);
-        closeFile(fd);
+
+    printf("%-12s %8s %6s %9s %9s %9s %9s %8s %8s %10s\n", "op", "calls", "errors",
+           "avg_ns", "p50_ns", "p99_ns", "max_ns", "rd/op", "wr/op", "bytes");
+    for (int i = 0; i < STAT_OP_COUNT; i++) {
+        const TfsOpStats* op = &stats.ops[i];
+        if (op->calls == 0) {
+            continue;
+        }
+        printf("%-12s %8llu %6llu %9llu %9llu %9llu %9llu %8.1f %8.1f %10llu\n",
+               tfs_stat_op_name(i),
+               (unsigned long long)op->calls, (unsigned long long)op->errors,
+               (unsigned long long)(op->total_ns / op->calls),
+               (unsigned long long)tfs_stat_percentile(op, 0.50),
+               (unsigned long long)tfs_stat_percentile(op, 0.99),
+               (unsigned long long)op->max_ns,
+               (double)op->block_reads / (double)op->calls,
+               (double)op->block_writes / (double)op->calls,
+               (unsigned long long)op->bytes_copied);
+    }
+
+    const TfsCounters* t = &stats.totals;
+    printf("block reads: %llu, block writes: %llu, bytes copied: %llu\n",
+           (unsigned long long)t->block_reads, (unsigned long long)t->block_writes,
+           (unsigned long long)t->bytes_copied);
+    printf("block allocs: %llu (avg scan %.1f), inode allocs: %llu (avg scan %.1f)\n",
+           (unsigned long long)t->block_allocs,
+           t->block_allocs ? (double)t->block_alloc_scan / (double)t->block_allocs : 0.0,
+           (unsigned long long)t->inode_allocs,
+           t->inode_allocs ? (double)t->inode_alloc_scan / (double)t->inode_allocs : 0.0);
+    printf("resident: %.1f MiB of %.1f MiB (chunks mapped: %llu, released: %llu)\n",
+           (double)get_resident_bytes() / (1024.0 * 1024.0),
+           (double)get_total_blocks() * get_block_size() / (1024.0 * 1024.0),
+           (unsigned long long)t->chunks_mapped, (unsigned long long)t->chunks_released);
+    uint32_t caps = get_disk_capabilities();
+    printf("backend: %s%s%s%s%s\n", get_disk_backend_name(),
+           (caps & BACKEND_CAP_ZERO_COPY) ? ", zero-copy" : "",
+           (caps & BACKEND_CAP_PERSISTENT) ? ", persistent" : "",
+           (caps & BACKEND_CAP_ASYNC) ? ", async-capable" : "",
+           (caps & BACKEND_CAP_UNCACHED) ? ", uncached" : "");
+    printf("async io (%s): %llu requests in %llu hand-offs, %llu run synchronously\n",
+           get_io_engine_name(), (unsigned long long)t->io_submitted,
+           (unsigned long long)t->io_submit_calls, (unsigned long long)t->io_sync_fallbacks);
+    printf("scheduler: %llu writes queued, %llu merged away, %llu runs dispatched\n",
+           (unsigned long long)t->io_queued, (unsigned long long)t->io_deduplicated,
+           (unsigned long long)t->io_runs);
+    if (writeback_enabled()) {
+        uint32_t expire, background, limit;
+        get_writeback(&expire, &background, &limit);
+        printf("write-back (%u ms, %u%%/%u%%): %llu blocks held, %llu flusher passes, "
+               "%llu throttled writers\n", expire, background, limit,
+               (unsigned long long)count_writeback_dirty(), (unsigned long long)t->writeback_flushes,
+               (unsigned long long)t->writeback_throttles);
+    } else {
+        printf("write-back: off\n");
+    }
+    printf("copy-on-write: %llu shared blocks copied, %llu snapshot blocks reclaimed\n",
+           (unsigned long long)t->cow_copies, (unsigned long long)t->snapshot_reclaimed);
+    uint64_t logical = 0, physical = 0;
+    get_dedup_usage(&logical, &physical);
+    printf("dedup (%s): %llu file blocks stored in %llu (ratio %.2f), %llu hits, "
+           "%llu mismatches\n", dedup_enabled() ? "on" : "off", (unsigned long long)logical,
+           (unsigned long long)physical, physical ? (double)logical / (double)physical : 1.0,
+           (unsigned long long)t->dedup_hits, (unsigned long long)t->dedup_mismatches);
+    printf("discards: %llu extents, %.1f MiB returned\n",
+           (unsigned long long)t->discards, (double)t->bytes_discarded / (1024.0 * 1024.0));
+    static const char* huge_modes[] = {"off", "thp", "hugetlb"};
+    printf("huge pages (%s): %llu hugetlb regions, %llu thp regions, %llu fallbacks, "
+           "%.1f MiB backed by huge pages\n", huge_modes[get_huge_page_mode()],
+           (unsigned long long)t->huge_page_regions, (unsigned long long)t->huge_page_advised,
+           (unsigned long long)t->huge_page_fallbacks,
+           (double)get_huge_page_bytes() / (1024.0 * 1024.0));
+    return 0;
+}
+
+static int shell_trim(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    uint64_t before = get_resident_bytes();
+    if (flush_discards() < 0) {
+        fprintf(stderr, "Error: Failed to discard freed blocks\n");
         return 1;
     }
-    closeFile(fd);
-    printf("Text written to: %s\n", argv[1]);
+    printf("Resident memory: %.1f MiB -> %.1f MiB\n", (double)before / (1024.0 * 1024.0),
+           (double)get_resident_bytes() / (1024.0 * 1024.0));
     return 0;
 }
 
@@ -160,119 +332,631 @@ static int shell_search(int argc, char* argv[]) {
     }
 }
 
-/* Interactive shell mode - RAM only, no disk persistence */
-int cmd_shell(int argc, char* argv[]) {
-    printf("TinyFS Interactive Shell \n");
-    printf("Type 'help' for commands, 'exit' to quit\n");
-    
-    /* Ensure open file table is initialized */
-    init_open_file_table();
-    
+/* Monotonic clock in nanoseconds */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Print a bulk transfer summary with its wall time */
+static void print_transfer(const char* verb, const TransferResult* r, uint64_t elapsed_ns) {
+    double seconds = elapsed_ns / 1e9;
+    printf("%s %u files (%llu bytes) and %u directories in %.3f s",
+           verb, r->files, (unsigned long long)r->bytes, r->directories, seconds);
+    if (seconds > 0) {
+        printf(" (%.0f files/sec)", r->files / seconds);
+    }
+    printf("\n");
+    if (r->skipped || r->failed) {
+        printf("  skipped: %u, failed: %u\n", r->skipped, r->failed);
+    }
+}
+
+static int shell_import(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: import <host_dir> <tfs_dir>\n");
+        return 1;
+    }
+    TransferResult result;
+    uint64_t start = now_ns();
+    if (tfs_import_tree(argv[1], argv[2], &result) < 0) {
+        fprintf(stderr, "Error: Failed to import %s into %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    print_transfer("Imported", &result, now_ns() - start);
+    return result.failed ? 1 : 0;
+}
+
+static int shell_export(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: export <tfs_dir> <host_dir>\n");
+        return 1;
+    }
+    TransferResult result;
+    uint64_t start = now_ns();
+    if (tfs_export_tree(argv[1], argv[2], &result) < 0) {
+        fprintf(stderr, "Error: Failed to export %s to %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    print_transfer("Exported", &result, now_ns() - start);
+    return result.failed ? 1 : 0;
+}
+
+static int shell_save(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: save <host_file>\n");
+        return 1;
+    }
+    uint64_t start = now_ns();
+    if (tfs_save_image(argv[1]) < 0) {
+        fprintf(stderr, "Error: Failed to save image: %s\n", argv[1]);
+        return 1;
+    }
+    printf("Image saved to %s in %.3f ms\n", argv[1], (now_ns() - start) / 1e6);
+    return 0;
+}
+
+/* Mounting leaves blocks alone that are marked used with nothing pointing at them */
+static void warn_orphans() {
+    uint64_t orphans = get_orphan_blocks();
+    if (orphans > 0) {
+        fprintf(stderr, "Warning: %llu blocks are marked used but no inode refers to them\n",
+                (unsigned long long)orphans);
+    }
+}
+
+static int shell_load(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: load <host_file> [--no-verify] [delta_file...]\n");
+        return 1;
+    }
+    int first_delta = 2;
+    bool verify = true;
+    if (argc >= 3 && strcmp(argv[2], "--no-verify") == 0) {
+        verify = false;
+        first_delta = 3;
+    }
+    uint64_t start = now_ns();
+    if (tfs_load_image(argv[1], verify) < 0) {
+        fprintf(stderr, "Error: Failed to load image: %s\n", argv[1]);
+        return 1;
+    }
+    for (int i = first_delta; i < argc; i++) {
+        if (tfs_apply_delta(argv[i]) < 0) {
+            fprintf(stderr, "Error: Failed to apply delta: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    printf("Image loaded from %s: %llu blocks, checkpoint %u in %.3f ms\n", argv[1],
+           (unsigned long long)get_total_blocks(), get_checkpoint_epoch(),
+           (now_ns() - start) / 1e6);
+    warn_orphans();
+    return 0;
+}
+
+/* Backend number for a name given on the command line; -1 if unknown */
+static int parse_backend(const char* name) {
+    static const char* names[BACKEND_COUNT] = {"ram", "mmap", "pread", "direct"};
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int shell_open(int argc, char* argv[]) {
+    int backend = BACKEND_PREAD;
+    if (argc >= 4 && strcmp(argv[2], "--backend") == 0) {
+        backend = parse_backend(argv[3]);
+    }
+    if (argc < 2 || backend <= BACKEND_RAM) {
+        fprintf(stderr, "Usage: open <host_file> [--backend mmap|pread|direct]\n");
+        return 1;
+    }
+    if (open_disk(backend, argv[1]) < 0) {
+        fprintf(stderr, "Error: No TinyFS volume in %s\n", argv[1]);
+        return 1;
+    }
+    if (mount_filesystem() < 0) {
+        fprintf(stderr, "Error: Failed to mount %s\n", argv[1]);
+        free_disk();
+        return 1;
+    }
+    printf("Opened %s (%s backend): %llu blocks of %u bytes\n", argv[1],
+           get_disk_backend_name(), (unsigned long long)get_total_blocks(), get_block_size());
+    warn_orphans();
+    return 0;
+}
+
+static int shell_sync(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    uint64_t start = now_ns();
+    if (tfs_sync() < 0) {
+        fprintf(stderr, "Error: Failed to flush the %s backend\n", get_disk_backend_name());
+        return 1;
+    }
+    printf("Flushed %s backend in %.3f ms\n", get_disk_backend_name(), (now_ns() - start) / 1e6);
+    return 0;
+}
+
+static int shell_fsync(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: fsync <file_path>\n");
+        return 1;
+    }
+    int fd = openFile(argv[1], MODE_READ);
+    if (fd < 0) {
+        fprintf(stderr, "Error: File not found: %s\n", argv[1]);
+        return 1;
+    }
+    uint64_t start = now_ns();
+    int status = fsyncFile(fd);
+    uint64_t elapsed = now_ns() - start;
+    closeFile(fd);
+    if (status < 0) {
+        fprintf(stderr, "Error: Failed to flush %s\n", argv[1]);
+        return 1;
+    }
+    printf("Flushed %s in %.3f ms\n", argv[1], elapsed / 1e6);
+    return 0;
+}
+
+static int shell_writeback(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+        if (set_writeback(false, 0, 0, 0) < 0) {
+            fprintf(stderr, "Error: Failed to write back held changes\n");
+            return 1;
+        }
+        printf("Write-back off: changes are written through\n");
+        return 0;
+    }
+    if (argc < 2 || strcmp(argv[1], "on") != 0) {
+        fprintf(stderr, "Usage: writeback on [expire_ms [background_%% [limit_%%]]] | off\n");
+        return 1;
+    }
+
+    uint32_t expire = argc >= 3 ? (uint32_t)atoi(argv[2]) : WRITEBACK_EXPIRE_MS;
+    uint32_t background = argc >= 4 ? (uint32_t)atoi(argv[3]) : WRITEBACK_BACKGROUND_PERCENT;
+    uint32_t limit = argc >= 5 ? (uint32_t)atoi(argv[4]) : WRITEBACK_LIMIT_PERCENT;
+    if (set_writeback(true, expire, background, limit) < 0) {
+        fprintf(stderr, "Error: expire must be positive and background <= limit <= 100\n");
+        return 1;
+    }
+    printf("Write-back on: flushed after %u ms, or past %u%% dirty; writers wait at %u%%\n",
+           expire, background, limit);
+    return 0;
+}
+
+/* Open a path inside a snapshot: its root handle, then the path relative to it */
+static int open_in_snapshot(const char* name, const char* path, bool directory) {
+    int root = openSnapshot(name);
+    while (path && *path == '/') {
+        path++;
+    }
+    if (root < 0 || ((!path || *path == '\0') && directory)) {
+        return root;
+    }
+    if (!path || *path == '\0') {
+        closeFile(root);
+        return -1;
+    }
+    int fd = directory ? openDirectoryAt(root, path) : openFileAt(root, path, MODE_READ);
+    closeFile(root);
+    return fd;
+}
+
+static int shell_snapshot(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "list") == 0) {
+        char names[MAX_SNAPSHOTS][MAX_FILENAME_LEN];
+        int count = tfs_list_snapshots(names, MAX_SNAPSHOTS);
+        for (int i = 0; i < count; i++) {
+            printf("%s\n", names[i]);
+        }
+        printf("%d of %d snapshots\n", count, MAX_SNAPSHOTS);
+        return 0;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "Usage: snapshot create|delete <name> | list | ls <name> [dir_path]"
+                        " | cat <name> <file_path>\n");
+        return 1;
+    }
+
+    if (strcmp(argv[1], "create") == 0) {
+        uint64_t start = now_ns();
+        if (tfs_create_snapshot(argv[2]) < 0) {
+            fprintf(stderr, "Error: Failed to create snapshot: %s\n", argv[2]);
+            return 1;
+        }
+        printf("Snapshot %s created in %.3f ms\n", argv[2], (now_ns() - start) / 1e6);
+        return 0;
+    }
+    if (strcmp(argv[1], "delete") == 0) {
+        if (tfs_delete_snapshot(argv[2]) < 0) {
+            fprintf(stderr, "Error: No such snapshot, or files in it are open: %s\n", argv[2]);
+            return 1;
+        }
+        printf("Snapshot %s deleted; its blocks are reclaimed in the background\n", argv[2]);
+        return 0;
+    }
+
+    const char* path = argc >= 4 ? argv[3] : NULL;
+    if (strcmp(argv[1], "ls") == 0) {
+        int dirfd = open_in_snapshot(argv[2], path, true);
+        if (dirfd < 0) {
+            fprintf(stderr, "Error: Failed to list %s in snapshot %s\n", path ? path : "/", argv[2]);
+            return 1;
+        }
+        DirectoryEntryPlus entries[16];
+        int count;
+        while ((count = readDirectoryPlus(dirfd, entries, 16)) > 0) {
+            for (int i = 0; i < count; i++) {
+                printf("%-4s %5u %8llu %s\n", entries[i].type == TYPE_DIRECTORY ? "DIR" : "FILE",
+                       entries[i].inode_num, (unsigned long long)entries[i].size, entries[i].name);
+            }
+        }
+        closeFile(dirfd);
+        return count < 0 ? 1 : 0;
+    }
+    if (strcmp(argv[1], "cat") == 0 && path) {
+        int fd = open_in_snapshot(argv[2], path, false);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Failed to open %s in snapshot %s\n", path, argv[2]);
+            return 1;
+        }
+        char buffer[4096];
+        int bytes_read;
+        while ((bytes_read = readFile(fd, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, bytes_read, stdout);
+        }
+        printf("\n");
+        closeFile(fd);
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown snapshot command: %s\n", argv[1]);
+    return 1;
+}
+
+static int shell_checkpoint(int argc, char* argv[]) {
+    /* Without a file, report what the next checkpoint would contain */
+    if (argc < 2) {
+        uint64_t extents = 0;
+        uint64_t cursor = 0;
+        BlockExtent extent;
+        while (next_dirty_extent(&cursor, &extent) > 0) {
+            extents++;
+        }
+        printf("Checkpoint %u: %llu dirty blocks in %llu extents\n", get_checkpoint_epoch(),
+               (unsigned long long)count_dirty_blocks(), (unsigned long long)extents);
+        return 0;
+    }
+
+    uint64_t start = now_ns();
+    if (tfs_save_delta(argv[1]) < 0) {
+        fprintf(stderr, "Error: Failed to write delta: %s (save a full image first)\n", argv[1]);
+        return 1;
+    }
+    printf("Checkpoint %u saved to %s in %.3f ms\n", get_checkpoint_epoch(), argv[1],
+           (now_ns() - start) / 1e6);
+    return 0;
+}
+
+static void print_help() {
+    printf("Commands:\n");
+    printf("  init [num_blocks] [--block-size N] [--huge-pages off|thp|hugetlb]\n");
+    printf("       [--backend ram|mmap|pread|direct --file host_file]\n");
+    printf("                     - Initialize file system in RAM or in a host file\n");
+    printf("                       (default: 512 blocks of %d bytes in RAM)\n", DEFAULT_BLOCK_SIZE);
+    printf("  open <host_file> [--backend mmap|pread|direct] - Mount a volume kept in a host file\n");
+    printf("  sync               - Flush everything written so far to the backing store\n");
+    printf("  fsync <file_path>  - Flush one file's data and metadata to the backing store\n");
+    printf("  writeback on [expire_ms [background_%% [limit_%%]]] | off\n");
+    printf("                     - Defer metadata and block writes to a background flusher\n");
+    printf("  touch <file_path>  - Create a new file\n");
+    printf("  mkdir <dir_path>   - Create a new directory\n");
+    printf("  ls [-l] [dir_path] - List directory contents (-l: inode, size, blocks)\n");
+    printf("  rm <file_path>     - Remove a file\n");
+    printf("  rmdir <dir_path>   - Remove an empty directory\n");
+    printf("  cat <file_path>    - Display file contents\n");
+    printf("  write <file_path> <text> - Write text to a file\n");
+    printf("  search <path>      - Search for a file/directory\n");
+    printf("  clone <src> <dst>  - Copy a file by sharing its block until either is written\n");
+    printf("  dedup on|off       - Store identical file blocks once\n");
+    printf("  batch <begin|commit> - Group metadata updates into one write\n");
+    printf("  stats [reset]      - Show or reset per-operation statistics\n");
+    printf("  trim               - Return memory of freed blocks to the OS now\n");
+    printf("  import <host_dir> <tfs_dir> - Copy a host directory tree into TinyFS\n");
+    printf("  export <tfs_dir> <host_dir> - Copy a TinyFS directory tree to the host\n");
+    printf("  save <host_file>   - Save the volume to a host image file\n");
+    printf("  load <host_file> [--no-verify] [delta_file...] - Map a saved image copy-on-write\n");
+    printf("                       and apply checkpoint deltas in order\n");
+    printf("  checkpoint [delta_file] - Save blocks changed since the last save or checkpoint\n");
+    printf("  snapshot create|delete <name> | list - Manage copy-on-write snapshots\n");
+    printf("  snapshot ls <name> [dir_path] | cat <name> <file_path>\n");
+    printf("                     - Read a snapshot; it stays as it was when taken\n");
+    printf("  exit/quit          - Exit shell (unsaved data will be lost)\n");
+}
+
+/* Run one command line; returns 0 on success, 1 on error, -1 to quit */
+static int execute_command(char* line, bool* filesystem_initialized) {
+    /* Parse command */
+    char* tokens[32];
+    int token_count = 0;
+    char* token = strtok(line, " \t");
+    while (token && token_count < 32) {
+        tokens[token_count++] = token;
+        token = strtok(NULL, " \t");
+    }
+
+    if (token_count == 0) {
+        return 0;
+    }
+
+    /* Handle commands */
+    if (strcmp(tokens[0], "exit") == 0 || strcmp(tokens[0], "quit") == 0) {
+        return -1;
+    } else if (strcmp(tokens[0], "help") == 0) {
+        print_help();
+        return 0;
+    } else if (strcmp(tokens[0], "init") == 0) {
+        uint64_t num_blocks = 512;
+        uint32_t block_size = DEFAULT_BLOCK_SIZE;
+        int backend = BACKEND_RAM;
+        const char* file = NULL;
+        for (int i = 1; i < token_count; i++) {
+            if (strcmp(tokens[i], "--block-size") == 0 && i + 1 < token_count) {
+                block_size = (uint32_t)atoi(tokens[++i]);
+            } else if (strcmp(tokens[i], "--backend") == 0 && i + 1 < token_count) {
+                backend = parse_backend(tokens[++i]);
+            } else if (strcmp(tokens[i], "--file") == 0 && i + 1 < token_count) {
+                file = tokens[++i];
+            } else if (strcmp(tokens[i], "--huge-pages") == 0 && i + 1 < token_count) {
+                const char* mode = tokens[++i];
+                int status = -1;
+                if (strcmp(mode, "off") == 0) {
+                    status = set_huge_page_mode(HUGE_PAGES_OFF);
+                } else if (strcmp(mode, "thp") == 0) {
+                    status = set_huge_page_mode(HUGE_PAGES_THP);
+                } else if (strcmp(mode, "hugetlb") == 0) {
+                    status = set_huge_page_mode(HUGE_PAGES_HUGETLB);
+                }
+                if (status < 0) {
+                    fprintf(stderr, "Error: --huge-pages must be off, thp or hugetlb\n");
+                    return 1;
+                }
+            } else {
+                num_blocks = strtoull(tokens[i], NULL, 10);
+            }
+        }
+        /* The only upper limit is what the backing memory can hold */
+        if (num_blocks < 10) {
+            fprintf(stderr, "Error: Number of blocks must be at least 10\n");
+            return 1;
+        }
+        if (!is_valid_block_size(block_size)) {
+            fprintf(stderr, "Error: Block size must be a power of two between %d and %d\n",
+                    MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+            return 1;
+        }
+        if (backend < 0 || (backend != BACKEND_RAM && !file)) {
+            fprintf(stderr, "Error: --backend must be ram, or mmap, pread or direct with --file\n");
+            return 1;
+        }
+        if (set_disk_backend(backend, file) < 0 ||
+            init_filesystem_with_block_size(num_blocks, block_size) < 0) {
+            fprintf(stderr, "Error: Failed to initialize file system\n");
+            *filesystem_initialized = get_total_blocks() > 0;
+            return 1;
+        }
+        *filesystem_initialized = true;
+        printf("File system initialized in %s (%s backend): %llu blocks of %u bytes\n",
+               backend == BACKEND_RAM ? "RAM" : file, get_disk_backend_name(),
+               (unsigned long long)num_blocks, block_size);
+        return 0;
+    } else if (strcmp(tokens[0], "open") == 0) {
+        int status = shell_open(token_count, tokens);
+        *filesystem_initialized = get_total_blocks() > 0;
+        return status;
+    } else if (strcmp(tokens[0], "load") == 0) {
+        int status = shell_load(token_count, tokens);
+        if (status == 0) {
+            *filesystem_initialized = true;
+        } else if (get_total_blocks() == 0) {
+            /* A failed load leaves no volume behind */
+            *filesystem_initialized = false;
+        }
+        return status;
+    }
+
+    /* All other commands require filesystem to be initialized */
+    if (!*filesystem_initialized) {
+        fprintf(stderr, "Error: File system not initialized. Type 'init' first.\n");
+        return 1;
+    }
+
+    if (strcmp(tokens[0], "touch") == 0) {
+        return shell_touch(token_count, tokens);
+    } else if (strcmp(tokens[0], "mkdir") == 0) {
+        return shell_mkdir(token_count, tokens);
+    } else if (strcmp(tokens[0], "ls") == 0) {
+        return shell_ls(token_count, tokens);
+    } else if (strcmp(tokens[0], "rm") == 0) {
+        return shell_rm(token_count, tokens);
+    } else if (strcmp(tokens[0], "rmdir") == 0) {
+        return shell_rmdir(token_count, tokens);
+    } else if (strcmp(tokens[0], "cat") == 0) {
+        return shell_cat(token_count, tokens);
+    } else if (strcmp(tokens[0], "write") == 0) {
+        return shell_write(token_count, tokens);
+    } else if (strcmp(tokens[0], "search") == 0) {
+        return shell_search(token_count, tokens);
+    } else if (strcmp(tokens[0], "clone") == 0) {
+        return shell_clone(token_count, tokens);
+    } else if (strcmp(tokens[0], "dedup") == 0) {
+        return shell_dedup(token_count, tokens);
+    } else if (strcmp(tokens[0], "batch") == 0) {
+        return shell_batch(token_count, tokens);
+    } else if (strcmp(tokens[0], "stats") == 0) {
+        return shell_stats(token_count, tokens);
+    } else if (strcmp(tokens[0], "import") == 0) {
+        return shell_import(token_count, tokens);
+    } else if (strcmp(tokens[0], "export") == 0) {
+        return shell_export(token_count, tokens);
+    } else if (strcmp(tokens[0], "save") == 0) {
+        return shell_save(token_count, tokens);
+    } else if (strcmp(tokens[0], "trim") == 0) {
+        return shell_trim(token_count, tokens);
+    } else if (strcmp(tokens[0], "sync") == 0) {
+        return shell_sync(token_count, tokens);
+    } else if (strcmp(tokens[0], "fsync") == 0) {
+        return shell_fsync(token_count, tokens);
+    } else if (strcmp(tokens[0], "writeback") == 0) {
+        return shell_writeback(token_count, tokens);
+    } else if (strcmp(tokens[0], "checkpoint") == 0) {
+        return shell_checkpoint(token_count, tokens);
+    } else if (strcmp(tokens[0], "snapshot") == 0) {
+        return shell_snapshot(token_count, tokens);
+    }
+
+    printf("Unknown command: %s (type 'help' for commands)\n", tokens[0]);
+    return 1;
+}
+
+/* Read and run commands until EOF or exit; returns the number of failed commands */
+static int run_commands(FILE* in, bool interactive, bool timed) {
     bool filesystem_initialized = false;
     char line[512];
-    
+    char command[512];
+    int failures = 0;
+    uint64_t commands = 0;
+    uint64_t total_ns = 0;
+
     while (1) {
-        printf("tfs> ");
-        if (fgets(line, sizeof(line), stdin) == NULL) {
+        if (interactive) {
+            printf("tfs> ");
+            fflush(stdout);
+        }
+        if (fgets(line, sizeof(line), in) == NULL) {
             break; /* EOF */
         }
-        
-        /* Remove newline */
+
+        /* Remove newline; a line fgets had to split is refused whole, not run in pieces */
         size_t len = strlen(line);
         if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
+            line[--len] = '\0';
+        } else if (!feof(in)) {
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n') {
+            }
+            fprintf(stderr, "Error: Command longer than %d characters, skipped\n",
+                    (int)sizeof(line) - 2);
+            failures++;
+            continue;
         }
-        
-        if (strlen(line) == 0) {
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+
+        /* Skip blank lines and script comments */
+        size_t start = strspn(line, " \t");
+        if (line[start] == '\0' || line[start] == '#') {
             continue;
         }
-        
-        /* Parse command */
-        char* tokens[32];
-        int token_count = 0;
-        char* token = strtok(line, " \t");
-        while (token && token_count < 32) {
-            tokens[token_count++] = token;
-            token = strtok(NULL, " \t");
+
+        /* execute_command tokenizes in place; keep the text for timing output */
+        if (timed) {
+            memcpy(command, line + start, len - start + 1);
         }
-        
-        if (token_count == 0) continue;
-        
-        /* Handle commands */
-        if (strcmp(tokens[0], "exit") == 0 || strcmp(tokens[0], "quit") == 0) {
+
+        uint64_t begin = timed ? now_ns() : 0;
+        int status = execute_command(line + start, &filesystem_initialized);
+        if (status < 0) {
             break;
-        } else if (strcmp(tokens[0], "help") == 0) {
-            printf("Commands:\n");
-            printf("  init [num_blocks]  - Initialize file system in RAM (default: 512 blocks)\n");
-            printf("  touch <file_path>  - Create a new file\n");
-            printf("  mkdir <dir_path>   - Create a new directory\n");
-            printf("  ls [dir_path]      - List directory contents\n");
-            printf("  rm <file_path>     - Remove a file\n");
-            printf("  rmdir <dir_path>   - Remove an empty directory\n");
-            printf("  cat <file_path>    - Display file contents\n");
-            printf("  write <file_path> <text> - Write text to a file\n");
-            printf("  search <path>      - Search for a file/directory\n");
-            printf("  exit/quit          - Exit shell (all data will be lost)\n");
-        } else if (strcmp(tokens[0], "init") == 0) {
-            uint32_t num_blocks = (token_count >= 2) ? (uint32_t)atoi(tokens[1]) : 512;
-            if (num_blocks < 10 || num_blocks > MAX_BLOCKS) {
-                fprintf(stderr, "Error: Number of blocks must be between 10 and %d\n", MAX_BLOCKS);
-                continue;
-            }
-            if (init_filesystem(num_blocks) < 0) {
-                fprintf(stderr, "Error: Failed to initialize file system\n");
-                continue;
-            }
-            filesystem_initialized = true;
-            printf("File system initialized in RAM: %d blocks\n", num_blocks);
-        } else {
-            /* All other commands require filesystem to be initialized */
-            if (!filesystem_initialized) {
-                fprintf(stderr, "Error: File system not initialized. Type 'init' first.\n");
-                continue;
-            }
-            
-            if (strcmp(tokens[0], "touch") == 0) {
-                shell_touch(token_count, tokens);
-            } else if (strcmp(tokens[0], "mkdir") == 0) {
-                shell_mkdir(token_count, tokens);
-            } else if (strcmp(tokens[0], "ls") == 0) {
-                shell_ls(token_count, tokens);
-            } else if (strcmp(tokens[0], "rm") == 0) {
-                shell_rm(token_count, tokens);
-            } else if (strcmp(tokens[0], "rmdir") == 0) {
-                shell_rmdir(token_count, tokens);
-            } else if (strcmp(tokens[0], "cat") == 0) {
-                shell_cat(token_count, tokens);
-            } else if (strcmp(tokens[0], "write") == 0) {
-                shell_write(token_count, tokens);
-            } else if (strcmp(tokens[0], "search") == 0) {
-                shell_search(token_count, tokens);
-            } else {
-                printf("Unknown command: %s (type 'help' for commands)\n", tokens[0]);
-            }
         }
+
+        if (timed) {
+            uint64_t elapsed = now_ns() - begin;
+            total_ns += elapsed;
+            fprintf(stderr, "[time] %10.3f us  %s\n", elapsed / 1000.0, command);
+        }
+        commands++;
+        failures += status;
     }
-    
-    /* Free memory - NO saving to disk */
+
+    if (timed) {
+        fprintf(stderr, "[time] total %.3f ms for %llu commands (%.0f commands/sec), %d failed\n",
+                total_ns / 1e6, (unsigned long long)commands,
+                total_ns ? commands * 1e9 / (double)total_ns : 0.0, failures);
+    }
+
+    /* Free memory - NO saving to disk; a host file backend still gets what write-back held */
+    set_writeback(false, 0, 0, 0);
     if (filesystem_initialized) {
         extern int free_disk(void);
         free_disk();
     }
-    printf("\nGoodbye! All data has been erased.\n");
-    return 0;
+    return failures;
+}
+
+/* Shell entry point: interactive on a terminal, batch for -f scripts and pipes */
+int cmd_shell(int argc, char* argv[]) {
+    const char* script = NULL;
+    bool timed = false;
+    bool force_interactive = false;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "shell") == 0 || strcmp(argv[i], "interactive") == 0) {
+            force_interactive = true;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--time") == 0) {
+            timed = true;
+        } else {
+            return -1;
+        }
+    }
+
+    FILE* in = stdin;
+    if (script && strcmp(script, "-") != 0) {
+        in = fopen(script, "r");
+        if (!in) {
+            fprintf(stderr, "Error: Cannot open script %s: %s\n", script, strerror(errno));
+            return 1;
+        }
+    }
+
+    /* Prompts only make sense when a person is typing */
+    bool interactive = !script && (force_interactive || isatty(fileno(stdin)));
+
+    if (interactive) {
+        printf("TinyFS Interactive Shell \n");
+        printf("Type 'help' for commands, 'exit' to quit\n");
+    }
+
+    int failures = run_commands(in, interactive, timed);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (interactive) {
+        printf("\nGoodbye! Unsaved data has been erased.\n");
+        return 0;
+    }
+    return failures > 0 ? 1 : 0;
 }
 
 /* Main function */
 int main(int argc, char* argv[]) {
     init_open_file_table();
 
-    /* Start shell by default, or if "shell" command is given */
-    if (argc == 1 || (argc == 2 && (strcmp(argv[1], "shell") == 0 || strcmp(argv[1], "interactive") == 0))) {
-        return cmd_shell(argc - 1, argv + 1);
-    } else {
+    int result = cmd_shell(argc - 1, argv + 1);
+    if (result < 0) {
         print_usage(argv[0]);
         return 1;
     }
+    return result;
 }
-
@@ -0,0 +1,172 @@
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern Superblock* get_superblock();
+
+/* Index of file data blocks by content hash: direct-mapped, one block per slot, newest
+ * wins. Entries are hints; a match is only used once the block's bytes have been compared */
+typedef struct {
+    uint64_t hash;
+    uint64_t block_num;          /* 0 for an empty slot; block 0 never holds file data */
+} DedupEntry;
+
+static bool dedup_on = false;
+static DedupEntry* dedup_index = NULL;
+static size_t dedup_index_mapped = 0;
+static uint64_t dedup_index_mask = 0;
+static uint8_t* verify_buffer = NULL;
+static uint32_t verify_buffer_size = 0;
+
+#define HASH_P1 0x9E3779B185EBCA87ull
+#define HASH_P2 0xC2B2AE3D27D4EB4Full
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Fast non-cryptographic hash of a block: four independent multiply-rotate lanes over 8-byte
+ * words, so the loop is not one long dependency chain. Block sizes are multiples of 32 */
+static uint64_t hash_block(const uint8_t* data, uint32_t length) {
+    uint64_t lane[4] = {HASH_P1 + HASH_P2, HASH_P2, 0, -HASH_P1};
+    for (uint32_t i = 0; i < length; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, data + i + j * 8, sizeof(word));
+            lane[j] = rotl64(lane[j] + word * HASH_P2, 31) * HASH_P1;
+        }
+    }
+    uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) +
+                 rotl64(lane[3], 18) + length;
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    return h;
+}
+
+/* Size the index for the volume: a slot per block, in memory that is only touched as it
+ * fills. A fresh index is mapped anew, which is cheaper than clearing the old one */
+static int map_dedup_index(bool fresh) {
+    uint64_t slots = 1;
+    while (slots < get_total_blocks()) {
+        slots <<= 1;
+    }
+    if (!fresh && dedup_index && dedup_index_mask + 1 == slots &&
+        verify_buffer_size == get_block_size()) {
+        return 0;
+    }
+
+    unmap_disk_memory(dedup_index, dedup_index_mapped);
+    dedup_index_mapped = (size_t)slots * sizeof(DedupEntry);
+    dedup_index = map_disk_memory(dedup_index_mapped);
+    dedup_index_mask = slots - 1;
+    free(verify_buffer);
+    verify_buffer_size = get_block_size();
+    verify_buffer = malloc(verify_buffer_size);
+    if (!dedup_index || !verify_buffer) {
+        unmap_disk_memory(dedup_index, dedup_index_mapped);
+        dedup_index = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Record that block_num holds data */
+static void remember_block(uint64_t block_num, const uint8_t* data) {
+    uint64_t hash = hash_block(data, get_block_size());
+    DedupEntry* entry = &dedup_index[hash & dedup_index_mask];
+    entry->hash = hash;
+    entry->block_num = block_num;
+}
+
+/* Build a fresh index of the files already on the volume */
+static int index_volume() {
+    Inode* inodes = malloc(MAX_INODES * sizeof(Inode));
+    if (!inodes || map_dedup_index(true) < 0 || copy_inode_table(inodes) < 0) {
+        free(inodes);
+        return -1;
+    }
+    for (uint32_t i = 0; i < MAX_INODES; i++) {
+        if (inodes[i].used && inodes[i].type == TYPE_FILE && inodes[i].data_block != 0 &&
+            read_block(inodes[i].data_block, verify_buffer) == 0) {
+            remember_block(inodes[i].data_block, verify_buffer);
+        }
+    }
+    free(inodes);
+    return 0;
+}
+
+/* Turn dedup on, indexing the files already on the volume, or off */
+int set_dedup(bool enabled) {
+    tfs_lock();
+    int status = enabled ? index_volume() : 0;
+    dedup_on = enabled && status == 0;
+    tfs_unlock();
+    return status;
+}
+
+bool dedup_enabled() {
+    return dedup_on;
+}
+
+/* Where a file's new block contents should live. Returns a block already holding exactly
+ * data, which the caller then shares, or (uint64_t)-1 to write data itself and have
+ * note_data_block index it */
+uint64_t find_duplicate_block(const void* data) {
+    if (!dedup_on || map_dedup_index(false) < 0) {
+        return (uint64_t)-1;
+    }
+    Superblock* sb = get_superblock();
+    uint64_t hash = hash_block(data, get_block_size());
+    const DedupEntry* entry = &dedup_index[hash & dedup_index_mask];
+    if (!sb || entry->block_num == 0 || entry->hash != hash) {
+        return (uint64_t)-1;
+    }
+
+    /* The entry may be stale: the block freed, reused or rewritten since */
+    uint64_t candidate = entry->block_num;
+    if (candidate < sb->data_start_block || !is_block_allocated(candidate) ||
+        read_block(candidate, verify_buffer) < 0 ||
+        memcmp(verify_buffer, data, get_block_size()) != 0) {
+        TFS_STAT_ADD(dedup_mismatches, 1);
+        return (uint64_t)-1;
+    }
+    return candidate;
+}
+
+/* Index a file data block just written */
+void note_data_block(uint64_t block_num, const void* data) {
+    if (dedup_on && map_dedup_index(false) == 0) {
+        remember_block(block_num, data);
+    }
+}
+
+/* File data blocks on the live volume, as inodes reference them and as they are stored;
+ * their ratio is what dedup (and cloning) saves */
+int get_dedup_usage(uint64_t* logical, uint64_t* physical) {
+    Inode* inodes = malloc(MAX_INODES * sizeof(Inode));
+    uint64_t blocks[MAX_INODES];
+    uint32_t count = 0;
+    tfs_lock();
+    int status = (inodes && copy_inode_table(inodes) == 0) ? 0 : -1;
+    tfs_unlock();
+    for (uint32_t i = 0; i < MAX_INODES && status == 0; i++) {
+        if (inodes[i].used && inodes[i].type == TYPE_FILE && inodes[i].data_block != 0) {
+            blocks[count++] = inodes[i].data_block;
+        }
+    }
+    free(inodes);
+
+    uint64_t distinct = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t j = 0;
+        while (j < i && blocks[j] != blocks[i]) {
+            j++;
+        }
+        distinct += (j == i) ? 1 : 0;
+    }
+    *logical = count;
+    *physical = distinct;
+    return status;
+}
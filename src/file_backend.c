@@ -0,0 +1,301 @@
+#define _GNU_SOURCE /* O_DIRECT, fallocate, FALLOC_FL_PUNCH_HOLE */
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define WRITE_RUN_IOVECS 256          /* Blocks per pwritev call */
+
+/* Host file behind the disk; one disk is open at a time */
+static int disk_fd = -1;
+static uint64_t file_blocks = 0;
+static uint32_t file_block_size = 0;
+static uint8_t* file_mapping = NULL;  /* mmap backend: the whole file, shared */
+static size_t file_mapping_length = 0;
+static uint8_t* bounce = NULL;        /* O_DIRECT backend: aligned staging buffer */
+static size_t bounce_size = 0;
+
+/* Open (and for a new disk, create and size) the backing file */
+static int open_backing_file(const char* path, uint64_t num_blocks, uint32_t block_size,
+                             bool create, int extra_flags) {
+    if (!path || path[0] == '\0') {
+        return -1;
+    }
+    int flags = O_RDWR | O_CLOEXEC | extra_flags | (create ? O_CREAT | O_TRUNC : 0);
+    disk_fd = open(path, flags, 0644);
+    if (disk_fd < 0) {
+        return -1;
+    }
+
+    /* A new disk starts as one hole, so unwritten blocks read as zeros */
+    off_t length = (off_t)(num_blocks * block_size);
+    struct stat st;
+    if (create ? ftruncate(disk_fd, length) < 0
+               : (fstat(disk_fd, &st) < 0 || st.st_size < length)) {
+        close(disk_fd);
+        disk_fd = -1;
+        return -1;
+    }
+    file_blocks = num_blocks;
+    file_block_size = block_size;
+    return 0;
+}
+
+/* Close the backing file and drop any mapping or staging buffer */
+static void file_close() {
+    if (file_mapping != NULL) {
+        munmap(file_mapping, file_mapping_length);
+        file_mapping = NULL;
+        file_mapping_length = 0;
+    }
+    free(bounce);
+    bounce = NULL;
+    bounce_size = 0;
+    if (disk_fd >= 0) {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    file_blocks = 0;
+}
+
+/* Read all of length bytes at offset */
+static int pread_fully(void* buffer, size_t length, off_t offset) {
+    uint8_t* p = buffer;
+    while (length > 0) {
+        ssize_t n = pread(disk_fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Write all of length bytes at offset */
+static int pwrite_fully(const void* buffer, size_t length, off_t offset) {
+    const uint8_t* p = buffer;
+    while (length > 0) {
+        ssize_t n = pwrite(disk_fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Punch the blocks out of the file; filesystems without hole punching keep the space */
+static int file_discard(uint64_t start, uint64_t count) {
+    off_t offset = (off_t)(start * file_block_size);
+    off_t length = (off_t)(count * file_block_size);
+    if (fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        TFS_STAT_ADD(bytes_discarded, (uint64_t)length);
+    }
+    return 0;
+}
+
+/* Descriptor of the backing file, for the async I/O engine */
+static int file_descriptor() {
+    return disk_fd;
+}
+
+/* Blocks live in the host file, not in process memory */
+static uint64_t file_resident_bytes() {
+    return 0;
+}
+
+/* mmap backend: map the whole file shared so stores reach the page cache directly */
+static int mmap_open(const char* path, uint64_t num_blocks, uint32_t block_size, bool create) {
+    if (open_backing_file(path, num_blocks, block_size, create, 0) < 0) {
+        return -1;
+    }
+    file_mapping_length = (size_t)(num_blocks * block_size);
+    void* mapping = mmap(NULL, file_mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         disk_fd, 0);
+    if (mapping == MAP_FAILED) {
+        file_mapping_length = 0;
+        file_close();
+        return -1;
+    }
+    file_mapping = mapping;
+    return 0;
+}
+
+static int mmap_read(uint64_t block_num, void* buffer) {
+    memcpy(buffer, file_mapping + (size_t)block_num * file_block_size, file_block_size);
+    return 0;
+}
+
+static int mmap_write(uint64_t block_num, const void* buffer) {
+    memcpy(file_mapping + (size_t)block_num * file_block_size, buffer, file_block_size);
+    return 0;
+}
+
+static const uint8_t* mmap_pointer(uint64_t block_num) {
+    return file_mapping + (size_t)block_num * file_block_size;
+}
+
+static uint64_t mmap_contiguous(uint64_t block_num) {
+    return file_blocks - block_num;
+}
+
+/* mmap backend: write dirty pages back and wait for them */
+static int mmap_flush() {
+    return msync(file_mapping, file_mapping_length, MS_SYNC) == 0 ? 0 : -1;
+}
+
+/* pread backend: plain file I/O through the page cache */
+static int pread_open(const char* path, uint64_t num_blocks, uint32_t block_size, bool create) {
+    return open_backing_file(path, num_blocks, block_size, create, 0);
+}
+
+static int pread_read(uint64_t block_num, void* buffer) {
+    return pread_fully(buffer, file_block_size, (off_t)(block_num * file_block_size));
+}
+
+static int pread_write(uint64_t block_num, const void* buffer) {
+    return pwrite_fully(buffer, file_block_size, (off_t)(block_num * file_block_size));
+}
+
+/* Write a run of adjacent blocks with as few pwritev calls as possible */
+static int pwritev_run(uint64_t start, uint64_t count, const uint8_t* const* blocks) {
+    struct iovec iov[WRITE_RUN_IOVECS];
+    while (count > 0) {
+        int n = count < WRITE_RUN_IOVECS ? (int)count : WRITE_RUN_IOVECS;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = (void*)blocks[i];
+            iov[i].iov_len = file_block_size;
+        }
+        size_t length = (size_t)n * file_block_size;
+        ssize_t written = pwritev(disk_fd, iov, n, (off_t)(start * file_block_size));
+        if (written < 0 || (size_t)written != length) {
+            /* Interrupted or short: finish block by block */
+            for (int i = 0; i < n; i++) {
+                if (pwrite_fully(blocks[i], file_block_size,
+                                 (off_t)((start + i) * file_block_size)) < 0) {
+                    return -1;
+                }
+            }
+        }
+        start += (uint64_t)n;
+        blocks += n;
+        count -= (uint64_t)n;
+    }
+    return 0;
+}
+
+/* File backends: data reaches stable storage once fdatasync returns */
+static int file_flush() {
+    return fdatasync(disk_fd) == 0 ? 0 : -1;
+}
+
+/* O_DIRECT backend: transfers must be DIRECT_IO_ALIGN aligned in memory and in the file, so
+ * every block goes through a bounce buffer spanning the aligned range around it */
+static int direct_open(const char* path, uint64_t num_blocks, uint32_t block_size, bool create) {
+    bounce_size = block_size > DIRECT_IO_ALIGN ? block_size : DIRECT_IO_ALIGN;
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, DIRECT_IO_ALIGN, bounce_size) != 0) {
+        bounce_size = 0;
+        return -1;
+    }
+    bounce = buffer;
+
+    if (open_backing_file(path, num_blocks, block_size, create, O_DIRECT) < 0) {
+        file_close();
+        return -1;
+    }
+
+    /* The aligned range around the last block must lie inside the file */
+    off_t aligned_length = (off_t)((num_blocks * block_size + bounce_size - 1) / bounce_size *
+                                   bounce_size);
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0 ||
+        (st.st_size < aligned_length && ftruncate(disk_fd, aligned_length) < 0)) {
+        file_close();
+        return -1;
+    }
+    return 0;
+}
+
+/* Aligned range of the file holding a block, and the block's place in it */
+static off_t direct_span(uint64_t block_num, size_t* within) {
+    off_t offset = (off_t)(block_num * file_block_size);
+    off_t span = offset / (off_t)bounce_size * (off_t)bounce_size;
+    *within = (size_t)(offset - span);
+    return span;
+}
+
+static int direct_read(uint64_t block_num, void* buffer) {
+    size_t within;
+    off_t span = direct_span(block_num, &within);
+    if (pread_fully(bounce, bounce_size, span) < 0) {
+        return -1;
+    }
+    memcpy(buffer, bounce + within, file_block_size);
+    return 0;
+}
+
+/* Blocks smaller than the alignment are read-modify-write of their aligned range */
+static int direct_write(uint64_t block_num, const void* buffer) {
+    size_t within;
+    off_t span = direct_span(block_num, &within);
+    if (file_block_size < bounce_size && pread_fully(bounce, bounce_size, span) < 0) {
+        return -1;
+    }
+    memcpy(bounce + within, buffer, file_block_size);
+    return pwrite_fully(bounce, bounce_size, span);
+}
+
+/* Whole aligned blocks in aligned buffers go straight to pwritev; anything else takes the
+ * bounce buffer one block at a time */
+static int direct_write_run(uint64_t start, uint64_t count, const uint8_t* const* blocks) {
+    bool aligned = file_block_size % DIRECT_IO_ALIGN == 0;
+    for (uint64_t i = 0; aligned && i < count; i++) {
+        aligned = (uintptr_t)blocks[i] % DIRECT_IO_ALIGN == 0;
+    }
+    if (aligned) {
+        return pwritev_run(start, count, blocks);
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        if (direct_write(start + i, blocks[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const BlockBackend mmap_file_backend = {
+    "mmap", BACKEND_CAP_ZERO_COPY | BACKEND_CAP_PERSISTENT,
+    mmap_open, file_close, mmap_read, mmap_write, NULL, mmap_pointer, mmap_contiguous,
+    file_discard, mmap_flush, file_resident_bytes, file_descriptor
+};
+
+const BlockBackend pread_file_backend = {
+    "pread", BACKEND_CAP_PERSISTENT | BACKEND_CAP_ASYNC,
+    pread_open, file_close, pread_read, pread_write, pwritev_run, NULL, NULL,
+    file_discard, file_flush, file_resident_bytes, file_descriptor
+};
+
+const BlockBackend direct_file_backend = {
+    "direct", BACKEND_CAP_PERSISTENT | BACKEND_CAP_ASYNC | BACKEND_CAP_UNCACHED,
+    direct_open, file_close, direct_read, direct_write, direct_write_run, NULL, NULL,
+    file_discard, file_flush, file_resident_bytes, file_descriptor
+};
@@ -0,0 +1,529 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_NORESERVE */
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC 0x49534654        /* "TFSI" */
+#define IMAGE_VERSION 3
+#define IMAGE_HEADER_SIZE 4096        /* Page aligned so the block area can be mapped in place */
+
+/* On-disk image header; blocks follow at IMAGE_HEADER_SIZE in block order */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t header_size;
+    uint32_t epoch;                   /* Checkpoint this image captures */
+    uint32_t reserved;
+    uint64_t total_blocks;
+    uint64_t allocated_blocks;
+    uint64_t volume_id;
+    uint64_t checksum;                /* FNV-1a over the allocated blocks, in block order */
+    uint64_t header_checksum;         /* FNV-1a over the fields above */
+} ImageHeader;
+
+#define DELTA_MAGIC 0x44534654        /* "TFSD" */
+#define DELTA_VERSION 2
+
+/* Delta file header; followed by extent_count BlockExtents, then their blocks in extent order */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t base_epoch;              /* Checkpoint the delta applies on top of */
+    uint32_t epoch;                   /* Checkpoint the volume is at once applied */
+    uint32_t reserved;
+    uint64_t total_blocks;
+    uint64_t extent_count;
+    uint64_t block_count;
+    uint64_t volume_id;
+    uint64_t checksum;                /* FNV-1a over the extent table and blocks */
+    uint64_t header_checksum;         /* FNV-1a over the fields above */
+} DeltaHeader;
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* A block's bytes: in place on zero-copy backends, otherwise read into scratch */
+static const uint8_t* block_bytes(uint64_t block_num, uint8_t* scratch) {
+    const uint8_t* bytes = get_block_pointer(block_num);
+    if (bytes == NULL && read_block(block_num, scratch) == 0) {
+        bytes = scratch;
+    }
+    return bytes;
+}
+
+/* Checksum of every allocated block on the current disk */
+static uint64_t allocated_checksum(uint64_t total, uint64_t* allocated) {
+    uint64_t hash = FNV_OFFSET;
+    uint64_t count = 0;
+    uint8_t* scratch = malloc(get_block_size());
+    for (uint64_t i = 0; scratch && i < total; i++) {
+        if (is_block_allocated(i)) {
+            const uint8_t* bytes = block_bytes(i, scratch);
+            if (bytes == NULL) {
+                break;
+            }
+            hash = fnv1a(hash, bytes, get_block_size());
+            count++;
+        }
+    }
+    free(scratch);
+    if (allocated) {
+        *allocated = count;
+    }
+    return hash;
+}
+
+/* Write all of buf at offset */
+static int write_fully(int fd, const void* buf, size_t length, off_t offset) {
+    const uint8_t* p = buf;
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Create a temporary file beside path to write a new image or delta into. The target is
+ * only replaced once the new file is complete, so an image loaded from path (which stays
+ * mapped) or a crash mid-save never sees a truncated file */
+static int open_beside(const char* path, char** temp_path) {
+    size_t length = strlen(path);
+    char* temp = malloc(length + sizeof(".XXXXXX"));
+    if (!temp) {
+        return -1;
+    }
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkstemp(temp);
+    if (fd < 0 || fchmod(fd, 0644) < 0) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        free(temp);
+        return -1;
+    }
+    *temp_path = temp;
+    return fd;
+}
+
+/* Make the temporary file durable and rename it over path; on any failure it is removed
+ * and path is left as it was */
+static int replace_with(int fd, char* temp_path, const char* path, int status) {
+    if (status == 0 && fsync(fd) < 0) {
+        status = -1;
+    }
+    if (close(fd) < 0) {
+        status = -1;
+    }
+    if (status == 0 && rename(temp_path, path) < 0) {
+        status = -1;
+    }
+    if (status < 0) {
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return status;
+}
+
+/* Write count blocks from start at offset, one write per contiguous piece of disk memory;
+ * blocks on backends without pointers go one at a time through scratch */
+static int write_block_run(int fd, uint64_t start, uint64_t count, off_t offset,
+                           uint8_t* scratch) {
+    uint32_t block_size = get_block_size();
+    while (count > 0) {
+        uint64_t piece = get_contiguous_blocks(start);
+        const uint8_t* bytes = (piece > 0) ? get_block_pointer(start) : block_bytes(start, scratch);
+        if (bytes == NULL) {
+            return -1;
+        }
+        if (piece == 0) {
+            piece = 1;
+        }
+        if (piece > count) {
+            piece = count;
+        }
+        if (write_fully(fd, bytes, (size_t)piece * block_size, offset) < 0) {
+            return -1;
+        }
+        start += piece;
+        count -= piece;
+        offset += (off_t)piece * block_size;
+    }
+    return 0;
+}
+
+/* Extend an FNV-1a hash over count blocks from start */
+static uint64_t hash_block_run(uint64_t hash, uint64_t start, uint64_t count, uint8_t* scratch) {
+    uint32_t block_size = get_block_size();
+    while (count > 0) {
+        uint64_t piece = get_contiguous_blocks(start);
+        const uint8_t* bytes = (piece > 0) ? get_block_pointer(start) : block_bytes(start, scratch);
+        if (bytes == NULL) {
+            break;
+        }
+        if (piece == 0) {
+            piece = 1;
+        }
+        if (piece > count) {
+            piece = count;
+        }
+        hash = fnv1a(hash, bytes, (size_t)piece * block_size);
+        start += piece;
+        count -= piece;
+    }
+    return hash;
+}
+
+/* Body of tfs_save_image */
+static int save_image(const char* path) {
+    uint64_t total = get_total_blocks();
+    if (!path || total == 0) {
+        return -1;
+    }
+
+    /* Whatever a batch, write-back or the async engine still holds must be in the image */
+    if (flush_inode_table() < 0 || flush_bitmap() < 0 || flush_block_queue() < 0 ||
+        drain_block_io() < 0) {
+        return -1;
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.block_size = get_block_size();
+    header.total_blocks = total;
+    header.header_size = IMAGE_HEADER_SIZE;
+    header.epoch = get_checkpoint_epoch() + 1;
+    header.volume_id = get_volume_id();
+    header.checksum = allocated_checksum(total, &header.allocated_blocks);
+    header.header_checksum = fnv1a(FNV_OFFSET, (const uint8_t*)&header,
+                                   offsetof(ImageHeader, header_checksum));
+
+    char* temp_path = NULL;
+    uint8_t* scratch = malloc(header.block_size);
+    int fd = scratch ? open_beside(path, &temp_path) : -1;
+    if (fd < 0) {
+        free(scratch);
+        return -1;
+    }
+
+    uint8_t page[IMAGE_HEADER_SIZE];
+    memset(page, 0, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    int status = write_fully(fd, page, sizeof(page), 0);
+
+    /* Each run of allocated blocks is written in as few pieces as memory allows */
+    uint64_t i = 0;
+    while (status == 0 && i < total) {
+        if (!is_block_allocated(i)) {
+            i++;
+            continue;
+        }
+        uint64_t run = i;
+        while (run < total && is_block_allocated(run)) {
+            run++;
+        }
+        status = write_block_run(fd, i, run - i, IMAGE_HEADER_SIZE + (off_t)i * header.block_size,
+                                 scratch);
+        i = run;
+    }
+    free(scratch);
+
+    /* Extend over trailing free blocks so the whole block area can be mapped */
+    if (status == 0) {
+        status = ftruncate(fd, IMAGE_HEADER_SIZE + (off_t)total * header.block_size);
+    }
+    status = replace_with(fd, temp_path, path, status);
+
+    /* Later deltas are relative to this image */
+    if (status == 0) {
+        set_checkpoint_state(header.volume_id, header.epoch);
+    }
+    return status;
+}
+
+/* Save the volume to a host file; free blocks are left as holes */
+int tfs_save_image(const char* path) {
+    tfs_lock();
+    int result = save_image(path);
+    tfs_unlock();
+    return result;
+}
+
+/* Load a saved volume by mapping it copy-on-write; the file itself is never modified */
+int tfs_load_image(const char* path, bool verify) {
+    if (!path) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ImageHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t expected = fnv1a(FNV_OFFSET, (const uint8_t*)&header,
+                              offsetof(ImageHeader, header_checksum));
+    if (header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION ||
+        header.header_checksum != expected || !is_valid_block_size(header.block_size) ||
+        header.header_size != IMAGE_HEADER_SIZE || header.total_blocks == 0 ||
+        header.total_blocks > (SIZE_MAX - IMAGE_HEADER_SIZE) / header.block_size) {
+        close(fd);
+        return -1;
+    }
+
+    size_t length = (size_t)header.header_size + (size_t)header.total_blocks * header.block_size;
+    if ((uint64_t)st.st_size < length) {
+        close(fd);
+        return -1;
+    }
+
+    /* Only pages that get written need memory; do not reserve swap for the whole volume */
+    void* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    if (attach_disk_mapping(mapping, length, IMAGE_HEADER_SIZE, header.total_blocks,
+                            header.block_size) < 0) {
+        munmap(mapping, length);
+        return -1;
+    }
+
+    if (mount_filesystem() < 0) {
+        free_disk();
+        return -1;
+    }
+
+    /* Verification touches every allocated block; skip it for a fully lazy load */
+    if (verify) {
+        uint64_t allocated = 0;
+        if (allocated_checksum(header.total_blocks, &allocated) != header.checksum ||
+            allocated != header.allocated_blocks) {
+            free_disk();
+            return -1;
+        }
+    }
+
+    set_checkpoint_state(header.volume_id, header.epoch);
+    return 0;
+}
+
+/* Body of tfs_save_delta */
+static int save_delta(const char* path) {
+    uint64_t total = get_total_blocks();
+    if (!path || total == 0) {
+        return -1;
+    }
+
+    /* A delta needs a saved image (or earlier delta) to apply to */
+    if (get_checkpoint_epoch() == 0) {
+        return -1;
+    }
+
+    if (flush_inode_table() < 0 || flush_bitmap() < 0 || flush_block_queue() < 0 ||
+        drain_block_io() < 0) {
+        return -1;
+    }
+
+    DeltaHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DELTA_MAGIC;
+    header.version = DELTA_VERSION;
+    header.block_size = get_block_size();
+    header.total_blocks = total;
+    header.base_epoch = get_checkpoint_epoch();
+    header.epoch = header.base_epoch + 1;
+    header.volume_id = get_volume_id();
+
+    /* Gather the dirty extents; their number is bounded by half the blocks */
+    BlockExtent extent;
+    uint64_t cursor = 0;
+    while (next_dirty_extent(&cursor, &extent) > 0) {
+        header.extent_count++;
+    }
+    BlockExtent* extents = malloc(((size_t)header.extent_count + 1) * sizeof(BlockExtent));
+    uint8_t* scratch = malloc(header.block_size);
+    if (!extents || !scratch) {
+        free(extents);
+        free(scratch);
+        return -1;
+    }
+    cursor = 0;
+    for (uint64_t i = 0; i < header.extent_count && next_dirty_extent(&cursor, &extents[i]) > 0; i++) {
+        header.block_count += extents[i].count;
+    }
+
+    size_t table_size = (size_t)header.extent_count * sizeof(BlockExtent);
+    uint64_t hash = fnv1a(FNV_OFFSET, (const uint8_t*)extents, table_size);
+    for (uint64_t i = 0; i < header.extent_count; i++) {
+        hash = hash_block_run(hash, extents[i].start, extents[i].count, scratch);
+    }
+    header.checksum = hash;
+    header.header_checksum = fnv1a(FNV_OFFSET, (const uint8_t*)&header,
+                                   offsetof(DeltaHeader, header_checksum));
+
+    char* temp_path = NULL;
+    int fd = open_beside(path, &temp_path);
+    if (fd < 0) {
+        free(extents);
+        free(scratch);
+        return -1;
+    }
+
+    off_t offset = sizeof(header);
+    int status = write_fully(fd, &header, sizeof(header), 0);
+    if (status == 0) {
+        status = write_fully(fd, extents, table_size, offset);
+        offset += (off_t)table_size;
+    }
+    for (uint64_t i = 0; status == 0 && i < header.extent_count; i++) {
+        status = write_block_run(fd, extents[i].start, extents[i].count, offset, scratch);
+        offset += (off_t)extents[i].count * header.block_size;
+    }
+    free(extents);
+    free(scratch);
+    status = replace_with(fd, temp_path, path, status);
+
+    if (status == 0) {
+        set_checkpoint_state(header.volume_id, header.epoch);
+    }
+    return status;
+}
+
+/* Write the blocks changed since the last checkpoint as a delta, and start a new checkpoint */
+int tfs_save_delta(const char* path) {
+    tfs_lock();
+    int result = save_delta(path);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of tfs_apply_delta */
+static int apply_delta(const char* path) {
+    uint64_t total = get_total_blocks();
+    if (!path || total == 0) {
+        return -1;
+    }
+
+    /* Changes since the checkpoint would silently mix with the delta */
+    if (count_dirty_blocks() > 0 || tfs_batch_active() || count_writeback_dirty() > 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    DeltaHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t expected = fnv1a(FNV_OFFSET, (const uint8_t*)&header,
+                              offsetof(DeltaHeader, header_checksum));
+    if (header.magic != DELTA_MAGIC || header.version != DELTA_VERSION ||
+        header.header_checksum != expected || header.block_size != get_block_size() ||
+        header.total_blocks != total || header.volume_id != get_volume_id() ||
+        header.base_epoch != get_checkpoint_epoch() || header.epoch != header.base_epoch + 1 ||
+        header.block_count > total || header.extent_count > header.block_count) {
+        close(fd);
+        return -1;
+    }
+
+    /* Both counts are bounded by the volume, which is already addressable in memory */
+    size_t table_size = (size_t)header.extent_count * sizeof(BlockExtent);
+    size_t length = sizeof(header) + table_size + (size_t)header.block_count * get_block_size();
+    if ((uint64_t)st.st_size != length) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    /* Validate everything before the first block is touched */
+    const BlockExtent* extents = (const BlockExtent*)(data + sizeof(header));
+    const uint8_t* blocks = data + sizeof(header) + table_size;
+    uint64_t covered = 0;
+    int status = 0;
+    for (uint64_t i = 0; i < header.extent_count; i++) {
+        if (extents[i].count == 0 || extents[i].start >= total ||
+            extents[i].count > total - extents[i].start) {
+            status = -1;
+            break;
+        }
+        covered += extents[i].count;
+    }
+    if (status == 0 && (covered != header.block_count ||
+        fnv1a(FNV_OFFSET, data + sizeof(header), length - sizeof(header)) != header.checksum)) {
+        status = -1;
+    }
+
+    for (uint64_t i = 0; status == 0 && i < header.extent_count; i++) {
+        for (uint64_t b = 0; b < extents[i].count && status == 0; b++) {
+            status = write_block(extents[i].start + b, blocks);
+            blocks += header.block_size;
+        }
+    }
+    munmap(data, length);
+
+    /* Cached metadata and open handles describe the old state */
+    if (status == 0 && mount_filesystem() < 0) {
+        status = -1;
+    }
+    if (status == 0) {
+        set_checkpoint_state(header.volume_id, header.epoch);
+    }
+    return status;
+}
+
+/* Apply a delta to the loaded volume; it must be at the delta's base checkpoint, unmodified */
+int tfs_apply_delta(const char* path) {
+    tfs_lock();
+    int result = apply_delta(path);
+    tfs_unlock();
+    return result;
+}
@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+extern Superblock* get_superblock();
+
+#define BLOCK_QUEUE_BYTES (1024 * 1024)   /* Block data held before a forced dispatch */
+#define BLOCK_QUEUE_MIN 16
+#define BLOCK_QUEUE_MAX 4096
+
+/* A queued write: the block and the slot of the queue buffer holding its data */
+typedef struct {
+    uint64_t block_num;
+    uint32_t slot;
+} QueuedWrite;
+
+/* Writes held while the queue is plugged, newest data per block only */
+static uint32_t plug_depth = 0;
+static QueuedWrite* queued = NULL;
+static uint32_t queued_count = 0;
+static uint32_t queue_capacity = 0;
+static uint32_t queue_block_size = 0;
+static uint8_t* queue_data = NULL;    /* queue_capacity blocks, DIRECT_IO_ALIGN aligned */
+static int32_t* slot_index = NULL;    /* Open-addressing table: block number -> queued index */
+static uint32_t index_mask = 0;
+
+/* Free the queue's memory; anything still queued is dropped */
+static void free_queue() {
+    free(queue_data);
+    free(queued);
+    free(slot_index);
+    queue_data = NULL;
+    queued = NULL;
+    slot_index = NULL;
+    queued_count = 0;
+    queue_capacity = 0;
+    queue_block_size = 0;
+}
+
+/* Blocks the queue holds at the current block size */
+uint32_t get_block_queue_capacity() {
+    uint32_t capacity = BLOCK_QUEUE_BYTES / get_block_size();
+    capacity = capacity < BLOCK_QUEUE_MIN ? BLOCK_QUEUE_MIN : capacity;
+    return capacity > BLOCK_QUEUE_MAX ? BLOCK_QUEUE_MAX : capacity;
+}
+
+/* Blocks currently waiting in the queue */
+uint32_t get_queued_blocks() {
+    return queued_count;
+}
+
+/* Size the queue for the current block size */
+static int allocate_queue() {
+    uint32_t block_size = get_block_size();
+    if (queue_data != NULL && queue_block_size == block_size) {
+        return 0;
+    }
+    free_queue();
+
+    uint32_t capacity = get_block_queue_capacity();
+    uint32_t table_size = 1;
+    while (table_size < capacity * 2) {
+        table_size <<= 1;
+    }
+
+    void* data = NULL;
+    if (posix_memalign(&data, DIRECT_IO_ALIGN, (size_t)capacity * block_size) != 0) {
+        return -1;
+    }
+    queued = malloc(capacity * sizeof(QueuedWrite));
+    slot_index = malloc(table_size * sizeof(int32_t));
+    if (!queued || !slot_index) {
+        free(data);
+        free(queued);
+        free(slot_index);
+        queued = NULL;
+        slot_index = NULL;
+        return -1;
+    }
+    memset(slot_index, 0xFF, table_size * sizeof(int32_t));
+    queue_data = data;
+    queue_capacity = capacity;
+    queue_block_size = block_size;
+    index_mask = table_size - 1;
+    queued_count = 0;
+    return 0;
+}
+
+/* Position of block_num in slot_index: its entry, or the empty place it would go */
+static uint32_t find_slot(uint64_t block_num) {
+    uint32_t i = (uint32_t)((block_num * 0x9E3779B97F4A7C15ull) >> 32) & index_mask;
+    while (slot_index[i] >= 0 && queued[slot_index[i]].block_num != block_num) {
+        i = (i + 1) & index_mask;
+    }
+    return i;
+}
+
+static int compare_queued(const void* a, const void* b) {
+    uint64_t x = ((const QueuedWrite*)a)->block_num;
+    uint64_t y = ((const QueuedWrite*)b)->block_num;
+    return (x > y) - (x < y);
+}
+
+static int compare_slots(const void* a, const void* b) {
+    uint32_t x = ((const QueuedWrite*)a)->slot;
+    uint32_t y = ((const QueuedWrite*)b)->slot;
+    return (x > y) - (x < y);
+}
+
+/* Write queued[first..last), sorted by block, one vectored write per run of adjacent blocks.
+ * The entries of runs that failed are packed at queued[first..first+*kept) to be retried */
+static int dispatch_runs(uint32_t first, uint32_t last, uint32_t* kept) {
+    const uint8_t* run[BLOCK_QUEUE_MAX];
+    int status = 0;
+    uint32_t i = first;
+    *kept = 0;
+    while (i < last) {
+        uint32_t begin = i;
+        uint32_t n = 0;
+        uint64_t start = queued[i].block_num;
+        while (i < last && queued[i].block_num == start + n) {
+            run[n++] = queue_data + (size_t)queued[i].slot * queue_block_size;
+            i++;
+        }
+        if (write_block_vector(start, n, run) < 0) {
+            status = -1;
+            memmove(&queued[first + *kept], &queued[begin], n * sizeof(QueuedWrite));
+            *kept += n;
+        }
+        TFS_STAT_ADD(io_runs, 1);
+    }
+    return status;
+}
+
+/* Drop the written entries of queued[first..last), keeping the kept ones packed at its
+ * front, then move the survivors' data down so slots 0..queued_count-1 stay the ones in
+ * use; in slot order no move overwrites data still to be moved */
+static void compact_queue(uint32_t first, uint32_t kept, uint32_t last) {
+    memmove(&queued[first + kept], &queued[last], (queued_count - last) * sizeof(QueuedWrite));
+    queued_count -= last - first - kept;
+    memset(slot_index, 0xFF, (index_mask + 1) * sizeof(int32_t));
+    if (queued_count == 0) {
+        return;
+    }
+    qsort(queued, queued_count, sizeof(QueuedWrite), compare_slots);
+    for (uint32_t i = 0; i < queued_count; i++) {
+        if (queued[i].slot != i) {
+            memcpy(queue_data + (size_t)i * queue_block_size,
+                   queue_data + (size_t)queued[i].slot * queue_block_size, queue_block_size);
+            queued[i].slot = i;
+        }
+        slot_index[find_slot(queued[i].block_num)] = (int32_t)i;
+    }
+}
+
+/* Send only the queued writes to blocks start..start+count-1, leaving the rest queued,
+ * along with any of them that fail */
+int flush_queued_range(uint64_t start, uint64_t count) {
+    if (count == 0 || next_queued_block(start) - start >= count) {
+        return 0;
+    }
+
+    /* Sorting moves entries under slot_index, which only compact_queue rebuilds */
+    qsort(queued, queued_count, sizeof(QueuedWrite), compare_queued);
+    uint32_t first = 0;
+    while (first < queued_count && queued[first].block_num < start) {
+        first++;
+    }
+    uint32_t last = first;
+    while (last < queued_count && queued[last].block_num - start < count) {
+        last++;
+    }
+    uint32_t kept;
+    int status = dispatch_runs(first, last, &kept);
+    compact_queue(first, kept, last);
+    return status;
+}
+
+/* Lowest queued block at or after from, or UINT64_MAX if there is none */
+uint64_t next_queued_block(uint64_t from) {
+    uint64_t next = UINT64_MAX;
+    for (uint32_t i = 0; i < queued_count; i++) {
+        if (queued[i].block_num >= from && queued[i].block_num < next) {
+            next = queued[i].block_num;
+        }
+    }
+    return next;
+}
+
+/* Send every queued write to the disk, the data area first and then, in block order, the
+ * superblock, bitmap and inode table that point into it. Metadata stays queued if any data
+ * write fails, so the disk never refers to blocks that were not written; writes that fail
+ * stay queued for a later flush to retry */
+int flush_block_queue() {
+    Superblock* sb = get_superblock();
+    uint64_t data_start = sb ? sb->data_start_block : 0;
+    if (flush_queued_range(data_start, UINT64_MAX - data_start) < 0) {
+        return -1;
+    }
+    return flush_queued_range(0, data_start);
+}
+
+/* Start holding block writes so they can be merged and deduplicated; nests */
+int plug_block_queue() {
+    plug_depth++;
+    return 0;
+}
+
+/* End a plug; the outermost one dispatches everything queued unless write-back keeps it */
+int unplug_block_queue() {
+    if (plug_depth == 0) {
+        return -1;
+    }
+    if (--plug_depth > 0 || writeback_caches_blocks()) {
+        return 0;
+    }
+    return flush_block_queue();
+}
+
+/* Whether write_block currently queues for a plug instead of writing through */
+bool block_queue_plugged() {
+    return plug_depth > 0;
+}
+
+/* Queue a block write, replacing any queued write to the same block */
+int queue_block_write(uint64_t block_num, const void* buffer) {
+    if (allocate_queue() < 0) {
+        return -1;
+    }
+
+    uint32_t position = find_slot(block_num);
+    if (slot_index[position] >= 0) {
+        uint32_t slot = queued[slot_index[position]].slot;
+        memcpy(queue_data + (size_t)slot * queue_block_size, buffer, queue_block_size);
+        TFS_STAT_ADD(io_deduplicated, 1);
+        return 0;
+    }
+
+    if (queued_count == queue_capacity) {
+        /* Writes the disk refused stay queued; with no room left this one cannot be */
+        flush_block_queue();
+        if (queued_count == queue_capacity) {
+            return -1;
+        }
+        position = find_slot(block_num);
+    }
+    uint32_t slot = queued_count;
+    queued[queued_count].block_num = block_num;
+    queued[queued_count].slot = slot;
+    slot_index[position] = (int32_t)queued_count;
+    queued_count++;
+    memcpy(queue_data + (size_t)slot * queue_block_size, buffer, queue_block_size);
+    TFS_STAT_ADD(io_queued, 1);
+    return 0;
+}
+
+/* Copy a block's queued data into buffer; false if no write to it is queued */
+bool read_queued_block(uint64_t block_num, void* buffer) {
+    if (queued_count == 0) {
+        return false;
+    }
+    int32_t entry = slot_index[find_slot(block_num)];
+    if (entry < 0) {
+        return false;
+    }
+    memcpy(buffer, queue_data + (size_t)queued[entry].slot * queue_block_size, queue_block_size);
+    return true;
+}
+
+/* Forget the queue and any plug; the disk it belonged to is going away */
+void reset_block_queue() {
+    free_queue();
+    plug_depth = 0;
+}
@@ -5,9 +5,22 @@
 
 static Superblock superblock_data;
 static Inode inode_table[MAX_INODES];
-OpenFileEntry open_file_table[MAX_OPEN_FILES];
+OpenFileEntry* open_file_table = NULL;
+static uint32_t open_file_capacity = 0;  /* Slots in open_file_table */
+static int free_fd_head = -1;            /* First free slot, chained via next_fd */
+static int inode_fd_head[MAX_INODES];    /* First descriptor open on each inode */
 static bool superblock_loaded = false;
 static bool inode_table_loaded = false;
+static const Inode* inode_view = NULL;   /* Snapshot inode table load_inode reads, if any */
+static int inode_view_id = 0;
+
+/* Batched metadata updates */
+#define INODES_PER_BLOCK (get_block_size() / sizeof(Inode))
+#define INODE_TABLE_BLOCKS ((MAX_INODES + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK)
+#define MAX_INODE_TABLE_BLOCKS \
+    ((MAX_INODES + MIN_BLOCK_SIZE / sizeof(Inode) - 1) / (MIN_BLOCK_SIZE / sizeof(Inode)))
+static uint32_t batch_depth = 0;                      /* Nesting level of open batches */
+static bool inode_block_dirty[MAX_INODE_TABLE_BLOCKS]; /* Inode table blocks awaiting write */
 
 /* Get reference to superblock */
 Superblock* get_superblock() {
@@ -21,45 +34,81 @@ Superblock* get_superblock() {
 
 /* Load superblock from disk */
 int load_superblock() {
-    if (read_block(0, &superblock_data) < 0) {
+    uint8_t* block = malloc(get_block_size());
+    if (!block) {
+        return -1;
+    }
+    if (read_block(0, block) < 0) {
+        free(block);
         return -1;
     }
 
-    if (superblock_data.magic != MAGIC_NUMBER) {
+    /* Only the struct is copied; the rest of block 0 is padding */
+    Superblock sb;
+    memcpy(&sb, block, sizeof(Superblock));
+    free(block);
+    if (sb.magic != MAGIC_NUMBER) {
         return -1;
     }
 
+    superblock_data = sb;
+
     superblock_loaded = true;
     return 0;
 }
 
 /* Save superblock to disk */
 int save_superblock() {
-    if (write_block(0, &superblock_data) < 0) {
+    uint8_t* block = calloc(get_block_size(), 1);
+    if (!block) {
         return -1;
     }
-    return 0;
+    memcpy(block, &superblock_data, sizeof(Superblock));
+
+    int status = write_block(0, block);
+    free(block);
+    return status < 0 ? -1 : 0;
+}
+
+/* Initialize file system metadata with the default block size */
+int init_filesystem(uint64_t num_blocks) {
+    return init_filesystem_with_block_size(num_blocks, DEFAULT_BLOCK_SIZE);
+}
+
+/* Abandon any batch left open: close its plugs so the queue stops holding writes, and
+ * give back the file system lock it holds */
+static void abandon_batches() {
+    for (; batch_depth > 0; batch_depth--) {
+        unplug_block_queue();
+        tfs_unlock();
+    }
 }
 
-/* Initialize file system metadata */
-int init_filesystem(uint32_t num_blocks) {
+/* Body of init_filesystem_with_block_size */
+static int format_filesystem(uint64_t num_blocks, uint32_t block_size) {
+    abandon_batches();
+
     /* Initialize disk */
-    if (init_disk(num_blocks) < 0) {
+    if (init_disk(num_blocks, block_size) < 0) {
         return -1;
     }
 
     /* Calculate layout */
-    uint32_t inode_blocks = (MAX_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint32_t bitmap_bytes = (num_blocks + 7) / 8;
-    uint32_t bitmap_blocks = (bitmap_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint32_t data_start = 1 + bitmap_blocks + inode_blocks;
+    uint64_t inode_blocks = INODE_TABLE_BLOCKS;
+    uint64_t bitmap_bytes = (num_blocks + 7) / 8;
+    uint64_t bitmap_blocks = (bitmap_bytes + block_size - 1) / block_size;
+    if (1 + bitmap_blocks + inode_blocks >= num_blocks) {
+        free_disk();
+        return -1;
+    }
+    uint64_t data_start = 1 + bitmap_blocks + inode_blocks;
 
     /* Initialize superblock */
     memset(&superblock_data, 0, sizeof(Superblock));
     superblock_data.magic = MAGIC_NUMBER;
     superblock_data.version = FS_VERSION;
     superblock_data.total_blocks = num_blocks;
-    superblock_data.block_size = BLOCK_SIZE;
+    superblock_data.block_size = block_size;
     superblock_data.bitmap_block = 1;
     superblock_data.inode_table_block = 1 + bitmap_blocks;
     superblock_data.inode_count = MAX_INODES;
@@ -72,6 +121,10 @@ int init_filesystem(uint32_t num_blocks) {
 
     /* Initialize inode table in memory */
     memset(inode_table, 0, sizeof(inode_table));
+    memset(inode_block_dirty, 0, sizeof(inode_block_dirty));
+    inode_table_loaded = true;
+    drop_snapshots();
+    init_open_file_table();
 
     /* Initialize bitmap */
     if (init_bitmap() < 0) {
@@ -87,30 +140,114 @@ int init_filesystem(uint32_t num_blocks) {
     return 0;
 }
 
-/* Load inode table from disk */
+/* Initialize file system metadata on a new disk of num_blocks blocks of block_size bytes */
+int init_filesystem_with_block_size(uint64_t num_blocks, uint32_t block_size) {
+    tfs_lock();
+    int result = format_filesystem(num_blocks, block_size);
+    tfs_unlock();
+    return result;
+}
+
+/* Data blocks the live inodes point at, one entry per pointer; returns the count */
+static uint32_t collect_data_blocks(uint64_t* blocks) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < MAX_INODES; i++) {
+        if (inode_table[i].used && inode_table[i].data_block >= superblock_data.data_start_block &&
+            inode_table[i].data_block < superblock_data.total_blocks) {
+            blocks[count++] = inode_table[i].data_block;
+        }
+    }
+    return count;
+}
+
+/* Body of mount_filesystem */
+static int adopt_filesystem() {
+    superblock_loaded = false;
+    inode_table_loaded = false;
+    abandon_batches();
+    memset(inode_block_dirty, 0, sizeof(inode_block_dirty));
+    drop_snapshots();
+    init_open_file_table();
+
+    if (load_superblock() < 0) {
+        return -1;
+    }
+    if (superblock_data.version != FS_VERSION || superblock_data.block_size != get_block_size() ||
+        superblock_data.inode_count != MAX_INODES ||
+        superblock_data.total_blocks > get_total_blocks()) {
+        return -1;
+    }
+    if (load_inode_table() < 0 || load_bitmap() < 0) {
+        return -1;
+    }
+
+    /* Blocks several inodes point at get their reference counts back */
+    uint64_t blocks[MAX_INODES];
+    uint32_t count = collect_data_blocks(blocks);
+    if (rebuild_block_refs(blocks, count) < 0) {
+        return -1;
+    }
+
+    /* Snapshots that died with the last mount left their blocks marked used. The flag only
+     * goes once the bitmap without them is written */
+    if (superblock_data.snapshots_live != 0) {
+        if (find_unreferenced_blocks(blocks, count, true) == (uint64_t)-1) {
+            return -1;
+        }
+        superblock_data.snapshots_live = 0;
+        if (flush_bitmap() < 0 || save_superblock() < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Adopt the file system already on the disk, dropping all cached metadata */
+int mount_filesystem() {
+    tfs_lock();
+    int result = adopt_filesystem();
+    tfs_unlock();
+    return result;
+}
+
+/* Data blocks marked used that no inode points at. Outside a sweep of dead snapshots
+ * they can only come from damage; finding them walks the whole bitmap, so mounting leaves
+ * it to whoever asks */
+uint64_t get_orphan_blocks() {
+    if ((!inode_table_loaded && load_inode_table() < 0) || !get_superblock()) {
+        return 0;
+    }
+    uint64_t blocks[MAX_INODES];
+    uint64_t found = find_unreferenced_blocks(blocks, collect_data_blocks(blocks), false);
+    return found == (uint64_t)-1 ? 0 : found;
+}
+
+/* Load inode table from disk (no-op once cached; see reload_inode_table) */
 int load_inode_table() {
+    if (inode_table_loaded) {
+        return 0;
+    }
+
     if (!superblock_loaded) {
         if (load_superblock() < 0) {
             return -1;
         }
     }
 
-    uint32_t inode_blocks = (MAX_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint8_t* block_buffer = malloc(BLOCK_SIZE);
+    uint8_t* block_buffer = malloc(get_block_size());
     if (!block_buffer) {
         return -1;
     }
 
-    for (uint32_t i = 0; i < inode_blocks; i++) {
+    for (uint32_t i = 0; i < INODE_TABLE_BLOCKS; i++) {
         if (read_block(superblock_data.inode_table_block + i, block_buffer) < 0) {
             free(block_buffer);
             return -1;
         }
 
-        uint32_t inodes_per_block = BLOCK_SIZE / sizeof(Inode);
-        uint32_t start_inode = i * inodes_per_block;
-        uint32_t copy_count = (start_inode + inodes_per_block > MAX_INODES) ?
-                             (MAX_INODES - start_inode) : inodes_per_block;
+        uint32_t start_inode = i * INODES_PER_BLOCK;
+        uint32_t copy_count = (start_inode + INODES_PER_BLOCK > MAX_INODES) ?
+                             (MAX_INODES - start_inode) : INODES_PER_BLOCK;
 
         memcpy(&inode_table[start_inode], block_buffer, copy_count * sizeof(Inode));
     }
@@ -122,41 +259,157 @@ int load_inode_table() {
 
 /* Force reload inode table from disk (clears cached version) */
 int reload_inode_table() {
+    /* Never drop updates that are still waiting for a batch commit */
+    if (flush_inode_table() < 0) {
+        return -1;
+    }
     inode_table_loaded = false;
     return load_inode_table();
 }
 
-/* Save inode table to disk */
-static int save_inode_table() {
+/* Write one block of the inode table to disk */
+static int write_inode_block(uint32_t index) {
     if (!superblock_loaded) {
         if (load_superblock() < 0) {
             return -1;
         }
     }
 
-    uint32_t inode_blocks = (MAX_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint8_t* block_buffer = malloc(BLOCK_SIZE);
+    uint8_t* block_buffer = calloc(get_block_size(), 1);
     if (!block_buffer) {
         return -1;
     }
 
-    for (uint32_t i = 0; i < inode_blocks; i++) {
-        memset(block_buffer, 0, BLOCK_SIZE);
+    uint32_t start_inode = index * INODES_PER_BLOCK;
+    uint32_t copy_count = (start_inode + INODES_PER_BLOCK > MAX_INODES) ?
+                         (MAX_INODES - start_inode) : INODES_PER_BLOCK;
 
-        uint32_t inodes_per_block = BLOCK_SIZE / sizeof(Inode);
-        uint32_t start_inode = i * inodes_per_block;
-        uint32_t copy_count = (start_inode + inodes_per_block > MAX_INODES) ?
-                             (MAX_INODES - start_inode) : inodes_per_block;
+    memcpy(block_buffer, &inode_table[start_inode], copy_count * sizeof(Inode));
 
-        memcpy(block_buffer, &inode_table[start_inode], copy_count * sizeof(Inode));
+    int status = write_block(superblock_data.inode_table_block + index, block_buffer);
+    free(block_buffer);
+    if (status < 0) {
+        return -1;
+    }
 
-        if (write_block(superblock_data.inode_table_block + i, block_buffer) < 0) {
-            free(block_buffer);
-            return -1;
+    inode_block_dirty[index] = false;
+    return 0;
+}
+
+/* Persist the inode table block holding inode_num, or defer it inside a batch or for
+ * write-back */
+static int sync_inode(uint32_t inode_num) {
+    uint32_t index = inode_num / INODES_PER_BLOCK;
+    if (metadata_deferred()) {
+        inode_block_dirty[index] = true;
+        note_writeback_dirty();
+        return 0;
+    }
+    if (write_inode_block(index) < 0) {
+        return -1;
+    }
+    return flush_due_discards();
+}
+
+/* Write all inode table blocks modified since the last flush */
+int flush_inode_table() {
+    /* Dirty table blocks are adjacent on disk; let the scheduler merge them */
+    plug_block_queue();
+    int status = 0;
+    for (uint32_t i = 0; i < INODE_TABLE_BLOCKS && status == 0; i++) {
+        if (inode_block_dirty[i] && write_inode_block(i) < 0) {
+            status = -1;
         }
     }
+    if (unplug_block_queue() < 0) {
+        status = -1;
+    }
+    return status;
+}
 
-    free(block_buffer);
+/* Write inode_num's slot of the inode table now, if its block has deferred changes. Only
+ * that slot changes, in the block as last written: the other inodes there may point at data
+ * still queued. The block stays deferred unless nothing else in it differs */
+int flush_inode(uint32_t inode_num) {
+    if (inode_num >= MAX_INODES) {
+        return -1;
+    }
+    uint32_t index = inode_num / INODES_PER_BLOCK;
+    if (!inode_block_dirty[index]) {
+        return 0;
+    }
+    uint64_t block_num = superblock_data.inode_table_block + index;
+    uint8_t* block = malloc(get_block_size());
+    if (!block || read_block(block_num, block) < 0) {
+        free(block);
+        return -1;
+    }
+
+    uint32_t start_inode = index * INODES_PER_BLOCK;
+    uint32_t copy_count = (start_inode + INODES_PER_BLOCK > MAX_INODES) ?
+                         (MAX_INODES - start_inode) : INODES_PER_BLOCK;
+    memcpy(block + (inode_num - start_inode) * sizeof(Inode), &inode_table[inode_num],
+           sizeof(Inode));
+    bool whole = memcmp(block, &inode_table[start_inode], copy_count * sizeof(Inode)) == 0;
+
+    int status = 0;
+    if (write_block(block_num, block) < 0 || flush_queued_range(block_num, 1) < 0) {
+        status = -1;
+    } else if (whole) {
+        inode_block_dirty[index] = false;
+    }
+    free(block);
+    return status;
+}
+
+/* Load an inode as last written to the disk, without the changes still deferred */
+int load_stored_inode(uint32_t inode_num, Inode* inode) {
+    if (inode_num >= MAX_INODES || !inode || (!superblock_loaded && load_superblock() < 0)) {
+        return -1;
+    }
+    uint32_t index = inode_num / INODES_PER_BLOCK;
+    uint8_t* block = malloc(get_block_size());
+    if (!block || read_block(superblock_data.inode_table_block + index, block) < 0) {
+        free(block);
+        return -1;
+    }
+    memcpy(inode, block + (inode_num - index * INODES_PER_BLOCK) * sizeof(Inode), sizeof(Inode));
+    free(block);
+    return 0;
+}
+
+/* Number of inode table blocks changed but not yet written */
+uint32_t count_dirty_inode_blocks() {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < INODE_TABLE_BLOCKS; i++) {
+        count += inode_block_dirty[i] ? 1 : 0;
+    }
+    return count;
+}
+
+/* Read inodes from a snapshot's table (snapshot id) or the live one (0); the inode table
+ * cannot be changed while a snapshot is selected */
+int select_inode_view(int snapshot) {
+    const Inode* view = NULL;
+    if (snapshot != 0 && !(view = get_snapshot_inodes(snapshot))) {
+        return -1;
+    }
+    inode_view = view;
+    inode_view_id = snapshot;
+    return 0;
+}
+
+/* Snapshot whose inode table load_inode reads, 0 for the live volume */
+int get_inode_view() {
+    return inode_view_id;
+}
+
+/* Copy the live inode table into inodes (MAX_INODES entries) */
+int copy_inode_table(Inode* inodes) {
+    if (!inode_table_loaded && load_inode_table() < 0) {
+        return -1;
+    }
+    memcpy(inodes, inode_table, sizeof(inode_table));
     return 0;
 }
 
@@ -172,13 +425,13 @@ int load_inode(uint32_t inode_num, Inode* inode) {
         return -1;
     }
 
-    *inode = inode_table[inode_num];
+    *inode = inode_view ? inode_view[inode_num] : inode_table[inode_num];
     return 0;
 }
 
 /* Save an inode to the inode table */
 int save_inode(const Inode* inode) {
-    if (!inode || inode->inode_num >= MAX_INODES) {
+    if (!inode || inode->inode_num >= MAX_INODES || inode_view) {
         return -1;
     }
 
@@ -189,27 +442,34 @@ int save_inode(const Inode* inode) {
     }
 
     inode_table[inode->inode_num] = *inode;
-    return save_inode_table();
+    return sync_inode(inode->inode_num);
 }
 
 /* Allocate a free inode */
 uint32_t allocate_inode() {
+    if (inode_view) {
+        return (uint32_t)-1;
+    }
     if (!inode_table_loaded) {
         if (load_inode_table() < 0) {
             return (uint32_t)-1;
         }
     }
 
+    TFS_STAT_ADD(inode_allocs, 1);
+
     for (uint32_t i = 0; i < MAX_INODES; i++) {
         if (!inode_table[i].used) {
+            TFS_STAT_ADD(inode_alloc_scan, i + 1);
             memset(&inode_table[i], 0, sizeof(Inode));
             inode_table[i].inode_num = i;
             inode_table[i].used = 1;
-            save_inode_table();
+            sync_inode(i);
             return i;
         }
     }
 
+    TFS_STAT_ADD(inode_alloc_scan, MAX_INODES);
     return (uint32_t)-1; /* No free inodes */
 }
 
@@ -221,12 +481,67 @@ int free_inode(uint32_t inode_num) {
         }
     }
 
-    if (inode_num >= MAX_INODES) {
+    if (inode_num >= MAX_INODES || inode_view) {
         return -1;
     }
 
     inode_table[inode_num].used = 0;
-    return save_inode_table();
+    return sync_inode(inode_num);
+}
+
+/* Start a batch: metadata updates stay in memory until the matching commit. The batch
+ * holds the file system lock until then, so the flusher never writes it half applied */
+int tfs_begin_batch() {
+    /* Block writes made inside the batch are queued too, so rewrites of a block collapse */
+    tfs_lock();
+    batch_depth++;
+    return plug_block_queue();
+}
+
+/* Body of tfs_commit_batch */
+static int commit_batch() {
+    if (batch_depth == 0) {
+        return -1;
+    }
+
+    if (--batch_depth > 0) {
+        return unplug_block_queue();
+    }
+
+    /* Under write-back the flusher takes the dirty blocks from here */
+    int status = 0;
+    if (!writeback_enabled() && (flush_inode_table() < 0 || flush_bitmap() < 0)) {
+        status = -1;
+    }
+    if (unplug_block_queue() < 0) {
+        status = -1;
+    }
+    if (status == 0 && !writeback_enabled()) {
+        status = flush_due_discards();
+    }
+    return status;
+}
+
+/* End a batch; the outermost commit writes each dirty metadata block once */
+int tfs_commit_batch() {
+    tfs_lock();
+    bool open = batch_depth > 0;
+    int result = commit_batch();
+    if (open) {
+        tfs_unlock(); /* The hold taken by the matching begin */
+    }
+    tfs_unlock();
+    return result;
+}
+
+/* Check whether a batch is currently open */
+bool tfs_batch_active() {
+    return batch_depth > 0;
+}
+
+/* Whether metadata updates are left in memory: inside a batch, or under write-back */
+bool metadata_deferred() {
+    return batch_depth > 0 || writeback_enabled();
 }
 
 /* Initialize root directory */
@@ -247,13 +562,13 @@ int init_root_directory() {
 
     /* Allocate a data block for directory entries */
     root.data_block = allocate_block();
-    if (root.data_block == (uint32_t)-1) {
+    if (root.data_block == (uint64_t)-1) {
         free_inode(root_inode);
         return -1;
     }
 
     /* Initialize directory as empty */
-    uint8_t* block = calloc(BLOCK_SIZE, 1);
+    uint8_t* block = calloc(get_block_size(), 1);
     if (!block) {
         free_block(root.data_block);
         free_inode(root_inode);
@@ -273,33 +588,33 @@ int init_root_directory() {
     return save_superblock();
 }
 
-/* Get an available slot in the open file table */
-int get_open_file_index() {
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!open_file_table[i].in_use) {
-            return i;
-        }
-    }
-    return -1;
-}
-
-/* Release an open file entry */
-int release_open_file(int fd) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+/* Double the open file table and chain the new slots onto the free list */
+static int grow_open_file_table() {
+    uint32_t new_capacity = open_file_capacity ? open_file_capacity * 2 : MAX_OPEN_FILES;
+    OpenFileEntry* table = realloc(open_file_table, new_capacity * sizeof(OpenFileEntry));
+    if (!table) {
         return -1;
     }
 
-    if (!open_file_table[fd].in_use) {
-        return -1;
+    memset(&table[open_file_capacity], 0,
+           (new_capacity - open_file_capacity) * sizeof(OpenFileEntry));
+
+    /* Push in reverse so the lowest new descriptor is handed out first */
+    for (uint32_t i = new_capacity; i-- > open_file_capacity; ) {
+        table[i].fd = (int)i;
+        table[i].next_fd = free_fd_head;
+        table[i].prev_fd = -1;
+        free_fd_head = (int)i;
     }
 
-    open_file_table[fd].in_use = false;
+    open_file_table = table;
+    open_file_capacity = new_capacity;
     return 0;
 }
 
 /* Get open file entry by file descriptor */
 OpenFileEntry* get_open_file_entry(int fd) {
-    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+    if (fd < 0 || (uint32_t)fd >= open_file_capacity) {
         return NULL;
     }
 
@@ -310,11 +625,106 @@ OpenFileEntry* get_open_file_entry(int fd) {
     return &open_file_table[fd];
 }
 
-/* Initialize open file table */
-void init_open_file_table() {
-    memset(open_file_table, 0, sizeof(open_file_table));
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        open_file_table[i].fd = i;
+/* Take a slot from the open file table's free list */
+int get_open_file_index() {
+    if (free_fd_head < 0 && grow_open_file_table() < 0) {
+        return -1;
+    }
+
+    int fd = free_fd_head;
+    OpenFileEntry* entry = &open_file_table[fd];
+    free_fd_head = entry->next_fd;
+
+    entry->inode_num = (uint32_t)-1;
+    entry->position = 0;
+    entry->mode = 0;
+    entry->in_use = true;
+    entry->next_fd = -1;
+    entry->prev_fd = -1;
+    entry->snapshot = 0;
+    return fd;
+}
+
+/* Bind an open file entry to an inode of the selected inode view and link it into that
+ * inode's list; snapshot inodes never change, so their descriptors need no list */
+int attach_open_file(int fd, uint32_t inode_num) {
+    OpenFileEntry* entry = get_open_file_entry(fd);
+    if (!entry || inode_num >= MAX_INODES) {
+        return -1;
+    }
+
+    entry->inode_num = inode_num;
+    entry->snapshot = (uint8_t)inode_view_id;
+    if (inode_view_id != 0) {
+        hold_snapshot(inode_view_id);
+        return 0;
+    }
+    entry->prev_fd = -1;
+    entry->next_fd = inode_fd_head[inode_num];
+    if (entry->next_fd >= 0) {
+        open_file_table[entry->next_fd].prev_fd = fd;
+    }
+    inode_fd_head[inode_num] = fd;
+    return 0;
+}
+
+/* Release an open file entry */
+int release_open_file(int fd) {
+    OpenFileEntry* entry = get_open_file_entry(fd);
+    if (!entry) {
+        return -1;
+    }
+
+    /* Unlink from the per-inode list */
+    if (entry->snapshot != 0) {
+        release_snapshot(entry->snapshot);
+        entry->snapshot = 0;
+    } else if (entry->inode_num < MAX_INODES) {
+        if (entry->prev_fd >= 0) {
+            open_file_table[entry->prev_fd].next_fd = entry->next_fd;
+        } else {
+            inode_fd_head[entry->inode_num] = entry->next_fd;
+        }
+        if (entry->next_fd >= 0) {
+            open_file_table[entry->next_fd].prev_fd = entry->prev_fd;
+        }
+    }
+
+    entry->in_use = false;
+    entry->inode_num = (uint32_t)-1;
+    entry->prev_fd = -1;
+    entry->next_fd = free_fd_head;
+    free_fd_head = fd;
+    return 0;
+}
+
+/* First descriptor open on an inode (-1 if none); follow next_fd for the rest */
+int first_open_file(uint32_t inode_num) {
+    if (inode_num >= MAX_INODES) {
+        return -1;
     }
+    return inode_fd_head[inode_num];
 }
 
+/* Close every descriptor open on an inode */
+int release_inode_open_files(uint32_t inode_num) {
+    int fd;
+    while ((fd = first_open_file(inode_num)) >= 0) {
+        if (release_open_file(fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Initialize open file table */
+void init_open_file_table() {
+    free(open_file_table);
+    open_file_table = NULL;
+    open_file_capacity = 0;
+    free_fd_head = -1;
+    for (int i = 0; i < MAX_INODES; i++) {
+        inode_fd_head[i] = -1;
+    }
+    grow_open_file_table();
+}
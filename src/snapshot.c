@@ -0,0 +1,205 @@
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A snapshot: the inode table as it was when taken. The blocks it points at are shared
+ * with the live volume until a write there gives the live inode a copy of its own */
+typedef struct {
+    bool used;
+    bool dead;                   /* Deleted; its block references are being released */
+    char name[MAX_FILENAME_LEN];
+    Inode* inodes;
+    uint32_t handles;            /* Descriptors open inside the snapshot */
+    uint32_t reclaim_next;       /* Next inode reclamation releases the block of */
+} Snapshot;
+
+extern Superblock* get_superblock();
+
+/* Snapshot ids start at 1; inode view 0 is the live volume */
+static Snapshot snapshots[MAX_SNAPSHOTS + 1];
+static uint32_t reclaim_pending = 0;      /* Snapshots deleted but not yet reclaimed */
+
+/* Id of the live (not deleted) snapshot called name, or -1 */
+int find_snapshot(const char* name) {
+    if (!name) {
+        return -1;
+    }
+    for (int i = 1; i <= MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].used && !snapshots[i].dead && strcmp(snapshots[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Record on disk that snapshots hold blocks. Their references die with the mount, leaving
+ * those blocks marked used; the flag tells the next mount to sweep them */
+static int mark_snapshots_live() {
+    Superblock* sb = get_superblock();
+    if (!sb) {
+        return -1;
+    }
+    if (sb->snapshots_live) {
+        return 0;
+    }
+    sb->snapshots_live = 1;
+    return save_superblock();
+}
+
+/* Body of tfs_create_snapshot */
+static int create_snapshot(const char* name) {
+    if (!name || name[0] == '\0' || strlen(name) >= MAX_FILENAME_LEN || find_snapshot(name) >= 0) {
+        return -1;
+    }
+
+    int id = -1;
+    for (int i = 1; i <= MAX_SNAPSHOTS && id < 0; i++) {
+        if (!snapshots[i].used) {
+            id = i;
+        }
+    }
+    if (id < 0) {
+        return -1;
+    }
+
+    Inode* inodes = malloc(MAX_INODES * sizeof(Inode));
+    if (!inodes || copy_inode_table(inodes) < 0 || mark_snapshots_live() < 0) {
+        free(inodes);
+        return -1;
+    }
+
+    /* One more reference per block in use: work bounded by the inode table, not the data */
+    for (uint32_t i = 0; i < MAX_INODES; i++) {
+        if (inodes[i].used && inodes[i].data_block != 0 && share_block(inodes[i].data_block) < 0) {
+            while (i-- > 0) {
+                if (inodes[i].used && inodes[i].data_block != 0) {
+                    free_block(inodes[i].data_block);
+                }
+            }
+            free(inodes);
+            return -1;
+        }
+    }
+
+    Snapshot* snap = &snapshots[id];
+    memset(snap, 0, sizeof(*snap));
+    snap->used = true;
+    strcpy(snap->name, name);
+    snap->inodes = inodes;
+    return id;
+}
+
+/* Take a snapshot of the volume; returns its id */
+int tfs_create_snapshot(const char* name) {
+    tfs_lock();
+    int result = create_snapshot(name);
+    tfs_unlock();
+    return result;
+}
+
+/* Body of tfs_delete_snapshot */
+static int delete_snapshot(const char* name) {
+    int id = find_snapshot(name);
+    if (id < 0 || snapshots[id].handles > 0) {
+        return -1;
+    }
+
+    snapshots[id].dead = true;
+    reclaim_pending++;
+    if (get_inode_view() == id) {
+        select_inode_view(0);
+    }
+    wake_flusher();
+    return 0;
+}
+
+/* Delete a snapshot; its blocks are given back in the background */
+int tfs_delete_snapshot(const char* name) {
+    tfs_lock();
+    int result = delete_snapshot(name);
+    tfs_unlock();
+    return result;
+}
+
+/* Names of the snapshots, up to max_names; returns how many there are */
+int tfs_list_snapshots(char names[][MAX_FILENAME_LEN], int max_names) {
+    if (!names && max_names > 0) {
+        return -1;
+    }
+    tfs_lock();
+    int count = 0;
+    for (int i = 1; i <= MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].used && !snapshots[i].dead) {
+            if (count < max_names) {
+                memcpy(names[count], snapshots[i].name, MAX_FILENAME_LEN);
+            }
+            count++;
+        }
+    }
+    tfs_unlock();
+    return count;
+}
+
+/* Inode table of a live snapshot, or NULL */
+const Inode* get_snapshot_inodes(int snapshot) {
+    if (snapshot < 1 || snapshot > MAX_SNAPSHOTS || !snapshots[snapshot].used ||
+        snapshots[snapshot].dead) {
+        return NULL;
+    }
+    return snapshots[snapshot].inodes;
+}
+
+/* Count a descriptor opened inside a snapshot; a snapshot in use cannot be deleted */
+void hold_snapshot(int snapshot) {
+    if (get_snapshot_inodes(snapshot)) {
+        snapshots[snapshot].handles++;
+    }
+}
+
+void release_snapshot(int snapshot) {
+    if (get_snapshot_inodes(snapshot) && snapshots[snapshot].handles > 0) {
+        snapshots[snapshot].handles--;
+    }
+}
+
+/* Whether deleted snapshots still hold block references */
+bool snapshot_reclaim_pending() {
+    return reclaim_pending > 0;
+}
+
+/* Release up to budget block references of deleted snapshots; returns how many it did */
+uint32_t reclaim_snapshots(uint32_t budget) {
+    uint32_t released = 0;
+    for (int id = 1; id <= MAX_SNAPSHOTS && reclaim_pending > 0 && released < budget; id++) {
+        Snapshot* snap = &snapshots[id];
+        if (!snap->used || !snap->dead) {
+            continue;
+        }
+        while (snap->reclaim_next < MAX_INODES && released < budget) {
+            const Inode* inode = &snap->inodes[snap->reclaim_next++];
+            if (inode->used && inode->data_block != 0) {
+                free_block(inode->data_block);
+                released++;
+            }
+        }
+        if (snap->reclaim_next == MAX_INODES) {
+            free(snap->inodes);
+            memset(snap, 0, sizeof(*snap));
+            reclaim_pending--;
+        }
+    }
+    TFS_STAT_ADD(snapshot_reclaimed, released);
+    return released;
+}
+
+/* Forget every snapshot without touching the disk; the volume is being formatted or
+ * mounted, and the block references are rebuilt from it */
+void drop_snapshots() {
+    for (int id = 1; id <= MAX_SNAPSHOTS; id++) {
+        free(snapshots[id].inodes);
+        memset(&snapshots[id], 0, sizeof(snapshots[id]));
+    }
+    reclaim_pending = 0;
+    select_inode_view(0);
+}
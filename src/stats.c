@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* op_names[STAT_OP_COUNT] = {
+    "create", "open", "close", "read", "write", "delete", "lookup",
+    "mkdir", "rmdir", "readdir", "readdirplus", "list", "write_whole", "fsync",
+    "clone"
+};
+
+/* Get the display name of an API operation */
+const char* tfs_stat_op_name(int op) {
+    if (op < 0 || op >= STAT_OP_COUNT) {
+        return "unknown";
+    }
+    return op_names[op];
+}
+
+/* Upper bound in nanoseconds of the values that land in a histogram bucket */
+static uint64_t bucket_upper_bound(uint32_t bucket) {
+    uint32_t group = bucket / STAT_HIST_SUB_BUCKETS;
+    uint64_t sub = bucket % STAT_HIST_SUB_BUCKETS;
+    if (group == 0) {
+        return sub;
+    }
+    uint32_t shift = group - 1;
+    return ((STAT_HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/* Latency at a percentile (0.0 - 1.0) from an operation's histogram */
+uint64_t tfs_stat_percentile(const TfsOpStats* op, double p) {
+    if (!op || op->calls == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(p * (double)op->calls + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < STAT_HIST_BUCKETS; i++) {
+        seen += op->histogram[i];
+        if (seen >= target) {
+            uint64_t bound = bucket_upper_bound(i);
+            return bound < op->max_ns ? bound : op->max_ns;
+        }
+    }
+    return op->max_ns;
+}
+
+#ifdef TFS_ENABLE_STATS
+
+TfsCounters tfs_counters;
+static TfsOpStats op_stats[STAT_OP_COUNT];
+static uint32_t op_depth = 0;       /* Nesting of instrumented API calls */
+static TfsCounters op_base;         /* Counters when the outermost call started */
+
+/* Monotonic clock in nanoseconds */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Log-linear bucket: STAT_HIST_SUB_BUCKETS linear steps per power of two */
+static uint32_t bucket_for(uint64_t ns) {
+    if (ns < STAT_HIST_SUB_BUCKETS) {
+        return (uint32_t)ns;
+    }
+
+    uint32_t msb = 63 - (uint32_t)__builtin_clzll(ns);
+    uint32_t group = msb - STAT_HIST_SUB_BITS + 1;
+    uint32_t sub = (uint32_t)(ns >> (msb - STAT_HIST_SUB_BITS)) & (STAT_HIST_SUB_BUCKETS - 1);
+    uint32_t bucket = group * STAT_HIST_SUB_BUCKETS + sub;
+    return bucket < STAT_HIST_BUCKETS ? bucket : STAT_HIST_BUCKETS - 1;
+}
+
+/* Mark the start of an API call; only the outermost call is measured */
+uint64_t tfs_stat_op_begin() {
+    if (op_depth++ > 0) {
+        return 0;
+    }
+    op_base = tfs_counters;
+    return now_ns();
+}
+
+/* Mark the end of an API call and charge its latency and block I/O to op */
+void tfs_stat_op_end(int op, uint64_t start, bool failed) {
+    if (op_depth == 0 || --op_depth > 0) {
+        return;
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    TfsOpStats* s = &op_stats[op];
+    s->calls++;
+    s->errors += failed ? 1 : 0;
+    s->total_ns += elapsed;
+    if (elapsed > s->max_ns) {
+        s->max_ns = elapsed;
+    }
+    s->histogram[bucket_for(elapsed)]++;
+    s->block_reads += tfs_counters.block_reads - op_base.block_reads;
+    s->block_writes += tfs_counters.block_writes - op_base.block_writes;
+    s->bytes_copied += tfs_counters.bytes_copied - op_base.bytes_copied;
+}
+
+/* Copy out a snapshot of all statistics */
+int tfs_get_stats(TfsStats* stats) {
+    if (!stats) {
+        return -1;
+    }
+    memcpy(stats->ops, op_stats, sizeof(op_stats));
+    stats->totals = tfs_counters;
+    return 0;
+}
+
+/* Zero all statistics */
+void tfs_reset_stats() {
+    memset(op_stats, 0, sizeof(op_stats));
+    memset(&tfs_counters, 0, sizeof(tfs_counters));
+    op_base = tfs_counters;
+}
+
+#else
+
+/* Statistics compiled out: nothing to report */
+int tfs_get_stats(TfsStats* stats) {
+    (void)stats;
+    return -1;
+}
+
+void tfs_reset_stats() {
+}
+
+#endif /* TFS_ENABLE_STATS */
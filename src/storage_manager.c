@@ -1,52 +1,542 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS, MAP_HUGETLB, MADV_DONTNEED, MADV_HUGEPAGE */
+
 #include "../include/tinyfs.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-/* RAM-based disk simulation */
-static uint8_t* ram_disk = NULL;      /* Memory buffer simulating disk blocks */
-static uint32_t total_blocks = 0;     /* Total number of blocks in RAM */
+/* Current disk */
+static const BlockBackend* backend = NULL; /* Where blocks are stored; NULL without a disk */
+static int backend_kind = BACKEND_RAM;
+static uint64_t total_blocks = 0;     /* Total number of blocks on the disk */
+static uint32_t block_size = DEFAULT_BLOCK_SIZE; /* Bytes per block, fixed when the disk is created */
 static bool disk_initialized = false; /* Whether disk is initialized */
 
+/* Backend the next init_disk creates its disk on */
+static int selected_backend = BACKEND_RAM;
+static char selected_path[4096];
 
-/* Initialize a new disk in RAM */
-int init_disk(uint32_t num_blocks) {
-    /* Free existing disk if any */
+/* RAM backend: contiguous memory when attached to an image mapping */
+static uint8_t* ram_disk = NULL;      /* Contiguous disk memory (image mappings only) */
+static void* disk_mapping = NULL;     /* Image mapping backing ram_disk, if loaded from a file */
+static size_t disk_mapping_length = 0;
+
+/* Sparse RAM disk: fixed-size chunks mapped on first write */
+static uint8_t** chunks = NULL;       /* Chunk memory, NULL until a block in it is written */
+static uint32_t* chunk_live = NULL;   /* Blocks in each chunk written and not discarded since */
+static uint8_t* live_map = NULL;      /* One bit per block: written and not discarded since */
+static size_t block_map_bytes = 0;    /* Size of live_map and dirty_map */
+static uint64_t chunk_count = 0;
+static uint32_t blocks_per_chunk = 0;
+static uint64_t resident_chunks = 0;
+static uint8_t zero_chunk[DISK_CHUNK_SIZE]; /* Never written; backs reads of unmapped chunks */
+
+/* Dirty block tracking: blocks written since the last checkpoint */
+static uint8_t* dirty_map = NULL;     /* One bit per block */
+static uint64_t dirty_count = 0;      /* Number of bits set in dirty_map */
+static uint32_t checkpoint_epoch = 0; /* Checkpoint the dirty map is relative to */
+static uint64_t volume_id = 0;        /* Identifies a volume across its images and deltas */
+
+/* Huge page policy for disk memory and large metadata arrays */
+static int huge_page_mode = HUGE_PAGES_THP;
+
+/* Choose how disk memory asks for huge pages; applies to memory mapped from now on */
+int set_huge_page_mode(int mode) {
+    if (mode != HUGE_PAGES_OFF && mode != HUGE_PAGES_THP && mode != HUGE_PAGES_HUGETLB) {
+        return -1;
+    }
+    huge_page_mode = mode;
+    return 0;
+}
+
+/* Current huge page policy */
+int get_huge_page_mode() {
+    return huge_page_mode;
+}
+
+/* Map zeroed memory, 2 MB aligned with huge pages requested when it spans at least one.
+ * Small requests come from calloc; free with unmap_disk_memory and the same length */
+void* map_disk_memory(size_t length) {
+    if (length < HUGE_PAGE_SIZE) {
+        return calloc(length, 1);
+    }
+
+    /* Reserved huge pages, if configured and the administrator set some aside */
+    if (huge_page_mode == HUGE_PAGES_HUGETLB && length % HUGE_PAGE_SIZE == 0) {
+        void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            TFS_STAT_ADD(huge_page_regions, 1);
+            return memory;
+        }
+        TFS_STAT_ADD(huge_page_fallbacks, 1);
+    }
+
+    /* Over-map by one huge page and trim so the region starts on a 2 MB boundary */
+    size_t rounded = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    uint8_t* raw = mmap(NULL, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                                  ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, (size_t)(aligned - raw));
+    }
+    size_t tail = (size_t)(raw + rounded + HUGE_PAGE_SIZE - (aligned + rounded));
+    if (tail > 0) {
+        munmap(aligned + rounded, tail);
+    }
+
+    /* Transparent huge pages are a hint; the kernel may still use small pages */
+    if (huge_page_mode == HUGE_PAGES_OFF) {
+        return aligned;
+    }
+    if (madvise(aligned, rounded, MADV_HUGEPAGE) == 0) {
+        TFS_STAT_ADD(huge_page_advised, 1);
+    } else {
+        TFS_STAT_ADD(huge_page_fallbacks, 1);
+    }
+    return aligned;
+}
+
+/* Release memory from map_disk_memory */
+void unmap_disk_memory(void* memory, size_t length) {
+    if (memory == NULL) {
+        return;
+    }
+    if (length < HUGE_PAGE_SIZE) {
+        free(memory);
+        return;
+    }
+    munmap(memory, (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+}
+
+/* Huge-page-backed anonymous memory of this process, from the kernel's accounting */
+uint64_t get_huge_page_bytes() {
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return (uint64_t)kb * 1024;
+}
+
+/* Allocate clean live and dirty maps for num_blocks */
+static int reset_block_maps(uint64_t num_blocks) {
+    unmap_disk_memory(live_map, block_map_bytes);
+    unmap_disk_memory(dirty_map, block_map_bytes);
+    block_map_bytes = (size_t)((num_blocks + 7) / 8);
+    live_map = map_disk_memory(block_map_bytes);
+    dirty_map = map_disk_memory(block_map_bytes);
+    dirty_count = 0;
+    return (live_map && dirty_map) ? 0 : -1;
+}
+
+/* Memory holding a block; NULL if it lies in a chunk that is not mapped */
+static uint8_t* block_address(uint64_t block_num) {
+    if (ram_disk != NULL) {
+        return ram_disk + (size_t)block_num * block_size;
+    }
+    uint8_t* chunk = chunks[block_num / blocks_per_chunk];
+    return chunk ? chunk + (size_t)(block_num % blocks_per_chunk) * block_size : NULL;
+}
+
+/* Map the chunk holding block_num, zero-filled */
+static uint8_t* map_chunk(uint64_t block_num) {
+    uint64_t index = block_num / blocks_per_chunk;
+    uint8_t* chunk = map_disk_memory(DISK_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunks[index] = chunk;
+    resident_chunks++;
+    TFS_STAT_ADD(chunks_mapped, 1);
+    return block_address(block_num);
+}
+
+/* Whether a block holds data written since the disk was created or mapped */
+static bool is_block_live(uint64_t block_num) {
+    return (live_map[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+/* RAM backend: set up an empty chunk table; chunk memory comes with the first write */
+static int ram_open(const char* path, uint64_t num_blocks, uint32_t new_block_size, bool create) {
+    (void)path;
+    if (!create) {
+        return -1;
+    }
+    blocks_per_chunk = DISK_CHUNK_SIZE / new_block_size;
+    chunk_count = (num_blocks + blocks_per_chunk - 1) / blocks_per_chunk;
+    chunks = calloc((size_t)chunk_count, sizeof(uint8_t*));
+    chunk_live = calloc((size_t)chunk_count, sizeof(uint32_t));
+    return (chunks && chunk_live) ? 0 : -1;
+}
+
+/* RAM backend: release chunk memory or the image mapping */
+static void ram_close() {
+    if (disk_mapping != NULL) {
+        munmap(disk_mapping, disk_mapping_length);
+        disk_mapping = NULL;
+        disk_mapping_length = 0;
+    }
+    for (uint64_t i = 0; chunks != NULL && i < chunk_count; i++) {
+        unmap_disk_memory(chunks[i], DISK_CHUNK_SIZE);
+    }
+    free(chunks);
+    free(chunk_live);
+    chunks = NULL;
+    chunk_live = NULL;
+    chunk_count = 0;
+    resident_chunks = 0;
+    ram_disk = NULL;
+}
+
+/* RAM backend: copy a block out; blocks in unmapped chunks were never written */
+static int ram_read(uint64_t block_num, void* buffer) {
+    const uint8_t* address = block_address(block_num);
+    if (address != NULL) {
+        memcpy(buffer, address, block_size);
+    } else {
+        memset(buffer, 0, block_size);
+    }
+    return 0;
+}
+
+/* RAM backend: copy a block in, mapping its chunk on first write */
+static int ram_write(uint64_t block_num, const void* buffer) {
+    uint8_t* address = block_address(block_num);
+    if (address == NULL && (address = map_chunk(block_num)) == NULL) {
+        return -1;
+    }
+    memcpy(address, buffer, block_size);
+    if (!is_block_live(block_num)) {
+        live_map[block_num / 8] |= (uint8_t)(1u << (block_num % 8));
+        if (chunks != NULL) {
+            chunk_live[block_num / blocks_per_chunk]++;
+        }
+    }
+    return 0;
+}
+
+/* RAM backend: block memory, or shared zeros for a chunk that is not mapped */
+static const uint8_t* ram_pointer(uint64_t block_num) {
+    uint8_t* address = block_address(block_num);
+    if (address == NULL) {
+        return zero_chunk + (size_t)(block_num % blocks_per_chunk) * block_size;
+    }
+    return address;
+}
+
+/* RAM backend: blocks contiguous in memory from block_num on */
+static uint64_t ram_contiguous(uint64_t block_num) {
+    uint64_t run = (ram_disk != NULL) ? total_blocks - block_num
+                                      : blocks_per_chunk - block_num % blocks_per_chunk;
+    return (run < total_blocks - block_num) ? run : total_blocks - block_num;
+}
+
+/* RAM backend: bytes of memory holding blocks (image mappings count in full) */
+static uint64_t ram_resident_bytes() {
     if (ram_disk != NULL) {
-        free(ram_disk);
-        ram_disk = NULL;
+        return (uint64_t)total_blocks * block_size;
+    }
+    return resident_chunks * DISK_CHUNK_SIZE;
+}
+
+/* Drop the private pages behind count blocks from first: anonymous memory reads back as
+ * zeros, an image mapping falls back to the file's contents */
+static void release_pages(uint64_t first, uint64_t count) {
+    uint8_t* address = block_address(first);
+    size_t length = (size_t)count * block_size;
+    if (address == NULL || madvise(address, length, MADV_DONTNEED) < 0) {
+        return;
+    }
+    TFS_STAT_ADD(bytes_discarded, length);
+}
+
+/* RAM backend: unmap chunks left empty and return page-aligned memory holding only
+ * discarded blocks to the OS */
+static int ram_discard(uint64_t start, uint64_t count) {
+    for (uint64_t b = start; b < start + count; b++) {
+        if (!is_block_live(b)) {
+            continue;
+        }
+        live_map[b / 8] &= (uint8_t)~(1u << (b % 8));
+
+        uint64_t index = b / blocks_per_chunk;
+        if (chunks != NULL && --chunk_live[index] == 0) {
+            unmap_disk_memory(chunks[index], DISK_CHUNK_SIZE);
+            chunks[index] = NULL;
+            resident_chunks--;
+            TFS_STAT_ADD(chunks_released, 1);
+        }
+    }
+
+    /* Small blocks share a page; it can only go once none of them is live */
+    static size_t page_size = 0;
+    if (page_size == 0) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    }
+    uint64_t blocks_per_page = (page_size > block_size) ? page_size / block_size : 1;
+    uint64_t end = start + count;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    for (uint64_t p = start / blocks_per_page * blocks_per_page; p < end; p += blocks_per_page) {
+        bool eligible = p + blocks_per_page <= total_blocks && block_address(p) != NULL &&
+                        (uintptr_t)block_address(p) % page_size == 0;
+        for (uint64_t b = p; eligible && b < p + blocks_per_page; b++) {
+            eligible = !is_block_live(b);
+        }
+
+        /* Extend the current run while it stays in one piece of memory */
+        if (eligible && run_length > 0 && p == run_start + run_length &&
+            ram_contiguous(run_start) > run_length) {
+            run_length += blocks_per_page;
+            continue;
+        }
+        if (run_length > 0) {
+            release_pages(run_start, run_length);
+            run_length = 0;
+        }
+        if (eligible) {
+            run_start = p;
+            run_length = blocks_per_page;
+        }
     }
+    if (run_length > 0) {
+        release_pages(run_start, run_length);
+    }
+    return 0;
+}
+
+/* RAM backend: nothing outlives the process, so there is nothing to flush */
+static int ram_flush() {
+    return 0;
+}
+
+static const BlockBackend ram_backend = {
+    "ram", BACKEND_CAP_ZERO_COPY,
+    ram_open, ram_close, ram_read, ram_write, NULL, ram_pointer, ram_contiguous,
+    ram_discard, ram_flush, ram_resident_bytes, NULL
+};
+
+static const BlockBackend* const backends[BACKEND_COUNT] = {
+    &ram_backend, &mmap_file_backend, &pread_file_backend, &direct_file_backend
+};
+
+/* Release the current disk, however it is stored */
+static void release_disk() {
+    /* Held and queued writes belong on this disk; requests in flight still refer to its
+     * descriptor. The lock keeps the flusher off the disk while it is torn down */
+    tfs_lock();
+    if (disk_initialized) {
+        if (writeback_enabled()) {
+            flush_writeback();
+        }
+        flush_block_queue();
+    }
+    reset_block_queue();
+    stop_io_engine();
+    if (backend != NULL) {
+        backend->close();
+        backend = NULL;
+    }
+    unmap_disk_memory(live_map, block_map_bytes);
+    unmap_disk_memory(dirty_map, block_map_bytes);
+    live_map = NULL;
+    dirty_map = NULL;
+    block_map_bytes = 0;
+    total_blocks = 0;
+    disk_initialized = false;
+    dirty_count = 0;
+    tfs_unlock();
+}
+
+/* Whether a block size is supported: a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE */
+bool is_valid_block_size(uint32_t size) {
+    return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0;
+}
 
-    /* Allocate RAM for all blocks */
-    ram_disk = calloc(num_blocks, BLOCK_SIZE); //use calloc to automatically initialize the memory to 0
-    if (!ram_disk) {
+/* Choose where the next init_disk stores blocks; host file backends need a path */
+int set_disk_backend(int kind, const char* path) {
+    if (kind < 0 || kind >= BACKEND_COUNT) {
+        return -1;
+    }
+    if (kind != BACKEND_RAM && (!path || strlen(path) >= sizeof(selected_path))) {
         return -1;
     }
+    selected_backend = kind;
+    snprintf(selected_path, sizeof(selected_path), "%s", path ? path : "");
+    return 0;
+}
 
+/* Bring up a disk of num_blocks on a backend, creating it or opening what is there */
+static int start_disk(int kind, const char* path, uint64_t num_blocks, uint32_t new_block_size,
+                      bool create) {
+    if (!is_valid_block_size(new_block_size)) {
+        return -1;
+    }
+    /* The whole volume must be addressable in this process */
+    if (num_blocks == 0 || num_blocks > SIZE_MAX / new_block_size) {
+        return -1;
+    }
+    block_size = new_block_size;
     total_blocks = num_blocks;
+
+    if (reset_block_maps(num_blocks) < 0 ||
+        backends[kind]->open(path, num_blocks, new_block_size, create) < 0) {
+        backend = backends[kind]; /* close whatever open managed to set up */
+        release_disk();
+        return -1;
+    }
+    backend = backends[kind];
+    backend_kind = kind;
     disk_initialized = true;
 
-    /* All blocks are already zero-initialized by calloc */
+    /* A new or newly opened volume has no checkpoints yet */
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    volume_id = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)(uintptr_t)dirty_map;
+    checkpoint_epoch = 0;
     return 0;
 }
 
+/* Initialize a new disk on the selected backend; unwritten blocks read as zeros */
+int init_disk(uint64_t num_blocks, uint32_t new_block_size) {
+    /* Free existing disk if any */
+    release_disk();
+    return start_disk(selected_backend, selected_path, num_blocks, new_block_size, true);
+}
+
+/* Open the volume already in a host file; size and block size come from its superblock */
+int open_disk(int kind, const char* path) {
+    if (kind <= BACKEND_RAM || kind >= BACKEND_COUNT || !path) {
+        return -1;
+    }
 
-/* Free all RAM disk memory (call this when completely done) */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    Superblock sb;
+    struct stat st;
+    bool ok = pread(fd, &sb, sizeof(sb), 0) == (ssize_t)sizeof(sb) && fstat(fd, &st) == 0;
+    close(fd);
+    if (!ok || sb.magic != MAGIC_NUMBER || !is_valid_block_size(sb.block_size) ||
+        sb.total_blocks == 0 || sb.total_blocks > (uint64_t)st.st_size / sb.block_size) {
+        return -1;
+    }
+
+    release_disk();
+    return start_disk(kind, path, sb.total_blocks, sb.block_size, false);
+}
+
+
+/* Free all disk memory and close any backing file (call this when completely done) */
 int free_disk() {
-    if (ram_disk != NULL) {
-        free(ram_disk);
-        ram_disk = NULL;
-        total_blocks = 0;
-        disk_initialized = false;
+    release_disk();
+    return 0;
+}
+
+/* Use a private (copy-on-write) file mapping as the disk; blocks fault in on first touch */
+int attach_disk_mapping(void* mapping, size_t length, size_t offset, uint64_t num_blocks,
+                        uint32_t mapping_block_size) {
+    if (!mapping || !is_valid_block_size(mapping_block_size) || offset > length ||
+        num_blocks > (length - offset) / mapping_block_size) {
+        return -1;
+    }
+
+    release_disk();
+    block_size = mapping_block_size;
+    if (reset_block_maps(num_blocks) < 0) {
+        release_disk();
+        return -1;
     }
+    backend = &ram_backend;
+    backend_kind = BACKEND_RAM;
+    disk_mapping = mapping;
+    disk_mapping_length = length;
+    ram_disk = (uint8_t*)mapping + offset;
+    total_blocks = num_blocks;
+    disk_initialized = true;
     return 0;
 }
 
-/* Read a block from RAM disk */
-int read_block(uint32_t block_num, void* buffer) {
-    if (!disk_initialized || !buffer || ram_disk == NULL) {
+/* Backend the current disk is stored on (BACKEND_*) */
+int get_disk_backend() {
+    return backend_kind;
+}
+
+/* Name of the current disk's backend */
+const char* get_disk_backend_name() {
+    return backends[backend_kind]->name;
+}
+
+/* BACKEND_CAP_* flags of the current disk; 0 without one */
+uint32_t get_disk_capabilities() {
+    return disk_initialized ? backend->capabilities : 0;
+}
+
+/* Host file descriptor behind the current disk; -1 for memory backends */
+int get_disk_descriptor() {
+    return (disk_initialized && backend->descriptor) ? backend->descriptor() : -1;
+}
+
+/* Direct pointer to a block's bytes, for bulk copies that bypass read_block; NULL when the
+ * backend is not zero-copy */
+const uint8_t* get_block_pointer(uint64_t block_num) {
+    if (!disk_initialized || block_num >= total_blocks || backend->pointer == NULL) {
+        return NULL;
+    }
+    /* The pointer bypasses the scheduler queue, so the queue must be empty */
+    if (flush_block_queue() < 0) {
+        return NULL;
+    }
+    return backend->pointer(block_num);
+}
+
+/* Blocks from block_num on that are contiguous behind get_block_pointer(block_num) */
+uint64_t get_contiguous_blocks(uint64_t block_num) {
+    if (!disk_initialized || block_num >= total_blocks || backend->contiguous == NULL) {
+        return 0;
+    }
+    return backend->contiguous(block_num);
+}
+
+/* Bytes of process memory currently holding disk blocks */
+uint64_t get_resident_bytes() {
+    return disk_initialized ? backend->resident_bytes() : 0;
+}
+
+/* Number of blocks on the current disk */
+uint64_t get_total_blocks() {
+    return total_blocks;
+}
+
+/* Bytes per block on the current disk */
+uint32_t get_block_size() {
+    return block_size;
+}
+
+/* Read a block from the disk */
+int read_block(uint64_t block_num, void* buffer) {
+    if (!disk_initialized || !buffer) {
         return -1;
     }
 
@@ -54,14 +544,32 @@ int read_block(uint32_t block_num, void* buffer) {
         return -1;
     }
 
-    /* Copy block from RAM */
-    memcpy(buffer, ram_disk + (block_num * BLOCK_SIZE), BLOCK_SIZE);
+    /* A write still held in the scheduler queue is newer than the disk */
+    if (!read_queued_block(block_num, buffer) && backend->read(block_num, buffer) < 0) {
+        return -1;
+    }
+    TFS_STAT_ADD(block_reads, 1);
+    TFS_STAT_ADD(bytes_copied, block_size);
     return 0;
 }
 
-/* Write a block to RAM disk */
-int write_block(uint32_t block_num, const void* buffer) {
-    if (!disk_initialized || !buffer || ram_disk == NULL) {
+/* Read a block as the disk has it, ignoring a newer write still held in the scheduler queue */
+int read_disk_block(uint64_t block_num, void* buffer) {
+    if (!disk_initialized || !buffer || block_num >= total_blocks) {
+        return -1;
+    }
+
+    if (backend->read(block_num, buffer) < 0) {
+        return -1;
+    }
+    TFS_STAT_ADD(block_reads, 1);
+    TFS_STAT_ADD(bytes_copied, block_size);
+    return 0;
+}
+
+/* Write a block to the disk */
+int write_block(uint64_t block_num, const void* buffer) {
+    if (!disk_initialized || !buffer) {
         return -1;
     }
 
@@ -69,8 +577,153 @@ int write_block(uint32_t block_num, const void* buffer) {
         return -1;
     }
 
-    /* Copy block to RAM */
-    memcpy(ram_disk + (block_num * BLOCK_SIZE), buffer, BLOCK_SIZE);
+    if (block_queue_plugged() || writeback_caches_blocks()) {
+        if (queue_block_write(block_num, buffer) < 0) {
+            return -1;
+        }
+        note_writeback_dirty();
+        return 0;
+    }
+    if (backend->write(block_num, buffer) < 0) {
+        return -1;
+    }
+    account_block_io(block_num, 1, true);
     return 0;
 }
 
+/* Write count adjacent blocks from start in one backend operation where it supports one */
+int write_block_vector(uint64_t start, uint64_t count, const uint8_t* const* blocks) {
+    if (!disk_initialized || !blocks || start >= total_blocks || count > total_blocks - start) {
+        return -1;
+    }
+
+    if (backend->write_run != NULL) {
+        if (backend->write_run(start, count, blocks) < 0) {
+            return -1;
+        }
+    } else {
+        for (uint64_t i = 0; i < count; i++) {
+            if (backend->write(start + i, blocks[i]) < 0) {
+                return -1;
+            }
+        }
+    }
+    account_block_io(start, count, true);
+    return 0;
+}
+
+/* Count a transfer of count blocks that bypassed read_block/write_block; writes mark the
+ * blocks dirty for the next checkpoint */
+void account_block_io(uint64_t block_num, uint64_t count, bool write) {
+    if (!write) {
+        TFS_STAT_ADD(block_reads, count);
+        TFS_STAT_ADD(bytes_copied, count * block_size);
+        return;
+    }
+    TFS_STAT_ADD(block_writes, count);
+    TFS_STAT_ADD(bytes_copied, count * block_size);
+
+    for (uint64_t b = block_num; b < block_num + count && b < total_blocks; b++) {
+        uint8_t bit = (uint8_t)(1u << (b % 8));
+        if (!(dirty_map[b / 8] & bit)) {
+            dirty_map[b / 8] |= bit;
+            dirty_count++;
+        }
+    }
+}
+
+/* Make every write issued so far, including queued async ones, durable on the backing store */
+int flush_disk() {
+    if (!disk_initialized || flush_block_queue() < 0) {
+        return -1;
+    }
+    return sync_disk();
+}
+
+/* Make what has reached the backend durable, leaving writes still in the scheduler queue */
+int sync_disk() {
+    if (!disk_initialized || drain_block_io() < 0) {
+        return -1;
+    }
+    return backend->flush();
+}
+
+/* Whether a block was written since the last checkpoint */
+bool is_block_dirty(uint64_t block_num) {
+    if (!disk_initialized || block_num >= total_blocks) {
+        return false;
+    }
+    return (dirty_map[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+/* Number of blocks written since the last checkpoint */
+uint64_t count_dirty_blocks() {
+    return dirty_count;
+}
+
+/* Find the next run of dirty blocks at or after *cursor; returns 0 when there are no more */
+int next_dirty_extent(uint64_t* cursor, BlockExtent* extent) {
+    if (!disk_initialized || !cursor || !extent) {
+        return -1;
+    }
+
+    uint64_t i = *cursor;
+    while (i < total_blocks) {
+        /* Skip whole clean bytes of the map at once */
+        if (i % 8 == 0 && dirty_map[i / 8] == 0) {
+            i += 8;
+            continue;
+        }
+        if (is_block_dirty(i)) {
+            break;
+        }
+        i++;
+    }
+    if (i >= total_blocks) {
+        *cursor = total_blocks;
+        return 0;
+    }
+
+    uint64_t end = i;
+    while (end < total_blocks && is_block_dirty(end)) {
+        end++;
+    }
+    extent->start = i;
+    extent->count = end - i;
+    *cursor = end;
+    return 1;
+}
+
+/* Checkpoint the dirty map is relative to (0: none taken yet) */
+uint32_t get_checkpoint_epoch() {
+    return checkpoint_epoch;
+}
+
+/* Identity of the current volume, recorded in its images and deltas */
+uint64_t get_volume_id() {
+    return volume_id;
+}
+
+/* Declare the disk identical to checkpoint epoch of volume id; clears the dirty map */
+void set_checkpoint_state(uint64_t id, uint32_t epoch) {
+    volume_id = id;
+    checkpoint_epoch = epoch;
+    if (dirty_map != NULL) {
+        memset(dirty_map, 0, block_map_bytes);
+    }
+    dirty_count = 0;
+}
+
+/* Tell the disk a run of blocks no longer holds data so the backend can give the space
+ * back: memory to the OS, or a hole in the backing file */
+int discard_blocks(uint64_t start, uint64_t count) {
+    if (!disk_initialized || start >= total_blocks || count > total_blocks - start) {
+        return -1;
+    }
+    /* Queued writes to these blocks must not land after the discard */
+    if (flush_block_queue() < 0 || backend->discard(start, count) < 0) {
+        return -1;
+    }
+    TFS_STAT_ADD(discards, 1);
+    return 0;
+}
@@ -0,0 +1,1669 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_BLOCKS 512              /* Volume size for every test */
+
+extern Superblock* get_superblock();
+
+static int checks_failed = 0;
+static char temp_dir[] = "/tmp/tinyfs-test-XXXXXX";
+
+/* Record a failed check and carry on, so one run reports every broken expectation */
+#define CHECK(cond)                                                                       \
+    do {                                                                                  \
+        if (!(cond)) {                                                                    \
+            fprintf(stderr, "  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+            checks_failed++;                                                              \
+        }                                                                                 \
+    } while (0)
+
+/* A named test; each one starts from a fresh RAM volume */
+typedef struct {
+    const char* name;
+    void (*run)();
+} TestCase;
+
+/* Host file for a test inside the run's temporary directory */
+static const char* temp_path(char* path, size_t size, const char* name) {
+    snprintf(path, size, "%s/%s", temp_dir, name);
+    return path;
+}
+
+/* Whole contents of a file, NUL terminated; returns its length or -1 */
+static int read_text(const char* path, char* text, uint32_t size) {
+    int fd = openFile(path, MODE_READ);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = readFile(fd, text, size - 1);
+    closeFile(fd);
+    text[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/* Copy a host file, as a crash would leave it */
+static int copy_host_file(const char* from, const char* to) {
+    FILE* in = fopen(from, "rb");
+    FILE* out = in ? fopen(to, "wb") : NULL;
+    char buffer[4096];
+    size_t n;
+    int status = out ? 0 : -1;
+    while (status == 0 && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        status = (fwrite(buffer, 1, n, out) == n) ? 0 : -1;
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out && fclose(out) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+/* Mount a host file volume in place of the current one */
+static int mount_host_file(const char* path) {
+    free_disk();
+    if (set_disk_backend(BACKEND_PREAD, path) < 0 || open_disk(BACKEND_PREAD, path) < 0) {
+        return -1;
+    }
+    return mount_filesystem();
+}
+
+/* Blocks marked used on the volume */
+static uint64_t count_used_blocks() {
+    uint64_t used = 0;
+    for (uint64_t b = 0; b < get_total_blocks(); b++) {
+        used += is_block_allocated(b) ? 1 : 0;
+    }
+    return used;
+}
+
+/* Data block of the file at path, or 0 */
+static uint64_t data_block_of(const char* path) {
+    Inode inode;
+    uint32_t inode_num = find_inode_by_path(path);
+    if (inode_num == (uint32_t)-1 || load_inode(inode_num, &inode) < 0) {
+        return 0;
+    }
+    return inode.data_block;
+}
+
+static int write_text(const char* path, const char* text) {
+    return writeWholeFile(path, text, (uint32_t)strlen(text), WRITE_CREATE | WRITE_TRUNCATE);
+}
+
+/* Write text at the start of the file at path through a descriptor, creating it if needed */
+static int write_text_fd(const char* path, const char* text) {
+    if (searchFile(path) < 0 && createFile(path, TYPE_FILE) < 0) {
+        return -1;
+    }
+    int fd = openFile(path, MODE_WRITE);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = writeFile(fd, text, (uint32_t)strlen(text));
+    closeFile(fd);
+    return n;
+}
+
+/* Whether the inode table on the disk, not the cached copy, has inode_num in use */
+static bool inode_on_disk(uint32_t inode_num) {
+    Superblock* sb = get_superblock();
+    uint8_t block[MAX_BLOCK_SIZE];
+    uint32_t per_block = get_block_size() / sizeof(Inode);
+    if (!sb || read_block(sb->inode_table_block + inode_num / per_block, block) < 0) {
+        return false;
+    }
+    Inode inode;
+    memcpy(&inode, block + (inode_num % per_block) * sizeof(Inode), sizeof(Inode));
+    return inode.used && inode.inode_num == inode_num;
+}
+
+/* Nested batches hold every metadata write until the outermost commit, which writes
+ * each dirty metadata block once */
+static void test_batch_nesting() {
+#ifdef TFS_ENABLE_STATS
+    TfsStats stats;
+    tfs_reset_stats();
+    CHECK(write_text("/a", "a") == 1);
+    CHECK(write_text("/b", "b") == 1);
+    CHECK(write_text("/c", "c") == 1);
+    CHECK(tfs_get_stats(&stats) == 0);
+    uint64_t unbatched = stats.totals.block_writes;
+    tfs_reset_stats();
+#endif
+
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_text_fd("/d", "d") == 1);
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_text_fd("/e", "e") == 1);
+    CHECK(write_text("/f", "f") == 1);
+    CHECK(tfs_commit_batch() == 0);
+    CHECK(tfs_batch_active() && block_queue_plugged());
+    CHECK(count_dirty_inode_blocks() > 0 && get_queued_blocks() > 0);
+#ifdef TFS_ENABLE_STATS
+    CHECK(tfs_get_stats(&stats) == 0 && stats.totals.block_writes == 0);
+#endif
+    uint32_t inode = find_inode_by_path("/e");
+    CHECK(inode != (uint32_t)-1 && !inode_on_disk(inode));
+
+    CHECK(tfs_commit_batch() == 0);
+    CHECK(!tfs_batch_active() && !block_queue_plugged());
+    CHECK(count_dirty_inode_blocks() == 0 && get_queued_blocks() == 0);
+    CHECK(inode_on_disk(inode) && inode_on_disk(find_inode_by_path("/d")));
+    CHECK(tfs_commit_batch() < 0);
+#ifdef TFS_ENABLE_STATS
+    CHECK(tfs_get_stats(&stats) == 0);
+    CHECK(stats.totals.block_writes > 0 && stats.totals.block_writes < unbatched);
+#endif
+
+    /* The changes are on the disk, not only in the cache */
+    char text[8];
+    CHECK(mount_filesystem() == 0);
+    CHECK(read_text("/e", text, sizeof(text)) == 1 && strcmp(text, "e") == 0);
+}
+
+/* A batch left open is abandoned by a format or a mount, plug and all */
+static void test_batch_abandoned() {
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_text_fd("/a", "a") == 1);
+    CHECK(mount_filesystem() == 0);
+    CHECK(!tfs_batch_active() && !block_queue_plugged());
+    CHECK(tfs_commit_batch() < 0);
+    CHECK(write_text_fd("/b", "b") == 1);
+    CHECK(get_queued_blocks() == 0 && count_dirty_inode_blocks() == 0);
+    CHECK(inode_on_disk(find_inode_by_path("/b")));
+
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_text("/c", "c") == 1);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(!tfs_batch_active() && !block_queue_plugged());
+    CHECK(tfs_commit_batch() < 0);
+    CHECK(write_text("/d", "d") == 1);
+    CHECK(get_queued_blocks() == 0 && count_dirty_inode_blocks() == 0);
+    CHECK(inode_on_disk(find_inode_by_path("/d")));
+}
+
+/* Closed descriptors are handed out again, most recently closed first */
+static void test_fd_reuse() {
+    CHECK(write_text("/a", "a") == 1);
+    int fds[3];
+    for (int i = 0; i < 3; i++) {
+        fds[i] = openFile("/a", MODE_READ);
+        CHECK(fds[i] >= 0);
+    }
+    CHECK(fds[0] != fds[1] && fds[1] != fds[2] && fds[0] != fds[2]);
+
+    CHECK(closeFile(fds[1]) == 0);
+    CHECK(closeFile(fds[1]) < 0);
+    int again = openFile("/a", MODE_READ);
+    CHECK(again == fds[1]);
+
+    closeFile(fds[0]);
+    closeFile(fds[2]);
+    closeFile(again);
+}
+
+/* The table grows past its initial size, and every descriptor stays usable */
+static void test_fd_table_growth() {
+    CHECK(write_text("/a", "grow") == 4);
+    int count = MAX_OPEN_FILES * 2 + 1;
+    int* fds = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        fds[i] = openFile("/a", MODE_READ);
+        CHECK(fds[i] >= 0);
+    }
+    char text[8];
+    CHECK(readFile(fds[count - 1], text, 4) == 4 && memcmp(text, "grow", 4) == 0);
+    for (int i = 0; i < count; i++) {
+        CHECK(closeFile(fds[i]) == 0);
+    }
+    free(fds);
+}
+
+/* Deleting a file closes its descriptors, and formatting or mounting leaves none open
+ * anywhere */
+static void test_fd_table_reset() {
+    CHECK(write_text("/a", "a") == 1);
+    uint32_t inode = find_inode_by_path("/a");
+    CHECK(inode != (uint32_t)-1);
+    CHECK(first_open_file(inode) < 0);
+
+    int fd = openFile("/a", MODE_READ);
+    CHECK(fd >= 0 && first_open_file(inode) == fd);
+    CHECK(deleteFile("/a") == 0);
+    CHECK(first_open_file(inode) < 0);
+    CHECK(closeFile(fd) < 0);
+
+    CHECK(write_text("/b", "b") == 1);
+    inode = find_inode_by_path("/b");
+    fd = openFile("/b", MODE_READ);
+    CHECK(fd >= 0 && first_open_file(inode) == fd);
+    CHECK(mount_filesystem() == 0);
+    CHECK(first_open_file(inode) < 0);
+    CHECK(closeFile(fd) < 0);
+
+    fd = openFile("/b", MODE_READ);
+    CHECK(fd >= 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    for (uint32_t i = 0; i < MAX_INODES; i++) {
+        CHECK(first_open_file(i) < 0);
+    }
+    CHECK(closeFile(fd) < 0);
+}
+
+/* writeWholeFile creates only when asked, keeps or drops the old tail as asked, and
+ * stores at most one block */
+static void test_write_whole_file() {
+    char text[64];
+    CHECK(writeWholeFile("/a", "abc", 3, 0) < 0);
+    CHECK(searchFile("/a") < 0);
+    CHECK(writeWholeFile("/a", "abcdef", 6, WRITE_CREATE) == 6);
+
+    /* Without truncation the old bytes past the new data stay */
+    CHECK(writeWholeFile("/a", "XY", 2, 0) == 2);
+    CHECK(read_text("/a", text, sizeof(text)) == 6 && strcmp(text, "XYcdef") == 0);
+    CHECK(writeWholeFile("/a", "XY", 2, WRITE_TRUNCATE) == 2);
+    CHECK(read_text("/a", text, sizeof(text)) == 2 && strcmp(text, "XY") == 0);
+
+    /* Empty contents, with or without a buffer */
+    CHECK(writeWholeFile("/a", NULL, 0, WRITE_TRUNCATE) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 0);
+    CHECK(writeWholeFile("/c", NULL, 0, WRITE_CREATE) == 0 && searchFile("/c") == 0);
+    CHECK(writeWholeFile("/d", NULL, 1, WRITE_CREATE) < 0 && searchFile("/d") < 0);
+
+    /* Input past one block is cut to the block */
+    uint32_t block_size = get_block_size();
+    char* big = malloc(block_size * 2);
+    memset(big, 'z', block_size * 2);
+    CHECK(writeWholeFile("/big", big, block_size * 2, WRITE_CREATE) == (int)block_size);
+    Inode inode;
+    CHECK(load_inode(find_inode_by_path("/big"), &inode) == 0 && inode.size == block_size);
+    free(big);
+
+    /* A directory is not a file to write */
+    CHECK(makeDirectory("/dir") == 0);
+    CHECK(writeWholeFile("/dir", "x", 1, WRITE_CREATE) < 0);
+}
+
+/* Paths resolve against a directory handle, or the root for TFS_ROOT_FD and absolute
+ * paths; a file or closed handle is no directory to resolve against */
+static void test_dirfd_resolution() {
+    char text[64];
+    CHECK(makeDirectory("/d") == 0);
+    CHECK(makeDirectory("/d/e") == 0);
+    int dir = openDirectory("/d");
+    CHECK(dir >= 0);
+
+    CHECK(createFileAt(dir, "f", TYPE_FILE) == 0);
+    CHECK(lookupAt(dir, "f") == (int)find_inode_by_path("/d/f"));
+    CHECK(createFileAt(dir, "e/g", TYPE_FILE) == 0);
+    int fd = openFileAt(dir, "e/g", MODE_WRITE);
+    CHECK(fd >= 0 && writeFile(fd, "deep", 4) == 4);
+    closeFile(fd);
+    CHECK(read_text("/d/e/g", text, sizeof(text)) == 4 && strcmp(text, "deep") == 0);
+    CHECK(writeWholeFileAt(dir, "e/w", "whole", 5, WRITE_CREATE) == 5);
+    CHECK(read_text("/d/e/w", text, sizeof(text)) == 5 && strcmp(text, "whole") == 0);
+    CHECK(makeDirectoryAt(dir, "e/h") == 0 && searchFile("/d/e/h") == 0);
+    int sub = openDirectoryAt(dir, "e");
+    CHECK(sub >= 0 && searchFileAt(sub, "g") == 0 && searchFileAt(sub, "f") < 0);
+    CHECK(cloneFileAt(sub, "g", TFS_ROOT_FD, "copy") == 0);
+    CHECK(read_text("/copy", text, sizeof(text)) == 4 && strcmp(text, "deep") == 0);
+
+    /* The root, by handle or by an absolute path whatever the handle */
+    CHECK(createFileAt(TFS_ROOT_FD, "top", TYPE_FILE) == 0);
+    CHECK(searchFile("/top") == 0);
+    CHECK(writeWholeFileAt(TFS_ROOT_FD, "top", "t", 1, 0) == 1);
+    CHECK(writeWholeFileAt(dir, "/top", "top", 3, 0) == 3);
+    CHECK(read_text("/top", text, sizeof(text)) == 3 && strcmp(text, "top") == 0);
+    CHECK(lookupAt(TFS_ROOT_FD, "d/f") == lookupAt(dir, "f"));
+    CHECK(lookupAt(dir, "/top") == (int)find_inode_by_path("/top"));
+    CHECK(lookupAt(dir, "top") < 0);
+
+    /* A file handle cannot stand in for a directory */
+    int file = openFile("/d/f", MODE_READ);
+    CHECK(file >= 0);
+    CHECK(lookupAt(file, "x") < 0);
+    CHECK(createFileAt(file, "x", TYPE_FILE) < 0);
+    CHECK(openFileAt(file, "x", MODE_READ) < 0);
+    CHECK(closeFile(file) == 0);
+
+    CHECK(removeDirectoryAt(dir, "e/h") == 0 && searchFile("/d/e/h") < 0);
+    CHECK(deleteFileAt(sub, "g") == 0 && searchFile("/d/e/g") < 0);
+
+    /* Nor can a closed one, or one never opened */
+    CHECK(closeFile(sub) == 0);
+    CHECK(closeFile(dir) == 0);
+    CHECK(deleteFileAt(dir, "f") < 0 && searchFile("/d/f") == 0);
+    CHECK(makeDirectoryAt(sub, "x") < 0);
+    CHECK(lookupAt(-1, "f") < 0 && lookupAt(MAX_OPEN_FILES * 4, "f") < 0);
+
+    /* openInode needs no path at all */
+    fd = openInode(find_inode_by_path("/d/f"), MODE_READ);
+    CHECK(fd >= 0 && closeFile(fd) == 0);
+    CHECK(openInode(MAX_INODES, MODE_READ) < 0);
+}
+
+/* A saved cookie resumes a listing on any handle to the directory, past entries removed
+ * since, without repeating or skipping the ones still there */
+static void test_directory_cookie() {
+    char path[32];
+    CHECK(makeDirectory("/d") == 0);
+    for (int i = 0; i < 5; i++) {
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        CHECK(write_text(path, "x") == 1);
+    }
+    int dir = openDirectory("/d");
+    DirectoryEntry entries[8];
+    CHECK(readDirectory(dir, entries, 2) == 2);
+    CHECK(strcmp(entries[0].name, "f0") == 0 && strcmp(entries[1].name, "f1") == 0);
+    uint32_t cookie = 0;
+    CHECK(tellDirectory(dir, &cookie) == 0 && cookie > 0);
+
+    /* One entry already listed and one still to come go away */
+    CHECK(deleteFile("/d/f1") == 0);
+    CHECK(deleteFile("/d/f3") == 0);
+    int again = openDirectory("/d");
+    CHECK(seekDirectory(again, cookie) == 0);
+    CHECK(readDirectory(again, entries, 8) == 2);
+    CHECK(strcmp(entries[0].name, "f2") == 0 && strcmp(entries[1].name, "f4") == 0);
+    CHECK(readDirectory(again, entries, 8) == 0);
+    CHECK(seekDirectory(again, 0) == 0 && readDirectory(again, entries, 8) == 3);
+
+    /* Only open directory handles have a cookie */
+    int file = openFile("/d/f0", MODE_READ);
+    CHECK(tellDirectory(file, &cookie) < 0 && seekDirectory(file, 0) < 0);
+    CHECK(tellDirectory(dir, NULL) < 0);
+    closeFile(file);
+    closeFile(again);
+    CHECK(closeFile(dir) == 0);
+    CHECK(tellDirectory(dir, &cookie) < 0 && seekDirectory(dir, 0) < 0);
+}
+
+/* readDirectoryPlus returns each entry with its inode's type, size and block count, in
+ * batches that carry on where the last one stopped */
+static void test_read_directory_plus() {
+    CHECK(makeDirectory("/d") == 0);
+    CHECK(write_text("/d/file", "hello") == 5);
+    CHECK(createFile("/d/empty", TYPE_FILE) == 0);
+    CHECK(makeDirectory("/d/sub") == 0);
+
+    int dir = openDirectory("/d");
+    DirectoryEntryPlus entries[4];
+    CHECK(readDirectoryPlus(dir, entries, 2) == 2);
+    CHECK(readDirectoryPlus(dir, entries + 2, 2) == 1);
+    CHECK(readDirectoryPlus(dir, entries, 2) == 0);
+
+    CHECK(strcmp(entries[0].name, "file") == 0);
+    CHECK(entries[0].inode_num == find_inode_by_path("/d/file"));
+    CHECK(entries[0].type == TYPE_FILE && entries[0].size == 5 && entries[0].block_count == 1);
+    CHECK(strcmp(entries[1].name, "empty") == 0);
+    CHECK(entries[1].type == TYPE_FILE && entries[1].size == 0 && entries[1].block_count == 0);
+    CHECK(strcmp(entries[2].name, "sub") == 0);
+    CHECK(entries[2].type == TYPE_DIRECTORY && entries[2].block_count == 1);
+
+    int file = openFile("/d/file", MODE_READ);
+    CHECK(readDirectoryPlus(file, entries, 4) < 0);
+    CHECK(readDirectoryPlus(dir, NULL, 4) < 0);
+    closeFile(file);
+    closeFile(dir);
+}
+
+/* API calls are charged to their own operation once, nested calls included, with their
+ * errors and block I/O */
+static void test_stats_counters() {
+    TfsStats stats;
+#ifdef TFS_ENABLE_STATS
+    tfs_reset_stats();
+    CHECK(write_text("/a", "a") == 1);
+    CHECK(openFile("/missing", MODE_READ) < 0);
+    int dir = openDirectory("/");
+    DirectoryEntryPlus entries[4];
+    CHECK(readDirectoryPlus(dir, entries, 4) == 1);
+    closeFile(dir);
+
+    CHECK(tfs_get_stats(&stats) == 0);
+    const TfsOpStats* write = &stats.ops[STAT_OP_WRITE_WHOLE];
+    CHECK(write->calls == 1 && write->errors == 0 && write->block_writes > 0);
+    CHECK(stats.ops[STAT_OP_OPEN].calls == 2 && stats.ops[STAT_OP_OPEN].errors == 1);
+    CHECK(stats.ops[STAT_OP_READDIRPLUS].calls == 1 && stats.ops[STAT_OP_READDIR].calls == 0);
+    CHECK(stats.totals.block_writes >= write->block_writes && stats.totals.inode_allocs == 1);
+    uint64_t sampled = 0;
+    for (uint32_t i = 0; i < STAT_HIST_BUCKETS; i++) {
+        sampled += write->histogram[i];
+    }
+    CHECK(sampled == 1 && write->max_ns <= write->total_ns);
+
+    /* A mkdir, rmdir or delete is its own operation, not also a create or lookup */
+    tfs_reset_stats();
+    CHECK(makeDirectory("/d") == 0);
+    CHECK(tfs_get_stats(&stats) == 0 && stats.ops[STAT_OP_MKDIR].calls == 1);
+    CHECK(stats.ops[STAT_OP_CREATE].calls == 0 && stats.ops[STAT_OP_LOOKUP].calls == 0);
+    CHECK(removeDirectory("/d") == 0 && deleteFile("/a") == 0);
+    CHECK(tfs_get_stats(&stats) == 0 && stats.ops[STAT_OP_RMDIR].calls == 1);
+    CHECK(stats.ops[STAT_OP_DELETE].calls == 1 && stats.ops[STAT_OP_LOOKUP].calls == 0);
+
+    tfs_reset_stats();
+    CHECK(tfs_get_stats(&stats) == 0);
+    CHECK(stats.ops[STAT_OP_OPEN].calls == 0 && stats.totals.block_writes == 0);
+#else
+    CHECK(tfs_get_stats(&stats) < 0);
+#endif
+    CHECK(strcmp(tfs_stat_op_name(STAT_OP_CLONE), "clone") == 0);
+    CHECK(strcmp(tfs_stat_op_name(STAT_OP_COUNT), "unknown") == 0);
+}
+
+/* Percentiles report the upper bound of the bucket they fall in, never above the slowest
+ * call: exact below STAT_HIST_SUB_BUCKETS ns, then STAT_HIST_SUB_BUCKETS steps per power
+ * of two */
+static void test_stats_percentile() {
+    TfsOpStats op;
+    memset(&op, 0, sizeof(op));
+    CHECK(tfs_stat_percentile(&op, 0.5) == 0);
+    CHECK(tfs_stat_percentile(NULL, 0.5) == 0);
+
+    uint64_t last = 0;
+    op.calls = 1;
+    op.max_ns = UINT64_MAX;
+    for (uint32_t i = 0; i < STAT_HIST_BUCKETS; i++) {
+        op.histogram[i] = 1;
+        uint64_t bound = tfs_stat_percentile(&op, 1.0);
+        op.histogram[i] = 0;
+        CHECK(i == 0 || bound > last);
+        CHECK(i >= STAT_HIST_SUB_BUCKETS || bound == i);
+        last = bound;
+    }
+
+    /* 2^k starts a group whose first bucket also holds 2^k + 2^(k-3) - 1 */
+    op.histogram[2 * STAT_HIST_SUB_BUCKETS] = 1;
+    CHECK(tfs_stat_percentile(&op, 1.0) == 16 + 2 - 1);
+    op.histogram[2 * STAT_HIST_SUB_BUCKETS] = 0;
+    op.histogram[10 * STAT_HIST_SUB_BUCKETS + 3] = 1;
+    CHECK(tfs_stat_percentile(&op, 1.0) == (1u << 12) + 4 * (1u << 9) - 1);
+    op.histogram[10 * STAT_HIST_SUB_BUCKETS + 3] = 0;
+
+    /* 50 calls of 3 ns, 40 of 8 ns, 10 between 16 and 17 ns, the slowest 16 ns */
+    op.calls = 100;
+    op.max_ns = 16;
+    op.histogram[3] = 50;
+    op.histogram[STAT_HIST_SUB_BUCKETS] = 40;
+    op.histogram[2 * STAT_HIST_SUB_BUCKETS] = 10;
+    CHECK(tfs_stat_percentile(&op, 0.0) == 3);
+    CHECK(tfs_stat_percentile(&op, 0.5) == 3);
+    CHECK(tfs_stat_percentile(&op, 0.51) == 8);
+    CHECK(tfs_stat_percentile(&op, 0.9) == 8);
+    CHECK(tfs_stat_percentile(&op, 0.99) == 16);
+    CHECK(tfs_stat_percentile(&op, 1.0) == 16);
+}
+
+/* Write a host file */
+static int write_host_file(const char* path, const void* data, size_t size) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        return -1;
+    }
+    size_t n = fwrite(data, 1, size, out);
+    return (fclose(out) == 0 && n == size) ? 0 : -1;
+}
+
+/* Whole contents of a host file, NUL terminated; returns its length or -1 */
+static long read_host_file(const char* path, char* text, size_t size) {
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        return -1;
+    }
+    size_t n = fread(text, 1, size - 1, in);
+    fclose(in);
+    text[n] = '\0';
+    return (long)n;
+}
+
+/* A host tree imports and exports back unchanged, less what TinyFS cannot hold: files
+ * over a block, names too long, and anything but files and directories */
+static void test_transfer_round_trip() {
+    char in[256];
+    char out[256];
+    char path[512];
+    char text[64];
+    temp_path(in, sizeof(in), "import");
+    temp_path(out, sizeof(out), "export");
+    CHECK(mkdir(in, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/sub", in);
+    CHECK(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/sub/deep", in);
+    CHECK(mkdir(path, 0755) == 0);
+    snprintf(path, sizeof(path), "%s/a.txt", in);
+    CHECK(write_host_file(path, "alpha", 5) == 0);
+    snprintf(path, sizeof(path), "%s/sub/b.txt", in);
+    CHECK(write_host_file(path, "beta", 4) == 0);
+
+    /* The longest name that fits, which the skipped long name below must not overwrite */
+    char fits[MAX_FILENAME_LEN + 8];
+    snprintf(fits, sizeof(fits), "/in/%0*d", MAX_FILENAME_LEN - 1, 0);
+    snprintf(path, sizeof(path), "%s/%0*d", in, MAX_FILENAME_LEN - 1, 0);
+    CHECK(write_host_file(path, "fits", 4) == 0);
+
+    /* Skipped: one byte over a block, a name over MAX_FILENAME_LEN, a symlink */
+    uint32_t big_size = get_block_size() + 1;
+    char* big = calloc(big_size, 1);
+    snprintf(path, sizeof(path), "%s/big.bin", in);
+    CHECK(write_host_file(path, big, big_size) == 0);
+    free(big);
+    snprintf(path, sizeof(path), "%s/%0*d", in, MAX_FILENAME_LEN, 0);
+    CHECK(write_host_file(path, "long", 4) == 0);
+    snprintf(path, sizeof(path), "%s/link", in);
+    CHECK(symlink("a.txt", path) == 0);
+
+    TransferResult result;
+    CHECK(tfs_import_tree(in, "/in", &result) == 0);
+    CHECK(result.files == 3 && result.directories == 2 && result.bytes == 13);
+    CHECK(result.skipped == 3 && result.failed == 0);
+    CHECK(read_text("/in/a.txt", text, sizeof(text)) == 5 && strcmp(text, "alpha") == 0);
+    CHECK(read_text("/in/sub/b.txt", text, sizeof(text)) == 4 && strcmp(text, "beta") == 0);
+    CHECK(searchFile("/in/sub/deep") == 0 && searchFile("/in/big.bin") < 0);
+    CHECK(searchFile("/in/link") < 0);
+    CHECK(read_text(fits, text, sizeof(text)) == 4 && strcmp(text, "fits") == 0);
+
+    CHECK(tfs_export_tree("/in", out, &result) == 0);
+    CHECK(result.files == 3 && result.directories == 2 && result.bytes == 13);
+    CHECK(result.skipped == 0 && result.failed == 0);
+    snprintf(path, sizeof(path), "%s/a.txt", out);
+    CHECK(read_host_file(path, text, sizeof(text)) == 5 && strcmp(text, "alpha") == 0);
+    snprintf(path, sizeof(path), "%s/sub/b.txt", out);
+    CHECK(read_host_file(path, text, sizeof(text)) == 4 && strcmp(text, "beta") == 0);
+
+    CHECK(tfs_import_tree("/nonexistent/tree", "/in", &result) < 0);
+    CHECK(tfs_export_tree("/missing", out, &result) < 0);
+
+    const char* host_files[] = {"a.txt", "sub/b.txt", "big.bin", "link"};
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", in, host_files[i]);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%s", out, host_files[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%0*d", in, MAX_FILENAME_LEN, 0);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%0*d", in, MAX_FILENAME_LEN - 1, 0);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%0*d", out, MAX_FILENAME_LEN - 1, 0);
+    unlink(path);
+    const char* host_dirs[] = {"sub/deep", "sub", ""};
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", in, host_dirs[i]);
+        rmdir(path);
+        snprintf(path, sizeof(path), "%s/%s", out, host_dirs[i]);
+        rmdir(path);
+    }
+}
+
+/* A saved image loads back with the same files, and can be saved over while loaded */
+static void test_image_round_trip() {
+    char image[256];
+    char text[64];
+    temp_path(image, sizeof(image), "round_trip.img");
+    CHECK(makeDirectory("/d") == 0);
+    CHECK(write_text("/d/a", "hello") == 5);
+    CHECK(write_text("/b", "world") == 5);
+    CHECK(tfs_save_image(image) == 0);
+
+    CHECK(write_text("/b", "changed") == 7);
+    CHECK(tfs_load_image(image, true) == 0);
+    CHECK(read_text("/d/a", text, sizeof(text)) == 5 && strcmp(text, "hello") == 0);
+    CHECK(read_text("/b", text, sizeof(text)) == 5 && strcmp(text, "world") == 0);
+
+    /* The loaded volume is mapped from the file it is now saved over */
+    CHECK(write_text("/c", "new") == 3);
+    CHECK(tfs_save_image(image) == 0);
+    CHECK(read_text("/d/a", text, sizeof(text)) == 5 && strcmp(text, "hello") == 0);
+    CHECK(tfs_load_image(image, true) == 0);
+    CHECK(read_text("/c", text, sizeof(text)) == 3 && strcmp(text, "new") == 0);
+    CHECK(read_text("/b", text, sizeof(text)) == 5 && strcmp(text, "world") == 0);
+
+    CHECK(tfs_load_image("/nonexistent/image", false) < 0);
+    free_disk();
+    unlink(image);
+}
+
+/* A delta brings a loaded image up to the volume it was taken from, and only applies to
+ * the checkpoint it was taken against */
+static void test_delta_apply() {
+    char image[256];
+    char delta[256];
+    char text[64];
+    temp_path(image, sizeof(image), "delta_base.img");
+    temp_path(delta, sizeof(delta), "delta_1.delta");
+    CHECK(write_text("/a", "base") == 4);
+    CHECK(write_text("/b", "gone") == 4);
+    CHECK(tfs_save_image(image) == 0);
+
+    CHECK(write_text("/a", "updated") == 7);
+    CHECK(deleteFile("/b") == 0);
+    CHECK(write_text("/c", "added") == 5);
+    CHECK(count_dirty_blocks() > 0);
+    CHECK(tfs_save_delta(delta) == 0);
+    CHECK(count_dirty_blocks() == 0);
+
+    CHECK(tfs_load_image(image, true) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 4 && strcmp(text, "base") == 0);
+    CHECK(tfs_apply_delta(delta) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 7 && strcmp(text, "updated") == 0);
+    CHECK(read_text("/b", text, sizeof(text)) < 0);
+    CHECK(read_text("/c", text, sizeof(text)) == 5 && strcmp(text, "added") == 0);
+
+    /* The volume is past the delta's base now */
+    CHECK(tfs_apply_delta(delta) < 0);
+
+    /* A changed volume no longer matches the base either */
+    CHECK(tfs_load_image(image, true) == 0);
+    CHECK(write_text("/d", "local") == 5);
+    CHECK(tfs_apply_delta(delta) < 0);
+
+    free_disk();
+    unlink(image);
+    unlink(delta);
+}
+
+/* A volume keeps the block size it was formatted with through an image save and load and
+ * a remount of its host file, whatever the size in use before */
+static void test_block_size() {
+    char image[256];
+    char volume[256];
+    char data[1000];
+    char text[2048];
+    temp_path(image, sizeof(image), "block_size.img");
+    temp_path(volume, sizeof(volume), "block_size.vol");
+    memset(data, 'b', sizeof(data));
+    CHECK(!is_valid_block_size(128) && !is_valid_block_size(1000));
+    CHECK(!is_valid_block_size(MAX_BLOCK_SIZE * 2) && is_valid_block_size(MAX_BLOCK_SIZE));
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 1000) < 0);
+
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 1024) == 0);
+    CHECK(get_block_size() == 1024);
+    CHECK(writeWholeFile("/a", data, sizeof(data), WRITE_CREATE) == (int)sizeof(data));
+    CHECK(tfs_save_image(image) == 0);
+
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(tfs_load_image(image, true) == 0);
+    CHECK(get_block_size() == 1024);
+    CHECK(read_text("/a", text, sizeof(text)) == (int)sizeof(data));
+    CHECK(memcmp(text, data, sizeof(data)) == 0);
+
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 2048) == 0);
+    CHECK(writeWholeFile("/b", data, sizeof(data), WRITE_CREATE) == (int)sizeof(data));
+    CHECK(tfs_sync() == 0);
+    CHECK(mount_host_file(volume) == 0);
+    CHECK(get_block_size() == 2048 && get_total_blocks() == TEST_BLOCKS);
+    CHECK(read_text("/b", text, sizeof(text)) == (int)sizeof(data));
+
+    free_disk();
+    unlink(image);
+    unlink(volume);
+}
+
+/* Block numbers are 64-bit all the way down: one past 2^32 is out of range on a small
+ * volume rather than wrapping onto a low block, and runs whose end overflows are refused */
+static void test_block_addresses() {
+    uint64_t far = (1ull << 32) + 1;
+    uint32_t block_size = get_block_size();
+    uint8_t* block = malloc(block_size);
+    uint8_t* check = malloc(block_size);
+    uint64_t low = get_total_blocks() - 1;
+    memset(block, 0x11, block_size);
+    CHECK(write_block(low, block) == 0);
+
+    memset(block, 0x22, block_size);
+    CHECK(write_block(far, block) < 0 && read_block(far, block) < 0);
+    CHECK(write_block((1ull << 32) + low, block) < 0);
+    CHECK(read_block(low, check) == 0 && check[0] == 0x11);
+    CHECK(!is_block_allocated(far) && discard_blocks(far, 1) < 0);
+    const uint8_t* run[1] = {block};
+    CHECK(write_block_vector(low, UINT64_MAX, run) < 0);
+    CHECK(discard_blocks(low, UINT64_MAX) < 0);
+
+    /* Inside a batch the queue sees the same checks */
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_block(far, block) < 0);
+    CHECK(tfs_commit_batch() == 0);
+    CHECK(read_block(low, check) == 0 && check[0] == 0x11);
+
+    /* Sizes past what the host can back are refused up front */
+    CHECK(init_filesystem_with_block_size(UINT64_MAX, DEFAULT_BLOCK_SIZE) < 0);
+    free(block);
+    free(check);
+}
+
+/* A large RAM volume only takes memory for the chunks written: reads of untouched blocks
+ * come back zero without mapping anything, and a write maps just its own chunk */
+static void test_sparse_ram_disk() {
+    uint64_t blocks = 1ull << 22;
+    uint32_t block_size = 4096;
+    CHECK(init_filesystem_with_block_size(blocks, block_size) == 0);
+    uint64_t resident = get_resident_bytes();
+    CHECK(resident > 0 && resident <= 2 * (uint64_t)DISK_CHUNK_SIZE);
+#ifdef TFS_ENABLE_STATS
+    tfs_reset_stats();
+#endif
+
+    uint8_t* block = malloc(block_size);
+    memset(block, 0xEE, block_size);
+    CHECK(read_block(blocks - 1, block) == 0 && block[0] == 0 && block[block_size - 1] == 0);
+    CHECK(get_resident_bytes() == resident);
+
+    memset(block, 0x5A, block_size);
+    CHECK(write_block(blocks - 1, block) == 0);
+    CHECK(write_block(blocks - 2, block) == 0);
+    CHECK(get_resident_bytes() == resident + DISK_CHUNK_SIZE);
+    memset(block, 0, block_size);
+    CHECK(read_block(blocks - 2, block) == 0 && block[0] == 0x5A);
+#ifdef TFS_ENABLE_STATS
+    TfsStats stats;
+    CHECK(tfs_get_stats(&stats) == 0 && stats.totals.chunks_mapped == 1);
+#endif
+    free(block);
+}
+
+/* Deleted files' blocks go back to the OS once the metadata no longer refers to them:
+ * not inside a batch, then whole chunks unmapped and shared pages dropped */
+static void test_discard_releases_chunks() {
+    uint32_t block_size = 65536;
+    char name[16];
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, block_size) == 0);
+    uint64_t resident = get_resident_bytes();
+    int files = (int)(DISK_CHUNK_SIZE / block_size) * 2;
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        CHECK(write_text(name, "data") == 4);
+    }
+    uint64_t last = data_block_of(name);
+    CHECK(get_resident_bytes() > resident);
+    uint64_t grown = get_resident_bytes();
+#ifdef TFS_ENABLE_STATS
+    tfs_reset_stats();
+#endif
+
+    CHECK(tfs_begin_batch() == 0);
+    for (int i = 0; i < files; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        CHECK(deleteFile(name) == 0);
+    }
+    CHECK(flush_discards() == 0);
+    CHECK(get_resident_bytes() == grown);
+    CHECK(tfs_commit_batch() == 0);
+
+    CHECK(flush_discards() == 0);
+    CHECK(get_resident_bytes() < grown);
+    uint8_t* block = malloc(block_size);
+    CHECK(read_block(last, block) == 0 && block[0] == 0);
+    free(block);
+#ifdef TFS_ENABLE_STATS
+    TfsStats stats;
+    CHECK(tfs_get_stats(&stats) == 0);
+    CHECK(stats.totals.chunks_released > 0 && stats.totals.bytes_discarded > 0);
+#endif
+
+    /* The volume still works on the released memory */
+    CHECK(write_text("/again", "more") == 4);
+    char text[8];
+    CHECK(read_text("/again", text, sizeof(text)) == 4 && strcmp(text, "more") == 0);
+}
+
+/* Disk memory is 2 MB aligned and zeroed in every huge page mode, asks the kernel for
+ * huge pages only when told to, and a volume works on each */
+static void test_huge_pages() {
+    const int modes[] = {HUGE_PAGES_OFF, HUGE_PAGES_THP, HUGE_PAGES_HUGETLB};
+    size_t length = 2 * HUGE_PAGE_SIZE;
+    char text[8];
+    CHECK(set_huge_page_mode(-1) < 0 && set_huge_page_mode(HUGE_PAGES_HUGETLB + 1) < 0);
+    CHECK(get_huge_page_mode() == HUGE_PAGES_THP);
+
+    for (int m = 0; m < 3; m++) {
+        CHECK(set_huge_page_mode(modes[m]) == 0 && get_huge_page_mode() == modes[m]);
+#ifdef TFS_ENABLE_STATS
+        tfs_reset_stats();
+#endif
+        uint8_t* memory = map_disk_memory(length);
+        CHECK(memory != NULL && (uintptr_t)memory % HUGE_PAGE_SIZE == 0);
+        CHECK(memory[0] == 0 && memory[length - 1] == 0);
+        memset(memory, 0x33, length);
+        unmap_disk_memory(memory, length);
+#ifdef TFS_ENABLE_STATS
+        TfsStats stats;
+        CHECK(tfs_get_stats(&stats) == 0);
+        const TfsCounters* t = &stats.totals;
+        if (modes[m] == HUGE_PAGES_OFF) {
+            CHECK(t->huge_page_regions + t->huge_page_advised + t->huge_page_fallbacks == 0);
+        } else if (modes[m] == HUGE_PAGES_THP) {
+            CHECK(t->huge_page_regions == 0 && t->huge_page_advised + t->huge_page_fallbacks == 1);
+        } else {
+            CHECK(t->huge_page_regions + t->huge_page_fallbacks >= 1);
+        }
+#endif
+
+        /* Below one huge page the memory comes from the heap, zeroed all the same */
+        uint8_t* small = map_disk_memory(4096);
+        CHECK(small != NULL && small[0] == 0 && small[4095] == 0);
+        unmap_disk_memory(small, 4096);
+
+        CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 65536) == 0);
+        CHECK(write_text("/a", "huge") == 4);
+        CHECK(read_text("/a", text, sizeof(text)) == 4 && strcmp(text, "huge") == 0);
+    }
+    set_huge_page_mode(HUGE_PAGES_THP);
+}
+
+/* Every host file backend keeps a volume across a remount, at a block size below the
+ * direct I/O alignment and at one above it; the host file system may refuse O_DIRECT */
+static void test_file_backends() {
+    const int kinds[] = {BACKEND_MMAP, BACKEND_PREAD, BACKEND_DIRECT};
+    const uint32_t sizes[] = {DEFAULT_BLOCK_SIZE, 4096};
+    char volume[256];
+    char text[64];
+    temp_path(volume, sizeof(volume), "backend.vol");
+
+    for (int k = 0; k < 3; k++) {
+        for (int s = 0; s < 2; s++) {
+            free_disk();
+            CHECK(set_disk_backend(kinds[k], volume) == 0);
+            if (init_filesystem_with_block_size(TEST_BLOCKS, sizes[s]) < 0) {
+                CHECK(kinds[k] == BACKEND_DIRECT);
+                printf("  (direct I/O unsupported in %s, skipped)\n", temp_dir);
+                break;
+            }
+            CHECK(get_disk_backend() == kinds[k]);
+            CHECK(get_disk_capabilities() & BACKEND_CAP_PERSISTENT);
+            CHECK(makeDirectory("/d") == 0);
+            CHECK(write_text("/d/a", "persisted") == 9);
+            CHECK(tfs_sync() == 0);
+
+            free_disk();
+            CHECK(open_disk(kinds[k], volume) == 0 && mount_filesystem() == 0);
+            CHECK(get_block_size() == sizes[s] && get_total_blocks() == TEST_BLOCKS);
+            CHECK(read_text("/d/a", text, sizeof(text)) == 9 && strcmp(text, "persisted") == 0);
+        }
+    }
+
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, NULL) < 0);
+    CHECK(open_disk(BACKEND_PREAD, "/nonexistent/volume") < 0);
+    CHECK(open_disk(BACKEND_RAM, volume) < 0);
+    unlink(volume);
+}
+
+/* Submit every request, reaping as the queue depth allows; returns how many failed */
+static int run_block_io(BlockIo* ios, int count) {
+    BlockIo* pending[64];
+    BlockIo* done[64];
+    int submitted = 0;
+    int reaped = 0;
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        pending[i] = &ios[i];
+    }
+    while (reaped < count) {
+        int n = submit_block_io(pending + submitted, count - submitted);
+        if (n < 0) {
+            return count;
+        }
+        submitted += n;
+        n = reap_block_io(done, 64, 1);
+        for (int i = 0; i < n; i++) {
+            failed += done[i]->result < 0 ? 1 : 0;
+        }
+        reaped += n;
+        if (n == 0 && submitted < count) {
+            return count;
+        }
+    }
+    return failed;
+}
+
+/* Fill count blocks of buffer so block i holds the byte 'a' + i */
+static void fill_blocks(uint8_t* buffer, uint32_t count, uint32_t block_size) {
+    for (uint32_t i = 0; i < count; i++) {
+        memset(buffer + (size_t)i * block_size, 'a' + (int)i, block_size);
+    }
+}
+
+/* Whether blocks first..first+count-1 read back as fill_blocks wrote them */
+static bool blocks_match(uint64_t first, uint32_t count, uint32_t block_size) {
+    uint8_t* block = malloc(block_size);
+    bool match = true;
+    for (uint32_t i = 0; match && i < count; i++) {
+        match = read_block(first + i, block) == 0 && block[0] == 'a' + (int)i &&
+                block[block_size - 1] == 'a' + (int)i;
+    }
+    free(block);
+    return match;
+}
+
+/* Child process: make io_uring_enter fail as if the kernel were out of resources, then
+ * submit; refused entries must be handed back as not accepted and never reaped */
+static int check_refused_submit(const char* volume) {
+    if (set_disk_backend(BACKEND_PREAD, volume) < 0 ||
+        init_filesystem_with_block_size(TEST_BLOCKS, 4096) < 0 ||
+        set_io_engine(IO_ENGINE_URING, 8) < 0) {
+        return 1;
+    }
+    uint8_t* buffer = NULL;
+    if (posix_memalign((void**)&buffer, DIRECT_IO_ALIGN, 4 * 4096) != 0) {
+        return 1;
+    }
+    fill_blocks(buffer, 4, 4096);
+    BlockIo first = {200, 1, true, buffer, 0, 1};
+    if (run_block_io(&first, 1) != 0 || strcmp(get_io_engine_name(), "io_uring") != 0) {
+        return 2; /* No io_uring here */
+    }
+
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_enter, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EAGAIN),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) < 0) {
+        return 2;
+    }
+
+    BlockIo ios[4];
+    BlockIo* pending[4];
+    for (int i = 0; i < 4; i++) {
+        ios[i] = (BlockIo){300 + i, 1, true, buffer + i * 4096, i, 1};
+        pending[i] = &ios[i];
+    }
+    BlockIo* done[4];
+    bool ok = submit_block_io(pending, 4) == 0 && get_block_io_inflight() == 0 &&
+              reap_block_io(done, 4, 0) == 0;
+    for (int i = 0; i < 4; i++) {
+        ok = ok && ios[i].result == 1 && !is_block_dirty(300 + i);
+    }
+    return ok ? 0 : 1;
+}
+
+/* The thread engine runs requests up to the queue depth and completes each once, invalid
+ * ones with -EINVAL, and sees writes write-back still holds; O_DIRECT requests it cannot align run synchronously instead; and
+ * io_uring entries the kernel refuses are handed back rather than lost */
+static void test_async_io() {
+    char volume[256];
+    temp_path(volume, sizeof(volume), "async.vol");
+    uint32_t block_size = 4096;
+    uint8_t* buffer = NULL;
+    CHECK(posix_memalign((void**)&buffer, DIRECT_IO_ALIGN, 13 * (size_t)block_size) == 0);
+    fill_blocks(buffer, 12, block_size);
+
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, block_size) == 0);
+    CHECK(set_io_engine(IO_ENGINE_THREADS, 8) == 0);
+    CHECK(set_io_engine(IO_ENGINE_SYNC + 1, 8) < 0);
+
+    BlockIo ios[16];
+    BlockIo* pending[16];
+    for (int i = 0; i < 12; i++) {
+        ios[i] = (BlockIo){100 + i, 1, true, buffer + (size_t)i * block_size, i, 1};
+        pending[i] = &ios[i];
+    }
+    CHECK(submit_block_io(pending, 12) == 8);
+    CHECK(strcmp(get_io_engine_name(), "threads") == 0 && get_block_io_inflight() == 8);
+    BlockIo* done[16];
+    CHECK(reap_block_io(done, 16, 8) == 8 && get_block_io_inflight() == 0);
+
+    /* The rest, with requests that cannot be valid */
+    uint64_t total = get_total_blocks();
+    ios[12] = (BlockIo){100, 1, true, NULL, 12, 1};
+    ios[13] = (BlockIo){100, 0, true, buffer, 13, 1};
+    ios[14] = (BlockIo){total, 1, false, buffer, 14, 1};
+    ios[15] = (BlockIo){total - 1, 2, false, buffer, 15, 1};
+    for (int i = 12; i < 16; i++) {
+        pending[i] = &ios[i];
+    }
+    CHECK(submit_block_io(pending + 8, 8) == 8);
+    int reaped = 0;
+    while (reaped < 8) {
+        int n = reap_block_io(done + reaped, 16 - reaped, 1);
+        CHECK(n > 0);
+        reaped += n > 0 ? n : 8;
+    }
+    for (int i = 0; i < 16; i++) {
+        CHECK(ios[i].result == (i < 12 ? 0 : -EINVAL));
+    }
+    CHECK(blocks_match(100, 12, block_size));
+
+    /* Reads come back through the engine as well */
+    memset(buffer, 0, 12 * (size_t)block_size);
+    for (int i = 0; i < 12; i++) {
+        ios[i].write = false;
+    }
+    CHECK(run_block_io(ios, 12) == 0);
+    CHECK(buffer[0] == 'a' && buffer[12 * (size_t)block_size - 1] == 'a' + 11);
+
+    /* Under write-back a submit first sends out what the scheduler queue holds, under the
+     * lock the flusher takes */
+    CHECK(set_writeback(true, 60000, 90, 95) == 0);
+    CHECK(write_text("/held", "held") == 4);
+    CHECK(get_queued_blocks() > 0);
+    BlockIo held = {data_block_of("/held"), 1, false, buffer, 0, 1};
+    CHECK(run_block_io(&held, 1) == 0 && memcmp(buffer, "held", 4) == 0);
+    CHECK(get_queued_blocks() == 0);
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    /* O_DIRECT: an aligned request goes to the engine, a misaligned buffer or a block size
+     * below the alignment runs synchronously; all of them land */
+    for (int s = 0; s < 2; s++) {
+        uint32_t size = s == 0 ? block_size : DEFAULT_BLOCK_SIZE;
+        free_disk();
+        CHECK(set_disk_backend(BACKEND_DIRECT, volume) == 0);
+        if (init_filesystem_with_block_size(TEST_BLOCKS, size) < 0) {
+            printf("  (direct I/O unsupported in %s, skipped)\n", temp_dir);
+            break;
+        }
+        CHECK(set_io_engine(IO_ENGINE_THREADS, 8) == 0);
+#ifdef TFS_ENABLE_STATS
+        tfs_reset_stats();
+#endif
+        fill_blocks(buffer, 2, size);
+        fill_blocks(buffer + size * 2 + 1, 2, size);
+        BlockIo aligned = {100, 2, true, buffer, 0, 1};
+        BlockIo shifted = {200, 2, true, buffer + size * 2 + 1, 1, 1};
+        CHECK(run_block_io(&aligned, 1) == 0);
+#ifdef TFS_ENABLE_STATS
+        TfsStats stats;
+        CHECK(tfs_get_stats(&stats) == 0);
+        CHECK(stats.totals.io_sync_fallbacks == (size == block_size ? 0u : 1u));
+#endif
+        CHECK(run_block_io(&shifted, 1) == 0);
+#ifdef TFS_ENABLE_STATS
+        CHECK(tfs_get_stats(&stats) == 0);
+        CHECK(stats.totals.io_sync_fallbacks == (size == block_size ? 1u : 2u));
+#endif
+        CHECK(blocks_match(100, 2, size) && blocks_match(200, 2, size));
+    }
+    free_disk();
+    set_io_engine(IO_ENGINE_AUTO, 0);
+    free(buffer);
+
+    pid_t child = fork();
+    if (child == 0) {
+        _exit(check_refused_submit(volume));
+    }
+    int status = 0;
+    CHECK(child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status));
+    CHECK(WEXITSTATUS(status) != 1);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+        printf("  (io_uring or seccomp unavailable, refused submit skipped)\n");
+    }
+    unlink(volume);
+}
+
+/* A plugged queue sends its data blocks before the metadata that points at them, and keeps
+ * the metadata back when the data fails: host writes past the file's data block are made to
+ * fail during a batch commit, and the copy taken then must not have the file */
+static void test_queue_data_first() {
+    char volume[256];
+    char crash[256];
+    char text[64];
+    temp_path(volume, sizeof(volume), "data_first.vol");
+    temp_path(crash, sizeof(crash), "data_first_crash.vol");
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(tfs_sync() == 0);
+
+    CHECK(tfs_begin_batch() == 0);
+    CHECK(write_text("/a", "alpha") == 5);
+    uint64_t block = data_block_of("/a");
+    CHECK(block != 0);
+    struct rlimit saved;
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    limit = saved;
+    limit.rlim_cur = (rlim_t)block * DEFAULT_BLOCK_SIZE;
+    void (*saved_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    CHECK(tfs_commit_batch() < 0);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, saved_handler);
+    CHECK(copy_host_file(volume, crash) == 0);
+    CHECK(get_queued_blocks() > 0);
+    CHECK(tfs_sync() == 0 && get_queued_blocks() == 0);
+
+    CHECK(mount_host_file(crash) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) < 0);
+    CHECK(mount_host_file(volume) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 5 && strcmp(text, "alpha") == 0);
+
+    free_disk();
+    unlink(volume);
+    unlink(crash);
+}
+
+/* Flushing a range with nothing queued in it leaves the queue intact: blocks queued out of
+ * order must still read back from the queue and be replaced in place when rewritten */
+static void test_queue_empty_range() {
+    Superblock* sb = get_superblock();
+    uint64_t first = sb->data_start_block + 8;
+    uint8_t block[DEFAULT_BLOCK_SIZE];
+    uint8_t back[DEFAULT_BLOCK_SIZE];
+    CHECK(plug_block_queue() == 0);
+    for (uint32_t i = 0; i < 8; i++) {
+        memset(block, 'a' + i, sizeof(block));
+        CHECK(write_block(first + 7 - i, block) == 0);
+    }
+    CHECK(get_queued_blocks() == 8);
+    CHECK(flush_queued_range(sb->data_start_block, 8) == 0);
+    CHECK(get_queued_blocks() == 8);
+
+    for (uint32_t i = 0; i < 8; i++) {
+        memset(block, 'a' + i, sizeof(block));
+        CHECK(read_block(first + 7 - i, back) == 0 && memcmp(back, block, sizeof(block)) == 0);
+        memset(block, 'A' + i, sizeof(block));
+        CHECK(write_block(first + 7 - i, block) == 0);
+    }
+    CHECK(get_queued_blocks() == 8);
+    CHECK(unplug_block_queue() == 0 && get_queued_blocks() == 0);
+    for (uint32_t i = 0; i < 8; i++) {
+        memset(block, 'A' + i, sizeof(block));
+        CHECK(read_block(first + 7 - i, back) == 0 && memcmp(back, block, sizeof(block)) == 0);
+    }
+}
+
+/* Write-back keeps changes off the disk until a flush, and a flush never writes metadata
+ * ahead of the data it points at: host writes past the file's data block are made to fail,
+ * the inode must stay unwritten with it, and both must still go out on a later sync */
+static void test_writeback_ordering() {
+    char volume[256];
+    char held[256];
+    char crash[256];
+    char text[64];
+    temp_path(volume, sizeof(volume), "writeback.vol");
+    temp_path(held, sizeof(held), "writeback_held.vol");
+    temp_path(crash, sizeof(crash), "writeback_crash.vol");
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(tfs_sync() == 0);
+    CHECK(set_writeback(true, 60000, 90, 95) == 0);
+
+    /* Held in memory until a flush */
+    CHECK(write_text("/a", "alpha") == 5);
+    CHECK(count_writeback_dirty() > 0);
+    CHECK(copy_host_file(volume, held) == 0);
+
+    /* Make the data block unwritable; only metadata blocks lie below it */
+    Inode inode;
+    CHECK(load_inode(find_inode_by_path("/a"), &inode) == 0 && inode.data_block != 0);
+    struct rlimit saved;
+    struct rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    limit = saved;
+    limit.rlim_cur = (rlim_t)inode.data_block * DEFAULT_BLOCK_SIZE;
+    void (*saved_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    CHECK(tfs_sync() < 0);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, saved_handler);
+    CHECK(copy_host_file(volume, crash) == 0);
+
+    /* Once the disk takes writes again, the held writes go out on the next sync */
+    CHECK(count_writeback_dirty() > 0);
+    CHECK(tfs_sync() == 0);
+    CHECK(count_writeback_dirty() == 0);
+    CHECK(write_text("/b", "unflushed") == 9);
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    /* Neither copy taken before a successful flush has the file */
+    CHECK(mount_host_file(held) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) < 0);
+    CHECK(mount_host_file(crash) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) < 0);
+    CHECK(mount_host_file(volume) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 5 && strcmp(text, "alpha") == 0);
+    CHECK(read_text("/b", text, sizeof(text)) == 9 && strcmp(text, "unflushed") == 0);
+
+    free_disk();
+    unlink(volume);
+    unlink(held);
+    unlink(crash);
+}
+
+/* Wait up to two seconds for the flusher to write back everything held */
+static bool wait_for_flusher() {
+    struct timespec pause = {0, 5 * 1000000L};
+    for (int i = 0; i < 400; i++) {
+        tfs_lock();
+        uint64_t dirty = count_writeback_dirty();
+        tfs_unlock();
+        if (dirty == 0) {
+            return true;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return false;
+}
+
+/* The flusher writes back on its own once changes pass their age limit: after each cycle,
+ * which flushes the data area in slices and then the whole queue, files rewritten between
+ * cycles read back their latest contents, and the disk has them once write-back is off */
+static void test_writeback_flusher() {
+    char volume[256];
+    char name[16];
+    char want[32];
+    char text[64];
+    temp_path(volume, sizeof(volume), "flusher.vol");
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 4096) == 0);
+    CHECK(tfs_sync() == 0);
+    CHECK(set_writeback(true, 10, 90, 95) == 0);
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < 8; i++) {
+            snprintf(name, sizeof(name), "/f%d", i);
+            snprintf(want, sizeof(want), "round %d file %d", round, i);
+            CHECK(write_text(name, want) == (int)strlen(want));
+        }
+        CHECK(wait_for_flusher());
+        for (int i = 0; i < 8; i++) {
+            snprintf(name, sizeof(name), "/f%d", i);
+            snprintf(want, sizeof(want), "round %d file %d", round, i);
+            CHECK(read_text(name, text, sizeof(text)) == (int)strlen(want) && strcmp(text, want) == 0);
+        }
+    }
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    CHECK(mount_host_file(volume) == 0);
+    for (int i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        snprintf(want, sizeof(want), "round 3 file %d", i);
+        CHECK(read_text(name, text, sizeof(text)) == (int)strlen(want) && strcmp(text, want) == 0);
+    }
+
+    free_disk();
+    unlink(volume);
+}
+
+/* fsyncFile makes one file durable, with its entry, and nothing else: another file whose
+ * inode shares the same inode table, bitmap and directory blocks stays held, so a crash
+ * right after the fsync leaves it absent rather than pointing at unwritten data. A file in
+ * a directory the disk does not have yet takes everything with it */
+static void test_fsync_file() {
+    char volume[256];
+    char crash[256];
+    char moved[256];
+    char text[64];
+    temp_path(volume, sizeof(volume), "fsync.vol");
+    temp_path(crash, sizeof(crash), "fsync_crash.vol");
+    temp_path(moved, sizeof(moved), "fsync_dir_crash.vol");
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(tfs_sync() == 0);
+    CHECK(set_writeback(true, 60000, 90, 95) == 0);
+
+    CHECK(write_text("/a", "alpha") == 5);
+    CHECK(write_text("/b", "bravo") == 5);
+    uint32_t b_inode = find_inode_by_path("/b");
+    uint64_t b_block = data_block_of("/b");
+    int fd = openFile("/a", MODE_READ);
+    CHECK(fd >= 0 && fsyncFile(fd) == 0);
+    CHECK(count_writeback_dirty() > 0);
+    CHECK(copy_host_file(volume, crash) == 0);
+
+    CHECK(makeDirectory("/d") == 0);
+    CHECK(write_text("/d/c", "charlie") == 7);
+    int in_dir = openFile("/d/c", MODE_READ);
+    CHECK(in_dir >= 0 && fsyncFile(in_dir) == 0);
+    CHECK(copy_host_file(volume, moved) == 0);
+    closeFile(in_dir);
+    closeFile(fd);
+    CHECK(fsyncFile(fd) < 0);
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    CHECK(mount_host_file(crash) == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 5 && strcmp(text, "alpha") == 0);
+    int n = read_text("/b", text, sizeof(text));
+    CHECK(n < 0 || (n == 5 && strcmp(text, "bravo") == 0));
+    Inode inode;
+    CHECK(load_inode(b_inode, &inode) == 0 && !inode.used);
+    CHECK(!is_block_allocated(b_block));
+    CHECK(mount_host_file(moved) == 0);
+    CHECK(read_text("/d/c", text, sizeof(text)) == 7 && strcmp(text, "charlie") == 0);
+
+    free_disk();
+    unlink(volume);
+    unlink(crash);
+    unlink(moved);
+}
+
+/* An fsync of a file with nothing left queued leaves the other files' held writes intact.
+ * /f1 shares no inode block with /f4../f6, whose rewrites are queued out of block order;
+ * across the fsync they read back, take further rewrites, and reach the disk */
+static void test_fsync_others_queued() {
+    char volume[256];
+    char name[16];
+    char want[32];
+    char text[64];
+    temp_path(volume, sizeof(volume), "fsync_queued.vol");
+    free_disk();
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) == 0);
+    CHECK(set_writeback(true, 60000, 90, 95) == 0);
+
+    for (int i = 1; i <= 6; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        snprintf(want, sizeof(want), "first %d", i);
+        CHECK(write_text(name, want) == (int)strlen(want));
+    }
+    CHECK(tfs_sync() == 0);
+    for (int i = 6; i >= 4; i--) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        snprintf(want, sizeof(want), "second %d", i);
+        CHECK(write_text(name, want) == (int)strlen(want));
+    }
+    uint32_t queued = get_queued_blocks();
+    CHECK(queued >= 3);
+    int fd = openFile("/f1", MODE_READ);
+    CHECK(fd >= 0 && fsyncFile(fd) == 0);
+    closeFile(fd);
+    CHECK(get_queued_blocks() == queued);
+
+    for (int i = 4; i <= 6; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        snprintf(want, sizeof(want), "second %d", i);
+        CHECK(read_text(name, text, sizeof(text)) == (int)strlen(want) && strcmp(text, want) == 0);
+        snprintf(want, sizeof(want), "third %d", i);
+        CHECK(write_text(name, want) == (int)strlen(want));
+        CHECK(read_text(name, text, sizeof(text)) == (int)strlen(want) && strcmp(text, want) == 0);
+    }
+    CHECK(get_queued_blocks() == queued);
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    CHECK(mount_host_file(volume) == 0);
+    for (int i = 1; i <= 6; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        snprintf(want, sizeof(want), i >= 4 ? "third %d" : "first %d", i);
+        CHECK(read_text(name, text, sizeof(text)) == (int)strlen(want) && strcmp(text, want) == 0);
+    }
+
+    free_disk();
+    unlink(volume);
+}
+
+/* A batch that passes the write-back limit has its data flushed early, but none of its
+ * half-applied metadata reaches the disk before the commit */
+static void test_writeback_limit_in_batch() {
+    char volume[256];
+    char crash[256];
+    char name[16];
+    char text[64];
+    temp_path(volume, sizeof(volume), "batch_limit.vol");
+    temp_path(crash, sizeof(crash), "batch_limit_crash.vol");
+    free_disk();
+    /* Large blocks make the queue small, so a few files pass the limit */
+    CHECK(set_disk_backend(BACKEND_PREAD, volume) == 0);
+    CHECK(init_filesystem_with_block_size(TEST_BLOCKS, 4096) == 0);
+    CHECK(tfs_sync() == 0);
+    CHECK(set_writeback(true, 60000, 1, 2) == 0);
+#ifdef TFS_ENABLE_STATS
+    tfs_reset_stats();
+#endif
+
+    CHECK(tfs_begin_batch() == 0);
+    for (int i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        CHECK(write_text(name, "batched") == 7);
+    }
+    CHECK(copy_host_file(volume, crash) == 0);
+    CHECK(tfs_commit_batch() == 0);
+#ifdef TFS_ENABLE_STATS
+    TfsStats stats;
+    CHECK(tfs_get_stats(&stats) == 0 && stats.totals.writeback_throttles > 0);
+#endif
+    CHECK(set_writeback(false, 0, 0, 0) == 0);
+
+    CHECK(mount_host_file(crash) == 0);
+    CHECK(read_text("/f0", text, sizeof(text)) < 0);
+    CHECK(mount_host_file(volume) == 0);
+    CHECK(read_text("/f0", text, sizeof(text)) == 7 && strcmp(text, "batched") == 0);
+    CHECK(read_text("/f15", text, sizeof(text)) == 7 && strcmp(text, "batched") == 0);
+
+    free_disk();
+    unlink(volume);
+    unlink(crash);
+}
+
+/* A snapshot keeps the contents it was taken with while the live file is rewritten or
+ * deleted, and its blocks come back once it is deleted or the volume is remounted */
+static void test_snapshot_isolation() {
+    char text[64];
+    CHECK(write_text("/a", "before") == 6);
+    CHECK(write_text("/b", "kept") == 4);
+    uint64_t used = count_used_blocks();
+    CHECK(tfs_create_snapshot("s") > 0);
+    CHECK(tfs_create_snapshot("s") < 0);
+    CHECK(count_used_blocks() == used);
+
+    /* The first write to the live file gives it a block of its own */
+    Inode inode;
+    CHECK(load_inode(find_inode_by_path("/a"), &inode) == 0);
+    uint64_t shared = inode.data_block;
+    CHECK(get_block_refs(shared) == 1);
+    CHECK(write_text("/a", "after") == 5);
+    CHECK(load_inode(find_inode_by_path("/a"), &inode) == 0);
+    CHECK(inode.data_block != shared && get_block_refs(shared) == 0);
+    CHECK(deleteFile("/b") == 0);
+
+    int root = openSnapshot("s");
+    CHECK(root >= 0);
+    int fd = openFileAt(root, "a", MODE_READ);
+    int n = readFile(fd, text, sizeof(text) - 1);
+    CHECK(n == 6 && memcmp(text, "before", 6) == 0);
+    closeFile(fd);
+    fd = openFileAt(root, "b", MODE_READ);
+    CHECK(fd >= 0 && readFile(fd, text, 4) == 4 && memcmp(text, "kept", 4) == 0);
+    closeFile(fd);
+    CHECK(writeWholeFileAt(root, "a", "x", 1, WRITE_TRUNCATE) < 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 5 && strcmp(text, "after") == 0);
+    CHECK(read_text("/b", text, sizeof(text)) < 0);
+
+    /* In use it stays; deleted, its blocks are reclaimed, down to one file less */
+    CHECK(tfs_delete_snapshot("s") < 0);
+    CHECK(closeFile(root) == 0);
+    CHECK(tfs_delete_snapshot("s") == 0);
+    reclaim_snapshots(UINT32_MAX);
+    CHECK(!snapshot_reclaim_pending());
+    used--;
+    CHECK(count_used_blocks() == used);
+
+    /* Snapshots do not survive a mount, which sweeps the blocks only they held */
+    CHECK(tfs_create_snapshot("t") > 0);
+    CHECK(write_text("/a", "again") == 5);
+    CHECK(count_used_blocks() == used + 1);
+    CHECK(mount_filesystem() == 0);
+    CHECK(find_snapshot("t") < 0);
+    CHECK(count_used_blocks() == used);
+    CHECK(get_orphan_blocks() == 0);
+    CHECK(read_text("/a", text, sizeof(text)) == 5 && strcmp(text, "again") == 0);
+
+    /* With no snapshots to sweep, a mount leaves a block nothing points at alone; it only
+     * shows up when asked for */
+    uint64_t stray = allocate_block();
+    CHECK(mount_filesystem() == 0);
+    CHECK(is_block_allocated(stray) && get_orphan_blocks() == 1);
+}
+
+/* A clone shares its source's block until either is written, and the block lives as long
+ * as one of them refers to it, whichever is deleted first */
+static void test_clone_refcounts() {
+    char text[64];
+    CHECK(write_text("/src", "shared") == 6);
+    uint64_t used = count_used_blocks();
+    uint64_t block = data_block_of("/src");
+
+    CHECK(cloneFile("/src", "/c1") == 0);
+    CHECK(cloneFile("/src", "/c2") == 0);
+    CHECK(cloneFile("/src", "/c1") < 0);
+    CHECK(data_block_of("/c1") == block && data_block_of("/c2") == block);
+    CHECK(get_block_refs(block) == 2);
+    CHECK(count_used_blocks() == used);
+
+    /* Writing one copy unshares it only */
+    CHECK(write_text("/c2", "own") == 3);
+    CHECK(data_block_of("/c2") != block && get_block_refs(block) == 1);
+    CHECK(read_text("/src", text, sizeof(text)) == 6 && strcmp(text, "shared") == 0);
+
+    /* Deleting the source leaves the clone intact */
+    CHECK(deleteFile("/src") == 0);
+    CHECK(get_block_refs(block) == 0 && is_block_allocated(block));
+    CHECK(read_text("/c1", text, sizeof(text)) == 6 && strcmp(text, "shared") == 0);
+
+    /* The counts are rebuilt from the inodes on mount */
+    CHECK(cloneFile("/c1", "/c3") == 0);
+    CHECK(mount_filesystem() == 0);
+    CHECK(get_block_refs(block) == 1);
+
+    /* Deleting the clones in either order frees the block with the last one */
+    CHECK(deleteFile("/c3") == 0);
+    CHECK(is_block_allocated(block));
+    CHECK(deleteFile("/c1") == 0);
+    CHECK(!is_block_allocated(block));
+    CHECK(read_text("/c2", text, sizeof(text)) == 3 && strcmp(text, "own") == 0);
+}
+
+/* Identical contents share one block, including files written before dedup was on, and a
+ * stale index entry is caught by comparing bytes rather than trusted */
+static void test_dedup() {
+    char text[64];
+    CHECK(write_text("/early", "same bytes") == 10);
+    CHECK(set_dedup(true) == 0);
+#ifdef TFS_ENABLE_STATS
+    tfs_reset_stats();
+#endif
+
+    uint64_t used = count_used_blocks();
+    CHECK(write_text("/a", "same bytes") == 10);
+    CHECK(write_text("/b", "same bytes") == 10);
+    CHECK(count_used_blocks() == used);
+    uint64_t block = data_block_of("/early");
+    CHECK(data_block_of("/a") == block && data_block_of("/b") == block);
+    CHECK(get_block_refs(block) == 2);
+
+    CHECK(write_text("/c", "other bytes") == 11);
+    CHECK(data_block_of("/c") != block && count_used_blocks() == used + 1);
+
+    uint64_t logical = 0;
+    uint64_t physical = 0;
+    CHECK(get_dedup_usage(&logical, &physical) == 0 && logical == 4 && physical == 2);
+
+    /* Rewriting /c in place leaves the index pointing it out for bytes it no longer has */
+    uint64_t rewritten = data_block_of("/c");
+    CHECK(write_text("/c", "newer bytes") == 11);
+    CHECK(data_block_of("/c") == rewritten);
+    CHECK(write_text("/d", "other bytes") == 11);
+    CHECK(data_block_of("/d") != rewritten);
+    CHECK(read_text("/d", text, sizeof(text)) == 11 && strcmp(text, "other bytes") == 0);
+    CHECK(read_text("/c", text, sizeof(text)) == 11 && strcmp(text, "newer bytes") == 0);
+
+    /* Writing a shared copy unshares it instead of changing the others */
+    CHECK(write_text("/a", "changed") == 7);
+    CHECK(data_block_of("/a") != block && get_block_refs(block) == 1);
+    CHECK(read_text("/b", text, sizeof(text)) == 10 && strcmp(text, "same bytes") == 0);
+
+#ifdef TFS_ENABLE_STATS
+    TfsStats stats;
+    CHECK(tfs_get_stats(&stats) == 0);
+    CHECK(stats.totals.dedup_hits == 2);
+    CHECK(stats.totals.dedup_mismatches == 1);
+#endif
+
+    /* Off, equal contents get blocks of their own again */
+    CHECK(set_dedup(false) == 0);
+    CHECK(write_text("/e", "same bytes") == 10);
+    CHECK(data_block_of("/e") != block);
+}
+
+static const TestCase tests[] = {
+    {"batch_nesting", test_batch_nesting},
+    {"batch_abandoned", test_batch_abandoned},
+    {"fd_reuse", test_fd_reuse},
+    {"fd_table_growth", test_fd_table_growth},
+    {"fd_table_reset", test_fd_table_reset},
+    {"write_whole_file", test_write_whole_file},
+    {"dirfd_resolution", test_dirfd_resolution},
+    {"directory_cookie", test_directory_cookie},
+    {"read_directory_plus", test_read_directory_plus},
+    {"stats_counters", test_stats_counters},
+    {"stats_percentile", test_stats_percentile},
+    {"transfer_round_trip", test_transfer_round_trip},
+    {"image_round_trip", test_image_round_trip},
+    {"delta_apply", test_delta_apply},
+    {"block_size", test_block_size},
+    {"block_addresses", test_block_addresses},
+    {"sparse_ram_disk", test_sparse_ram_disk},
+    {"discard_releases_chunks", test_discard_releases_chunks},
+    {"huge_pages", test_huge_pages},
+    {"file_backends", test_file_backends},
+    {"async_io", test_async_io},
+    {"queue_data_first", test_queue_data_first},
+    {"queue_empty_range", test_queue_empty_range},
+    {"writeback_ordering", test_writeback_ordering},
+    {"writeback_flusher", test_writeback_flusher},
+    {"fsync_file", test_fsync_file},
+    {"fsync_others_queued", test_fsync_others_queued},
+    {"writeback_limit_in_batch", test_writeback_limit_in_batch},
+    {"snapshot_isolation", test_snapshot_isolation},
+    {"clone_refcounts", test_clone_refcounts},
+    {"dedup", test_dedup},
+};
+
+int main() {
+    if (!mkdtemp(temp_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    int failed_tests = 0;
+    int count = (int)(sizeof(tests) / sizeof(tests[0]));
+    for (int i = 0; i < count; i++) {
+        set_writeback(false, 0, 0, 0);
+        set_dedup(false);
+        free_disk();
+        set_disk_backend(BACKEND_RAM, NULL);
+        if (init_filesystem_with_block_size(TEST_BLOCKS, DEFAULT_BLOCK_SIZE) < 0) {
+            fprintf(stderr, "Error: cannot create a test volume\n");
+            return 1;
+        }
+
+        int before = checks_failed;
+        tests[i].run();
+        bool passed = checks_failed == before;
+        failed_tests += passed ? 0 : 1;
+        printf("%-24s %s\n", tests[i].name, passed ? "ok" : "FAILED");
+    }
+    free_disk();
+    rmdir(temp_dir);
+
+    printf("%d of %d tests passed\n", count - failed_tests, count);
+    return failed_tests > 0 ? 1 : 0;
+}
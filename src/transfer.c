@@ -0,0 +1,517 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRANSFER_MAX_WORKERS 8
+#define TRANSFER_WINDOW 256   /* Jobs the workers may run ahead of the consumer */
+
+/* One file moving between the host and TinyFS */
+typedef struct {
+    char* host_path;
+    int dirfd;                   /* TinyFS directory handle holding the file */
+    char name[MAX_FILENAME_LEN];
+    uint8_t* data;
+    int32_t length;              /* Bytes in data, or -1 if the host side failed */
+    bool done;
+} TransferJob;
+
+/* Shared state between the calling thread and the worker pool */
+typedef struct {
+    TransferJob* jobs;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t next;               /* Next job a worker will claim */
+    uint32_t consumed;           /* Jobs the other side has finished with */
+    bool closed;                 /* No more jobs will be added */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} TransferQueue;
+
+/* Number of worker threads to start */
+static int worker_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    }
+    return cpus > TRANSFER_MAX_WORKERS ? TRANSFER_MAX_WORKERS : (int)cpus;
+}
+
+static int queue_init(TransferQueue* q) {
+    memset(q, 0, sizeof(*q));
+    if (pthread_mutex_init(&q->lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&q->changed, NULL) != 0) {
+        pthread_mutex_destroy(&q->lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void queue_destroy(TransferQueue* q) {
+    for (uint32_t i = 0; i < q->count; i++) {
+        free(q->jobs[i].host_path);
+        free(q->jobs[i].data);
+    }
+    free(q->jobs);
+    pthread_cond_destroy(&q->changed);
+    pthread_mutex_destroy(&q->lock);
+}
+
+/* Append a job; the caller holds q->lock if workers are running */
+static TransferJob* queue_add(TransferQueue* q, const char* host_path) {
+    if (q->count == q->capacity) {
+        uint32_t capacity = q->capacity ? q->capacity * 2 : 256;
+        TransferJob* jobs = realloc(q->jobs, capacity * sizeof(TransferJob));
+        if (!jobs) {
+            return NULL;
+        }
+        q->jobs = jobs;
+        q->capacity = capacity;
+    }
+
+    TransferJob* job = &q->jobs[q->count];
+    memset(job, 0, sizeof(*job));
+    job->host_path = strdup(host_path);
+    if (!job->host_path) {
+        return NULL;
+    }
+    job->dirfd = -1;
+    q->count++;
+    return job;
+}
+
+/* Join a host path and a name */
+static int join_path(char* out, size_t size, const char* dir, const char* name) {
+    size_t len = strlen(dir);
+    const char* sep = (len > 0 && dir[len - 1] == '/') ? "" : "/";
+    int n = snprintf(out, size, "%s%s%s", dir, sep, name);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/* Read a whole host file with one large read; oversize files are rejected */
+static int32_t read_host_file(const char* path, uint8_t** data) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size > (off_t)get_block_size()) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t* buffer = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+    if (!buffer) {
+        close(fd);
+        return -1;
+    }
+
+    size_t total = 0;
+    while (total < (size_t)st.st_size) {
+        ssize_t n = read(fd, buffer + total, (size_t)st.st_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += (size_t)n;
+    }
+    close(fd);
+
+    *data = buffer;
+    return (int32_t)total;
+}
+
+/* Write a whole host file */
+static int write_host_file(const char* path, const uint8_t* data, uint32_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    uint32_t total = 0;
+    while (total < length) {
+        ssize_t n = write(fd, data + total, length - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        total += (uint32_t)n;
+    }
+    return close(fd);
+}
+
+/* Import worker: read host files ahead of the TinyFS writer, within the window */
+static void* import_worker(void* arg) {
+    TransferQueue* q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->next < q->count && q->next >= q->consumed + TRANSFER_WINDOW) {
+            pthread_cond_wait(&q->changed, &q->lock);
+        }
+        if (q->next >= q->count) {
+            break;
+        }
+
+        uint32_t index = q->next++;
+        char* path = q->jobs[index].host_path;
+        pthread_mutex_unlock(&q->lock);
+
+        uint8_t* data = NULL;
+        int32_t length = read_host_file(path, &data);
+
+        pthread_mutex_lock(&q->lock);
+        q->jobs[index].data = data;
+        q->jobs[index].length = length;
+        q->jobs[index].done = true;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Export worker: write host files produced by the TinyFS reader */
+static void* export_worker(void* arg) {
+    TransferQueue* q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->next >= q->count && !q->closed) {
+            pthread_cond_wait(&q->changed, &q->lock);
+        }
+        if (q->next >= q->count) {
+            break;
+        }
+
+        uint32_t index = q->next++;
+        TransferJob job = q->jobs[index];
+        pthread_mutex_unlock(&q->lock);
+
+        int result = write_host_file(job.host_path, job.data, (uint32_t)job.length);
+
+        pthread_mutex_lock(&q->lock);
+        free(q->jobs[index].data);
+        q->jobs[index].data = NULL;
+        q->jobs[index].length = (result < 0) ? -1 : job.length;
+        q->jobs[index].done = true;
+        q->consumed++;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Open a TinyFS directory, creating missing components along the way */
+static int open_or_create_directory(const char* path) {
+    int dirfd = openDirectory(path);
+    if (dirfd >= 0) {
+        return dirfd;
+    }
+
+    char partial[MAX_PATH_LEN];
+    size_t len = strlen(path);
+    if (len >= MAX_PATH_LEN) {
+        return -1;
+    }
+
+    for (size_t i = 1; i <= len; i++) {
+        if (path[i] == '/' || path[i] == '\0') {
+            memcpy(partial, path, i);
+            partial[i] = '\0';
+            if (searchFile(partial) < 0 && makeDirectory(partial) < 0) {
+                return -1;
+            }
+        }
+    }
+    return openDirectory(path);
+}
+
+/* Walk a host directory: create TinyFS directories and queue regular files */
+static int scan_host_directory(const char* host_dir, int dirfd, TransferQueue* q,
+                               int** handles, uint32_t* handle_count, TransferResult* result) {
+    DIR* dir = opendir(host_dir);
+    if (!dir) {
+        return -1;
+    }
+
+    struct dirent* ent;
+    char child[4096];
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        /* A name TinyFS cannot hold whole is refused, not cut short to collide with another */
+        size_t name_length = strlen(ent->d_name);
+        if (name_length >= MAX_FILENAME_LEN) {
+            result->skipped++;
+            continue;
+        }
+
+        struct stat st;
+        if (join_path(child, sizeof(child), host_dir, ent->d_name) < 0 || lstat(child, &st) < 0) {
+            result->skipped++;
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (searchFileAt(dirfd, ent->d_name) < 0 &&
+                makeDirectoryAt(dirfd, ent->d_name) < 0) {
+                result->failed++;
+                continue;
+            }
+            int subdir = openDirectoryAt(dirfd, ent->d_name);
+            if (subdir < 0) {
+                result->failed++;
+                continue;
+            }
+
+            int* grown = realloc(*handles, (*handle_count + 1) * sizeof(int));
+            if (!grown) {
+                closeFile(subdir);
+                result->failed++;
+                continue;
+            }
+            *handles = grown;
+            (*handles)[(*handle_count)++] = subdir;
+
+            result->directories++;
+            scan_host_directory(child, subdir, q, handles, handle_count, result);
+        } else if (S_ISREG(st.st_mode) && st.st_size <= (off_t)get_block_size()) {
+            TransferJob* job = queue_add(q, child);
+            if (!job) {
+                result->failed++;
+                continue;
+            }
+            job->dirfd = dirfd;
+            memcpy(job->name, ent->d_name, name_length + 1);
+        } else {
+            /* Special files, and files larger than a TinyFS file can hold */
+            result->skipped++;
+        }
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+/* Copy a host directory tree into a TinyFS directory */
+int tfs_import_tree(const char* host_dir, const char* tfs_dir, TransferResult* result) {
+    if (!host_dir || !tfs_dir || !result) {
+        return -1;
+    }
+    memset(result, 0, sizeof(*result));
+
+    TransferQueue q;
+    if (queue_init(&q) < 0) {
+        return -1;
+    }
+
+    /* Every create, allocation and inode update lands in one metadata flush */
+    tfs_begin_batch();
+
+    int* handles = NULL;
+    uint32_t handle_count = 0;
+    int root = open_or_create_directory(tfs_dir);
+    int status = -1;
+
+    if (root >= 0 && scan_host_directory(host_dir, root, &q, &handles, &handle_count, result) == 0) {
+        pthread_t workers[TRANSFER_MAX_WORKERS];
+        int started = 0;
+        int wanted = worker_count();
+        for (int i = 0; i < wanted; i++) {
+            if (pthread_create(&workers[started], NULL, import_worker, &q) == 0) {
+                started++;
+            }
+        }
+
+        /* Workers read in parallel; files are written in discovery order here */
+        for (uint32_t i = 0; i < q.count; i++) {
+            TransferJob* job = &q.jobs[i];
+
+            pthread_mutex_lock(&q.lock);
+            while (!job->done && started > 0) {
+                pthread_cond_wait(&q.changed, &q.lock);
+            }
+            pthread_mutex_unlock(&q.lock);
+
+            if (!job->done) {
+                /* No worker threads could be started: read inline */
+                job->length = read_host_file(job->host_path, &job->data);
+            }
+
+            if (job->length < 0 ||
+                writeWholeFileAt(job->dirfd, job->name, job->data, (uint32_t)job->length,
+                                 WRITE_CREATE | WRITE_TRUNCATE) < 0) {
+                result->failed++;
+            } else {
+                result->files++;
+                result->bytes += (uint64_t)job->length;
+            }
+
+            pthread_mutex_lock(&q.lock);
+            free(job->data);
+            job->data = NULL;
+            q.consumed++;
+            pthread_cond_broadcast(&q.changed);
+            pthread_mutex_unlock(&q.lock);
+        }
+
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        status = 0;
+    }
+
+    for (uint32_t i = 0; i < handle_count; i++) {
+        closeFile(handles[i]);
+    }
+    free(handles);
+    if (root >= 0) {
+        closeFile(root);
+    }
+
+    if (tfs_commit_batch() < 0) {
+        status = -1;
+    }
+    queue_destroy(&q);
+    return status;
+}
+
+/* Walk a TinyFS directory, creating host directories and queueing file contents */
+static int export_directory(int dirfd, const char* host_dir, TransferQueue* q,
+                            TransferResult* result) {
+    if (mkdir(host_dir, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    DirectoryEntryPlus entries[16];
+    char child[4096];
+    int count;
+
+    while ((count = readDirectoryPlus(dirfd, entries, 16)) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (join_path(child, sizeof(child), host_dir, entries[i].name) < 0) {
+                result->skipped++;
+                continue;
+            }
+
+            if (entries[i].type == TYPE_DIRECTORY) {
+                int subdir = openDirectoryAt(dirfd, entries[i].name);
+                if (subdir < 0 || export_directory(subdir, child, q, result) < 0) {
+                    result->failed++;
+                } else {
+                    result->directories++;
+                }
+                if (subdir >= 0) {
+                    closeFile(subdir);
+                }
+                continue;
+            }
+
+            /* Open by inode number: the listing already resolved it */
+            uint8_t* data = malloc(entries[i].size > 0 ? entries[i].size : 1);
+            int fd = data ? openInode(entries[i].inode_num, MODE_READ) : -1;
+            int length = (fd >= 0) ? readFile(fd, data, (uint32_t)entries[i].size) : -1;
+            if (fd >= 0) {
+                closeFile(fd);
+            }
+            if (length < 0) {
+                free(data);
+                result->failed++;
+                continue;
+            }
+
+            pthread_mutex_lock(&q->lock);
+            /* Bound memory: wait while too many files are waiting to be written */
+            while (q->count - q->consumed >= TRANSFER_WINDOW) {
+                pthread_cond_wait(&q->changed, &q->lock);
+            }
+            TransferJob* job = queue_add(q, child);
+            if (job) {
+                job->data = data;
+                job->length = length;
+                pthread_cond_broadcast(&q->changed);
+            }
+            pthread_mutex_unlock(&q->lock);
+
+            if (!job) {
+                free(data);
+                result->failed++;
+            }
+        }
+    }
+
+    return (count < 0) ? -1 : 0;
+}
+
+/* Copy a TinyFS directory tree out to a host directory */
+int tfs_export_tree(const char* tfs_dir, const char* host_dir, TransferResult* result) {
+    if (!host_dir || !tfs_dir || !result) {
+        return -1;
+    }
+    memset(result, 0, sizeof(*result));
+
+    int root = openDirectory(tfs_dir);
+    if (root < 0) {
+        return -1;
+    }
+
+    TransferQueue q;
+    if (queue_init(&q) < 0) {
+        closeFile(root);
+        return -1;
+    }
+
+    pthread_t workers[TRANSFER_MAX_WORKERS];
+    int started = 0;
+    int wanted = worker_count();
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&workers[started], NULL, export_worker, &q) == 0) {
+            started++;
+        }
+    }
+
+    int status = -1;
+    if (started > 0) {
+        status = export_directory(root, host_dir, &q, result);
+    }
+
+    pthread_mutex_lock(&q.lock);
+    q.closed = true;
+    pthread_cond_broadcast(&q.changed);
+    pthread_mutex_unlock(&q.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < q.count; i++) {
+        if (q.jobs[i].length < 0) {
+            result->failed++;
+        } else {
+            result->files++;
+            result->bytes += (uint64_t)q.jobs[i].length;
+        }
+    }
+
+    closeFile(root);
+    queue_destroy(&q);
+    return status;
+}
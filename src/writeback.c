@@ -0,0 +1,284 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/tinyfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+extern Superblock* get_superblock();
+
+#define WRITEBACK_SLICE_BLOCKS 64   /* Block span the flusher writes per hold of the lock */
+
+/* Write-back settings; only the thread driving the file system changes them. The flag is
+ * read unlocked by tfs_lock, and only changes with the lock held */
+static atomic_bool writeback_on = false;
+static uint32_t expire_ms = WRITEBACK_EXPIRE_MS;
+static uint32_t background_percent = WRITEBACK_BACKGROUND_PERCENT;
+static uint32_t limit_percent = WRITEBACK_LIMIT_PERCENT;
+
+/* File system lock, held by API calls and by the flusher while it writes */
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t fs_lock;
+static pthread_cond_t flusher_wake;
+
+/* Flusher state, guarded by fs_lock */
+static pthread_t flusher;
+static bool flusher_stop = false;
+static uint64_t dirty_since = 0;      /* When the oldest unwritten change was made, in ms */
+static bool flushing = false;         /* A flush is writing; its own writes don't count */
+
+/* Create the recursive file system lock and a monotonic condition variable */
+static void init_lock() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&fs_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher_wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+}
+
+/* Monotonic clock in milliseconds */
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+/* Take the file system lock; without write-back there is no second thread to exclude */
+void tfs_lock() {
+    if (writeback_on) {
+        pthread_mutex_lock(&fs_lock);
+    }
+}
+
+void tfs_unlock() {
+    if (writeback_on) {
+        pthread_mutex_unlock(&fs_lock);
+    }
+}
+
+/* Whether block writes are held in the scheduler queue rather than written through.
+ * Zero-copy backends gain nothing from it: a write there is already just a copy */
+bool writeback_caches_blocks() {
+    return writeback_on && !(get_disk_capabilities() & BACKEND_CAP_ZERO_COPY);
+}
+
+bool writeback_enabled() {
+    return writeback_on;
+}
+
+/* Blocks write-back is holding: deferred metadata plus queued block writes */
+uint64_t count_writeback_dirty() {
+    return count_dirty_inode_blocks() + count_dirty_bitmap_blocks() + get_queued_blocks();
+}
+
+/* Write the queued blocks of the data area, leaving metadata queued */
+static int flush_data_blocks() {
+    Superblock* sb = get_superblock();
+    if (sb && get_total_blocks() > sb->data_start_block) {
+        return flush_queued_range(sb->data_start_block, get_total_blocks() - sb->data_start_block);
+    }
+    return 0;
+}
+
+/* Write everything write-back is holding, data blocks before the bitmap and inode blocks
+ * that point at them; the caller holds the file system lock */
+int flush_writeback() {
+    if (flushing) {
+        return 0;
+    }
+    flushing = true;
+    int status = flush_data_blocks();
+    /* Metadata must not reach the disk ahead of data that failed to. The queue dispatches
+     * in block order, so the bitmap goes out before the inode table */
+    if (status == 0 && (flush_inode_table() < 0 || flush_bitmap() < 0 || flush_block_queue() < 0)) {
+        status = -1;
+    }
+    flushing = false;
+    if (status == 0 && count_writeback_dirty() == 0) {
+        dirty_since = 0;
+    }
+    /* Freed blocks are unreferenced on disk now */
+    if (status == 0) {
+        status = flush_due_discards();
+    }
+    return status;
+}
+
+/* Dirty blocks as a share of the budget, the scheduler queue's capacity */
+static bool dirty_over(uint64_t dirty, uint32_t percent) {
+    return dirty * 100 >= (uint64_t)get_block_queue_capacity() * percent;
+}
+
+/* Called after a change was left unwritten: start its age clock, wake the flusher past
+ * the background threshold, and make the writer flush itself past the hard limit. Inside a
+ * batch the metadata is half applied, so only data blocks are flushed */
+void note_writeback_dirty() {
+    if (!writeback_on || flushing) {
+        return;
+    }
+    if (dirty_since == 0) {
+        dirty_since = now_ms();
+        pthread_cond_signal(&flusher_wake);
+    }
+
+    uint64_t dirty = count_writeback_dirty();
+    if (dirty_over(dirty, limit_percent)) {
+        if (tfs_batch_active()) {
+            flushing = true;
+            flush_data_blocks();
+            flushing = false;
+        } else {
+            flush_writeback();
+        }
+        TFS_STAT_ADD(writeback_throttles, 1);
+    } else if (dirty_over(dirty, background_percent)) {
+        pthread_cond_signal(&flusher_wake);
+    }
+}
+
+/* Wake the flusher for background work other than dirty blocks */
+void wake_flusher() {
+    if (writeback_on) {
+        pthread_cond_signal(&flusher_wake);
+    }
+}
+
+/* Flusher step ahead of flush_writeback: write the queued data blocks a slice at a time,
+ * letting API calls in between, so they wait for one slice rather than the whole write-back.
+ * Called and returns with fs_lock held; stops at the first slice that fails */
+static int flush_data_slices() {
+    Superblock* sb = get_superblock();
+    uint64_t cursor = sb ? sb->data_start_block : 0;
+    while (!flusher_stop && (cursor = next_queued_block(cursor)) != UINT64_MAX) {
+        if (flush_queued_range(cursor, WRITEBACK_SLICE_BLOCKS) < 0) {
+            return -1;
+        }
+        cursor += WRITEBACK_SLICE_BLOCKS;
+        pthread_mutex_unlock(&fs_lock);
+        pthread_mutex_lock(&fs_lock);
+    }
+    return 0;
+}
+
+/* Flusher thread: gives back the blocks of deleted snapshots, and sleeps until the oldest
+ * change reaches its age limit or writers pass the background threshold, then writes
+ * everything back */
+static void* flusher_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&fs_lock);
+    while (!flusher_stop) {
+        if (snapshot_reclaim_pending()) {
+            /* A step at a time, letting API calls in between */
+            reclaim_snapshots(SNAPSHOT_RECLAIM_BATCH);
+            pthread_mutex_unlock(&fs_lock);
+            pthread_mutex_lock(&fs_lock);
+            continue;
+        }
+
+        uint64_t dirty = count_writeback_dirty();
+        if (dirty == 0) {
+            dirty_since = 0;
+            pthread_cond_wait(&flusher_wake, &fs_lock);
+            continue;
+        }
+
+        uint64_t now = now_ms();
+        if (dirty_since == 0) {
+            dirty_since = now;
+        }
+        uint64_t due = dirty_since + expire_ms;
+        if (now >= due || dirty_over(dirty, background_percent)) {
+            /* The bulk of the data goes out unlocked between slices; what writers added
+             * meanwhile and the metadata follow under one hold */
+            if (flush_data_slices() < 0 || flush_writeback() < 0) {
+                /* Leave it for the next period rather than spinning on a failing disk */
+                dirty_since = now;
+            }
+            TFS_STAT_ADD(writeback_flushes, 1);
+            continue;
+        }
+
+        struct timespec deadline = {(time_t)(due / 1000), (long)(due % 1000) * 1000000L};
+        pthread_cond_timedwait(&flusher_wake, &fs_lock, &deadline);
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return NULL;
+}
+
+/* Turn write-back on with an age limit in ms and background / hard-limit thresholds in
+ * percent of the dirty budget, or off (writing back whatever it held). Not to be called
+ * while holding the file system lock or inside a batch, which holds it */
+int set_writeback(bool enabled, uint32_t expire, uint32_t background, uint32_t limit) {
+    pthread_once(&lock_once, init_lock);
+    if ((enabled && (expire == 0 || limit == 0 || limit > 100 || background > limit)) ||
+        tfs_batch_active()) {
+        return -1;
+    }
+
+    if (writeback_on) {
+        pthread_mutex_lock(&fs_lock);
+        flusher_stop = true;
+        pthread_cond_signal(&flusher_wake);
+        pthread_mutex_unlock(&fs_lock);
+        pthread_join(flusher, NULL);
+
+        /* Nothing may stay behind once writes go straight to the disk again */
+        pthread_mutex_lock(&fs_lock);
+        flusher_stop = false;
+        int status = flush_writeback();
+        dirty_since = 0;
+        writeback_on = false;
+        pthread_mutex_unlock(&fs_lock);
+        if (status < 0) {
+            return -1;
+        }
+    }
+
+    if (!enabled) {
+        return 0;
+    }
+
+    /* The flag goes up before the flusher exists, so API calls are locked from its start */
+    pthread_mutex_lock(&fs_lock);
+    expire_ms = expire;
+    background_percent = background;
+    limit_percent = limit;
+    writeback_on = true;
+    int status = 0;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+        writeback_on = false;
+        status = -1;
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return status;
+}
+
+/* Get write-back settings */
+void get_writeback(uint32_t* expire, uint32_t* background, uint32_t* limit) {
+    if (expire) {
+        *expire = expire_ms;
+    }
+    if (background) {
+        *background = background_percent;
+    }
+    if (limit) {
+        *limit = limit_percent;
+    }
+}
+
+/* Write all deferred metadata and queued blocks and wait until the disk has them */
+int tfs_sync() {
+    tfs_lock();
+    int status = (flush_writeback() < 0 || flush_disk() < 0) ? -1 : 0;
+    tfs_unlock();
+    return status;
+}